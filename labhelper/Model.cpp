@@ -11,7 +11,7 @@
 
 namespace labhelper
 {
-	bool Texture::load(const std::string & _filename, int _components) {
+	bool Texture::load(const std::string & _filename, int _components, bool upload_to_gpu) {
 		filename = _filename;
 		valid = true; 
 		int components; 
@@ -20,6 +20,10 @@ namespace labhelper
 			std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << "\n";
 			exit(1);
 		}
+		if (!upload_to_gpu) {
+			gl_id = 0;
+			return true;
+		}
 		glGenTextures(1, &gl_id);
 		glBindTexture(GL_TEXTURE_2D, gl_id);
 		GLenum format, internal_format;
@@ -45,6 +49,7 @@ namespace labhelper
 	///////////////////////////////////////////////////////////////////////////
 	Model::~Model()
 	{
+		if (!m_on_gpu) return;
 		for (auto & material : m_materials) {
 			if (material.m_color_texture.valid) glDeleteTextures(1, &material.m_color_texture.gl_id);
 			if (material.m_reflectivity_texture.valid) glDeleteTextures(1, &material.m_reflectivity_texture.gl_id);
@@ -58,7 +63,7 @@ namespace labhelper
 		glDeleteBuffers(1, &m_texture_coordinates_bo);
 	}
 
-	Model * loadModelFromOBJ(std::string path)
+	Model * loadModelFromOBJ(std::string path, bool upload_to_gpu)
 	{
 		///////////////////////////////////////////////////////////////////////
 		// Separate filename into directory, base filename and extension
@@ -111,27 +116,27 @@ namespace labhelper
 			material.m_name = m.name;
 			material.m_color = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
 			if (m.diffuse_texname != "") { 
-				material.m_color_texture.load(directory + m.diffuse_texname, 4);
+				material.m_color_texture.load(directory + m.diffuse_texname, 4, upload_to_gpu);
 			}
 			material.m_reflectivity = m.specular[0];
 			if (m.specular_texname != "") {
-				material.m_reflectivity_texture.load(directory + m.specular_texname, 1);
+				material.m_reflectivity_texture.load(directory + m.specular_texname, 1, upload_to_gpu);
 			}
 			material.m_metalness = m.metallic;
 			if (m.metallic_texname != "") {
-				material.m_metalness_texture.load(directory + m.metallic_texname, 1);
+				material.m_metalness_texture.load(directory + m.metallic_texname, 1, upload_to_gpu);
 			}
 			material.m_fresnel = m.sheen; 
 			if (m.sheen_texname != "") {
-				material.m_fresnel_texture.load(directory + m.sheen_texname, 1);
+				material.m_fresnel_texture.load(directory + m.sheen_texname, 1, upload_to_gpu);
 			}
 			material.m_shininess = m.roughness;
 			if (m.roughness_texname != "") {
-				material.m_fresnel_texture.load(directory + m.sheen_texname, 1);
+				material.m_fresnel_texture.load(directory + m.sheen_texname, 1, upload_to_gpu);
 			}
 			material.m_emission = m.emission[0];
 			if (m.emissive_texname != "") {
-				material.m_emission_texture.load(directory + m.emissive_texname, 4);
+				material.m_emission_texture.load(directory + m.emissive_texname, 4, upload_to_gpu);
 			}
 			material.m_transparency = m.transmittance[0]; 
 			model->m_materials.push_back(material);
@@ -146,6 +151,9 @@ namespace labhelper
 		for (const auto & shape : shapes) {
 			number_of_vertices += shape.mesh.indices.size(); 
 		}
+		// The pathtracer shares the positions with Embree, which reads 4 bytes
+		// past the last one
+		model->m_positions.reserve(number_of_vertices + 1);
 		model->m_positions.resize(number_of_vertices);
 		model->m_normals.resize(number_of_vertices);
 		model->m_texture_coordinates.resize(number_of_vertices);
@@ -274,6 +282,11 @@ namespace labhelper
 		///////////////////////////////////////////////////////////////////////
 		// Upload to GPU
 		///////////////////////////////////////////////////////////////////////
+		model->m_on_gpu = upload_to_gpu;
+		if (!upload_to_gpu) {
+			std::cout << "done.\n";
+			return model;
+		}
 		glGenVertexArrays(1, &model->m_vaob);
 		glBindVertexArray(model->m_vaob);
 		glGenBuffers(1, &model->m_positions_bo);
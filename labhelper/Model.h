@@ -11,7 +11,9 @@ namespace labhelper
 		std::string filename;
 		int width, height;
 		uint8_t * data;
-		bool load(const std::string & filename, int nof_components);
+		// With upload_to_gpu false only the CPU copy in data is created (for
+		// headless programs that have no GL context)
+		bool load(const std::string & filename, int nof_components, bool upload_to_gpu = true);
 	};
 	//////////////////////////////////////////////////////////////////////////////
 	// This material class implements a subset of the suggested PBR extension
@@ -70,9 +72,11 @@ namespace labhelper
 		uint32_t m_texture_coordinates_bo;
 		// Vertex Array Object
 		uint32_t m_vaob;
+		// False if the model was loaded without a GL context
+		bool m_on_gpu = true;
 	};
 
-	Model * loadModelFromOBJ(std::string filename);
+	Model * loadModelFromOBJ(std::string filename, bool upload_to_gpu = true);
 	void saveModelToOBJ(Model * model, std::string filename);
 	void freeModel(Model * model);
 	void render(const Model * model, const bool submitMaterials = true); 
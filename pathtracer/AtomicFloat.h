@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// A float that can be added to concurrently from many threads, and that
+	// can be copied (which std::atomic can not) when no one is writing to it.
+	///////////////////////////////////////////////////////////////////////////
+	struct AtomicFloat
+	{
+		std::atomic<float> value;
+		AtomicFloat(float v = 0.0f) : value(v) {}
+		AtomicFloat(const AtomicFloat & other) : value(other.get()) {}
+		AtomicFloat & operator=(const AtomicFloat & other) { value.store(other.get(), std::memory_order_relaxed); return *this; }
+		float get() const { return value.load(std::memory_order_relaxed); }
+		void add(float x) {
+			float current = value.load(std::memory_order_relaxed);
+			while (!value.compare_exchange_weak(current, current + x, std::memory_order_relaxed)) {}
+		}
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// A float accumulated in 64 bit fixed point. Integer addition is
+	// associative, so unlike with AtomicFloat the sum does not depend on the
+	// order in which threads add to it. Values are rounded to multiples of
+	// 2^-20 and sums should stay below 2^42.
+	///////////////////////////////////////////////////////////////////////////
+	struct AtomicFixed
+	{
+		std::atomic<int64_t> value;
+		AtomicFixed(float v = 0.0f) : value(toFixed(v)) {}
+		AtomicFixed(const AtomicFixed & other) : value(other.value.load(std::memory_order_relaxed)) {}
+		AtomicFixed & operator=(const AtomicFixed & other) { value.store(other.value.load(std::memory_order_relaxed), std::memory_order_relaxed); return *this; }
+		float get() const { return float(double(value.load(std::memory_order_relaxed)) * (1.0 / 1048576.0)); }
+		void add(float x) { value.fetch_add(toFixed(x), std::memory_order_relaxed); }
+		static int64_t toFixed(float x) {
+			// Clamped so that even a few thousand huge values can not overflow
+			const double v = double(x) * 1048576.0;
+			if (!(v == v)) return 0;
+			return int64_t(std::llround(std::min(std::max(v, -1e15), 1e15)));
+		}
+	};
+}
@@ -6,6 +6,16 @@
 #include "material.h"
 #include "embree.h"
 #include "sampling.h"
+#include "guiding.h"
+#include "camera.h"
+#include "bdpt.h"
+#include "sppm.h"
+#include "radiance_cache.h"
+#include "gbuffer.h"
+#include "reprojection.h"
+#include "texture.h"
+#include "profiling.h"
+#include <stb_image_write.h>
 
 using namespace std; 
 using namespace glm; 
@@ -19,6 +29,7 @@ namespace pathtracer
 	Environment environment; 
 	Image rendered_image; 
 	PointLight point_light; 
+	std::atomic<bool> cancel_tracing(false);
 
 	///////////////////////////////////////////////////////////////////////////
 	// Restart rendering of image
@@ -29,59 +40,241 @@ namespace pathtracer
 		rendered_image.number_of_samples = 0; 
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Fill a row of a resized image with zeros, or with the old image scaled
+	// to the new size (nearest neighbour) if there is one
+	///////////////////////////////////////////////////////////////////////////
+	static void fillRow(int y, const PixelBuffer & old_data, int old_width, int old_height)
+	{
+		auto row = rendered_image.data.begin() + y * rendered_image.width;
+		if (old_data.empty()) {
+			std::fill(row, row + rendered_image.width, vec3(0.0f));
+			return;
+		}
+		const int old_y = y * old_height / rendered_image.height;
+		for (int x = 0; x < rendered_image.width; x++) {
+			row[x] = old_data[old_y * old_width + x * old_width / rendered_image.width];
+		}
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// On window resize, window size is passed in, actual size of pathtraced
 	// image may be smaller (if we're subsampling for speed)
 	///////////////////////////////////////////////////////////////////////////
 	void resize(int w, int h)
 	{
+		// With a crop region, the pixels outside of it keep showing the old
+		// image
+		const int old_width = rendered_image.width, old_height = rendered_image.height;
+		PixelBuffer old_data;
+		if (settings.use_crop) old_data.swap(rendered_image.data);
 		rendered_image.width = w / settings.subsampling; 
 		rendered_image.height = h / settings.subsampling; 
-		rendered_image.data.resize(rendered_image.width * rendered_image.height);
+		// A new buffer, so that its pages have not been touched yet (the
+		// allocator does not write to new pixels). Each row is then placed on
+		// the NUMA node of the thread that will trace it.
+		PixelBuffer(rendered_image.width * rendered_image.height).swap(rendered_image.data);
+		if (numa_settings.first_touch) {
+#pragma omp parallel for schedule(static)
+			for (int y = 0; y < rendered_image.height; y++) {
+				fillRow(y, old_data, old_width, old_height);
+			}
+		}
+		else {
+			for (int y = 0; y < rendered_image.height; y++) {
+				fillRow(y, old_data, old_width, old_height);
+			}
+		}
 		restart(); 
 	}
 
 	///////////////////////////////////////////////////////////////////////////
-	// Return the radiance from a certain direction wi from the environment
-	// map. 
+	// The pixels that a pass traces, [x, z) x [y, w): the crop region, or
+	// the whole image
 	///////////////////////////////////////////////////////////////////////////
-	vec3 Lenvironment(const vec3 & wi) {
+	static ivec4 tracedRegion()
+	{
+		const int w = rendered_image.width, h = rendered_image.height;
+		if (!settings.use_crop) return ivec4(0, 0, w, h);
+		const int x0 = clamp(int(floor(settings.crop_min.x * w)), 0, w);
+		const int y0 = clamp(int(floor(settings.crop_min.y * h)), 0, h);
+		return ivec4(x0, y0, clamp(int(ceil(settings.crop_max.x * w)), x0, w), clamp(int(ceil(settings.crop_max.y * h)), y0, h));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The environment map in direction wi, before the multiplier is applied
+	///////////////////////////////////////////////////////////////////////////
+	static vec3 environmentMapRadiance(const vec3 & wi) {
+		PROFILE_SCOPE(PROFILE_ENVIRONMENT);
+		PROFILE_COUNT(PROFILE_ENVIRONMENT_LOOKUPS, 1);
 		const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
 		float phi = atan(wi.z, wi.x);
 		if (phi < 0.0f) phi = phi + 2.0f * M_PI;
 		vec2 lookup = vec2(phi / (2.0 * M_PI), theta / M_PI);
-		return environment.multiplier * environment.map.sample(lookup.x, lookup.y);
+		return environment.map.sample(lookup.x, lookup.y);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Return the radiance from a certain direction wi from the environment
+	// map. 
+	///////////////////////////////////////////////////////////////////////////
+	vec3 Lenvironment(const vec3 & wi) {
+		return environment.multiplier * environmentMapRadiance(wi);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Offset a ray origin from a surface, to the side that wi points to, so 
+	// that the new ray does not hit the surface it starts on.
+	///////////////////////////////////////////////////////////////////////////
+	vec3 offsetRayOrigin(const Intersection & hit, const vec3 & wi) {
+		return hit.position + EPSILON * (dot(wi, hit.geometry_normal) > 0.0f ? 1.0f : -1.0f) * hit.geometry_normal;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// A vertex along a path, kept so that the radiance that eventually 
+	// arrives at it can be used to train the path guiding distribution.
+	///////////////////////////////////////////////////////////////////////////
+	struct GuidingVertex {
+		vec3 position;
+		vec3 wi;
+		// Path throughput after the bounce at this vertex
+		vec3 throughput;
+		// Radiance that has arrived at this vertex from direction wi
+		vec3 radiance;
+		// The (combined) pdf with which wi was sampled
+		float wi_pdf;
+	};
+	const int max_guiding_vertices = 32;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add a contribution that reached the camera through all guiding vertices
+	///////////////////////////////////////////////////////////////////////////
+	static void addToGuidingVertices(GuidingVertex * vertices, int nof_vertices, const vec3 & contribution) {
+		for (int i = 0; i < nof_vertices; i++) {
+			const vec3 & t = vertices[i].throughput;
+			vertices[i].radiance += vec3(t.x > 0.0f ? contribution.x / t.x : 0.0f,
+				t.y > 0.0f ? contribution.y / t.y : 0.0f,
+				t.z > 0.0f ? contribution.z / t.z : 0.0f);
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Calculate the radiance going from one point (r.hitPosition()) in one 
 	// direction (-r.d), through path tracing.  
 	///////////////////////////////////////////////////////////////////////////
-	vec3 Li(Ray & primary_ray) {
+	vec3 Li(Ray & primary_ray, const RayDifferential * primary_differential) {
 		vec3 L = vec3(0.0f);
 		vec3 path_throughput = vec3(1.0);
 		Ray current_ray = primary_ray;
+		RayDifferential differential;
+		if (primary_differential) differential = *primary_differential;
+
+		// Path guiding: sample from the SD-tree once it has learned something
+		// and record the radiance along the path while it is training.
+		const bool guide = settings.path_guiding && sd_tree.canSample();
+		const bool train = settings.path_guiding && sd_tree.isTraining();
+		GuidingVertex guiding_vertices[max_guiding_vertices];
+		int nof_guiding_vertices = 0;
+
+		for (int bounces = 0; bounces < settings.max_bounces; bounces++) {
+			///////////////////////////////////////////////////////////////////
+			// Get the intersection information from the ray
+			///////////////////////////////////////////////////////////////////
+			Intersection hit = getIntersection(current_ray);
+			PROFILE_COUNT(PROFILE_PATH_VERTICES, 1);
+			if (primary_differential) transferDifferential(differential, current_ray, hit);
+			///////////////////////////////////////////////////////////////////
+			// Create a Material tree for evaluating brdfs and calculating
+			// sample directions. 
+			///////////////////////////////////////////////////////////////////
+			const vec3 color = baseColor(hit);
+			Diffuse diffuse(color);
+			BRDF & mat = diffuse;
+			///////////////////////////////////////////////////////////////////
+			// Calculate Direct Illumination from light.
+			///////////////////////////////////////////////////////////////////
+			{
+				const float distance_to_light = length(point_light.position - hit.position);
+				const float falloff_factor = 1.0f / (distance_to_light*distance_to_light);
+				vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
+				vec3 wi = normalize(point_light.position - hit.position);
+				Ray shadow_ray(offsetRayOrigin(hit, wi), wi, 0.0f, distance_to_light);
+				if (!occluded(shadow_ray)) {
+					vec3 brdf;
+					{
+						PROFILE_SCOPE(PROFILE_BRDF);
+						brdf = mat.f(wi, hit.wo, hit.shading_normal);
+					}
+					vec3 contribution = path_throughput * brdf * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+					L += contribution;
+					addToGuidingVertices(guiding_vertices, nof_guiding_vertices, contribution);
+				}
+			}
+			///////////////////////////////////////////////////////////////////
+			// Add emitted radiance from the surface
+			///////////////////////////////////////////////////////////////////
+			{
+				vec3 contribution = path_throughput * hit.material->m_emission * color;
+				L += contribution;
+				addToGuidingVertices(guiding_vertices, nof_guiding_vertices, contribution);
+			}
+			///////////////////////////////////////////////////////////////////
+			// Sample an incoming direction. With path guiding we pick either
+			// the brdf or the learned distribution, and weight the result 
+			// with the combined pdf (one-sample MIS).
+			///////////////////////////////////////////////////////////////////
+			vec3 wi;
+			float pdf;
+			vec3 brdf;
+			{
+				PROFILE_SCOPE(PROFILE_BRDF);
+				if (guide) {
+					const float alpha = guiding_settings.bsdf_sampling_fraction;
+					float brdf_pdf, guide_pdf;
+					if (randf() < alpha) {
+						brdf = mat.sample_wi(wi, hit.wo, hit.shading_normal, brdf_pdf);
+						if (brdf_pdf == 0.0f) break;
+						guide_pdf = sd_tree.pdf(hit.position, wi);
+					}
+					else {
+						wi = sd_tree.sample(hit.position, guide_pdf);
+						brdf_pdf = mat.pdf(wi, hit.wo, hit.shading_normal);
+						brdf = mat.f(wi, hit.wo, hit.shading_normal);
+					}
+					pdf = alpha * brdf_pdf + (1.0f - alpha) * guide_pdf;
+				}
+				else {
+					brdf = mat.sample_wi(wi, hit.wo, hit.shading_normal, pdf);
+				}
+			}
+			if (pdf < EPSILON) break;
+			const float cosineterm = abs(dot(wi, hit.shading_normal));
+			path_throughput = path_throughput * (brdf * cosineterm) / pdf;
+			if (path_throughput == vec3(0.0f)) break;
+			if (primary_differential) diffuseDifferential(differential, hit, wi);
+			if (train && nof_guiding_vertices < max_guiding_vertices) {
+				guiding_vertices[nof_guiding_vertices++] = { hit.position, wi, path_throughput, vec3(0.0f), pdf };
+			}
+			///////////////////////////////////////////////////////////////////
+			// Follow the path, or pick up the environment if it escapes
+			///////////////////////////////////////////////////////////////////
+			current_ray = Ray(offsetRayOrigin(hit, wi), wi);
+			if (!intersect(current_ray)) {
+				vec3 contribution = path_throughput * Lenvironment(current_ray.d);
+				L += contribution;
+				addToGuidingVertices(guiding_vertices, nof_guiding_vertices, contribution);
+				break;
+			}
+		}
 
-		///////////////////////////////////////////////////////////////////
-		// Get the intersection information from the ray
-		///////////////////////////////////////////////////////////////////
-		Intersection hit = getIntersection(current_ray);
-		///////////////////////////////////////////////////////////////////
-		// Create a Material tree for evaluating brdfs and calculating
-		// sample directions. 
-		///////////////////////////////////////////////////////////////////
-
-		Diffuse diffuse(hit.material->m_color);
-		BRDF & mat = diffuse;
-		///////////////////////////////////////////////////////////////////
-		// Calculate Direct Illumination from light.
-		///////////////////////////////////////////////////////////////////
-		{
-			const float distance_to_light = length(point_light.position - hit.position);
-			const float falloff_factor = 1.0f / (distance_to_light*distance_to_light);
-			vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
-			vec3 wi = normalize(point_light.position - hit.position);
-			L = mat.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+		///////////////////////////////////////////////////////////////////////
+		// Train the guiding distribution with the radiance that arrived at 
+		// each vertex, divided by the pdf it was sampled with.
+		///////////////////////////////////////////////////////////////////////
+		for (int i = 0; i < nof_guiding_vertices; i++) {
+			const vec3 & radiance = guiding_vertices[i].radiance;
+			const float luminance = dot(radiance, vec3(0.2126f, 0.7152f, 0.0722f));
+			sd_tree.record(guiding_vertices[i].position, guiding_vertices[i].wi, luminance / guiding_vertices[i].wi_pdf);
 		}
 		// Return the final outgoing radiance for the primary ray
 		return L;
@@ -93,50 +286,184 @@ namespace pathtracer
 	void tracePaths(vec3 camera_pos, vec3 camera_dir, vec3 camera_up)
 	{
 		// Calculate where to shoot rays from the camera
-		vec3 camera_right = normalize(cross(camera_dir, camera_up));
-		camera_up = normalize(cross(camera_right, camera_dir));
 		float camera_fov = 45.0f;
 		float camera_aspectRatio = float(rendered_image.width) / float(rendered_image.height);
-		// Calculate the lower left corner of a virtual screen, a vector X
-		// that points from there to the lower left corner, and a vector Y
-		// that points to the upper left corner
-		glm::vec3 A = camera_dir * cos(camera_fov / 2.0f * (M_PI / 180.0f));
-		glm::vec3 B = camera_up * sin(camera_fov / 2.0f * (M_PI / 180.0f));
-		glm::vec3 C = camera_right * sin(camera_fov / 2.0f * (M_PI / 180.0f)) * camera_aspectRatio;
-		glm::vec3 lower_right_corner = A - C - B;
-		glm::vec3 X = 2.0f * ((A - B) - lower_right_corner);
-		glm::vec3 Y = 2.0f * ((A - C) - lower_right_corner);
+		Camera camera(camera_pos, camera_dir, camera_up, camera_fov, camera_aspectRatio, settings.projection);
 		// Stop here if we have as many samples as we want
 		if ((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel) &&
 			(settings.max_paths_per_pixel != 0)) return;
+		beginProfiledPass();
+		// The guiding distribution lives in world space and survives restarts,
+		// so it is only created once
+		if (settings.path_guiding && !sd_tree.isInitialized()) {
+			vec3 bounds_min, bounds_max;
+			getSceneBounds(bounds_min, bounds_max);
+			sd_tree.reset(bounds_min, bounds_max);
+		}
+		const bool bidirectional = settings.integrator == BIDIRECTIONAL_PATH_TRACING;
+		if (bidirectional) clearSplats(rendered_image.width, rendered_image.height);
+		// Photon mapping keeps its own per pixel statistics and only needs the
+		// photons of this pass before the camera rays are traced.
+		const bool photon_mapping = settings.integrator == PHOTON_MAPPING;
+		if (photon_mapping) {
+			beginPhotonMappingPass(rendered_image.width, rendered_image.height, rendered_image.number_of_samples == 0);
+		}
+		// The radiance cache is also kept over restarts. New records are only
+		// created on a sparse (randomly offset) lattice of pixels per pass.
+		const bool deterministic = settings.deterministic;
+		const bool use_radiance_cache = settings.use_radiance_cache && settings.integrator == PATH_TRACING && !deterministic;
+		if (use_radiance_cache && !radiance_cache.isInitialized()) {
+			vec3 bounds_min, bounds_max;
+			getSceneBounds(bounds_min, bounds_max);
+			radiance_cache.reset(bounds_min, bounds_max);
+		}
+		if (use_radiance_cache) radiance_cache.beginPass();
+		const int record_stride = std::max(1, radiance_cache_settings.record_stride);
+		const int record_x = int(randf() * record_stride) % record_stride;
+		const int record_y = int(randf() * record_stride) % record_stride;
+		// The first hits of the camera rays are kept while the camera does
+		// not move, so that restarts after material and light edits only
+		// trace from the first hit on
+		const ivec4 region = tracedRegion();
+		const bool use_gbuffer = settings.use_gbuffer && settings.integrator == PATH_TRACING;
+		int gbuffer_sample = 0;
+		bool gbuffer_cached = false;
+		if (use_gbuffer) {
+			gbuffer.update(camera, rendered_image.width, rendered_image.height, region);
+			gbuffer_sample = gbuffer.sampleIndex(rendered_image.number_of_samples);
+			gbuffer_cached = gbuffer.isCached(gbuffer_sample);
+		}
+		else if (gbuffer.memoryUsage() > 0) {
+			gbuffer.clear();
+		}
+		// (The history outside of a crop region would be from another view)
+		const bool use_reprojection = settings.use_reprojection && settings.integrator == PATH_TRACING && !settings.use_crop;
+		bool reproject = false;
+		if (use_reprojection) {
+			reproject = reprojection.beginPass(camera);
+		}
+		else if (reprojection.isActive()) {
+			reprojection.clear();
+		}
 		// Trace one path per pixel (the omp parallel stuf magically distributes the 
 		// pathtracing on all cores of your CPU).
-#pragma omp parallel for
-		for (int y = 0; y < rendered_image.height; y++) {
-			for (int x = 0; x < rendered_image.width; x++) {
+#pragma omp parallel for schedule(static)
+		for (int y = region.y; y < region.w; y++) {
+			for (int x = region.x; x < region.z; x++) {
+				if (cancel_tracing.load(std::memory_order_relaxed)) break;
+				const int pixel = y * rendered_image.width + x;
+				if (deterministic) {
+					beginSampleStream(settings.seed, uint32_t(y * rendered_image.width + x), uint32_t(rendered_image.number_of_samples));
+				}
+				PROFILE_COUNT(PROFILE_CAMERA_SAMPLES, 1);
 				vec3 color;
 				Ray primaryRay;
-				primaryRay.o = camera_pos;
-				// Create a ray that starts in the camera position and points toward
-				// the current pixel on a virtual screen. 
-				vec2 screenCoord = vec2(float(x) / float(rendered_image.width), float(y) / float(rendered_image.height));
-				primaryRay.d = normalize(lower_right_corner + screenCoord.x * X + screenCoord.y * Y);
-				// Intersect ray with scene
-				if (intersect(primaryRay)) {
+				RayDifferential differential;
+				vec2 screenCoord;
+				{
+					PROFILE_SCOPE(PROFILE_RAY_GENERATION);
+					primaryRay.o = camera_pos;
+					// Create a ray that starts in the camera position and points toward
+					// a random position in the current pixel on a virtual screen. 
+					// (The light tracing strategies of the bidirectional integrator
+					// estimate the average over the pixel, so camera rays must too).
+					if (gbuffer_cached) {
+						screenCoord = gbuffer.firstHit(pixel, gbuffer_sample).screen_coord;
+					}
+					else {
+						screenCoord = vec2((float(x) + randf()) / float(rendered_image.width), 
+							(float(y) + randf()) / float(rendered_image.height));
+					}
+					primaryRay.d = camera.rayDirection(screenCoord);
+					// The pixel footprint, used to pick texture mip levels
+					differential = camera.rayDifferential(screenCoord, rendered_image.width, rendered_image.height);
+				}
+				if (photon_mapping) {
+					// The returned value is already the progressive estimate
+					rendered_image.data[y * rendered_image.width + x] = LiPhotonMapping(primaryRay, y * rendered_image.width + x, differential);
+					if (deterministic) endSampleStream();
+					continue;
+				}
+				if (bidirectional) {
+					color = LiBidirectional(primaryRay, camera);
+				}
+				// Intersect ray with scene (or take the hit from the G-buffer)
+				else if (gbuffer_cached ? gbuffer.restoreFirstHit(pixel, gbuffer_sample, primaryRay) : intersect(primaryRay)) {
+					if (use_gbuffer && !gbuffer_cached) gbuffer.storeFirstHit(pixel, gbuffer_sample, screenCoord, primaryRay);
 					// If it hit something, evaluate the radiance from that point
-					color = Li(primaryRay);
+					if (use_radiance_cache) {
+						color = LiRadianceCache(primaryRay, differential, x % record_stride == record_x && y % record_stride == record_y);
+					}
+					else {
+						color = Li(primaryRay, &differential);
+					}
 				}
 				else {
 					// Otherwise evaluate environment
-					color = Lenvironment(primaryRay.d);
+					if (gbuffer_cached) {
+						color = environment.multiplier * gbuffer.firstHit(pixel, gbuffer_sample).n;
+					}
+					else if (use_gbuffer) {
+						const vec3 radiance = environmentMapRadiance(primaryRay.d);
+						gbuffer.storeMiss(pixel, gbuffer_sample, screenCoord, radiance);
+						color = environment.multiplier * radiance;
+					}
+					else {
+						color = Lenvironment(primaryRay.d);
+					}
 				}
 				// Accumulate the obtained radiance to the pixels color
-				float n = float(rendered_image.number_of_samples);
-				rendered_image.data[y * rendered_image.width + x] =
-					rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f)) +
-					(1.0f / (n + 1.0f)) * color;
+				{
+					PROFILE_SCOPE(PROFILE_ACCUMULATION);
+					if (use_reprojection) {
+						// Pixels keep their own number of samples
+						const bool hit = primaryRay.geomID != RTC_INVALID_GEOMETRY_ID;
+						reprojection.accumulate(pixel, color, hit, hit ? primaryRay.o + primaryRay.tfar * primaryRay.d : primaryRay.d,
+							hit ? normalize(primaryRay.n) : vec3(0.0f), reproject);
+					}
+					else {
+						float n = float(rendered_image.number_of_samples);
+						rendered_image.data[y * rendered_image.width + x] =
+							rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f)) +
+							(1.0f / (n + 1.0f)) * color;
+					}
+				}
+				if (deterministic) endSampleStream();
 			}
 		}
+		if (cancel_tracing.load()) {
+			endProfiledPass(rendered_image.number_of_samples);
+			return;
+		}
+		// Light tracing contributions can land on any pixel, so they are 
+		// added once all threads are done. The estimate assumes one light
+		// path per pixel of the image, but with a crop region only the
+		// pixels in it traced one.
+		if (bidirectional) {
+			PROFILE_SCOPE(PROFILE_ACCUMULATION);
+			const float traced_pixels = float(region.z - region.x) * float(region.w - region.y);
+			const float light_path_scale = traced_pixels > 0.0f ? float(rendered_image.width * rendered_image.height) / traced_pixels : 0.0f;
+			addSplats(rendered_image.data, light_path_scale / float(rendered_image.number_of_samples + 1), region);
+		}
 		rendered_image.number_of_samples += 1;
+		if (settings.path_guiding) sd_tree.endPass();
+		if (use_radiance_cache) radiance_cache.endPass();
+		if (use_gbuffer && !gbuffer_cached) gbuffer.endPass(gbuffer_sample);
+		if (use_reprojection) reprojection.endPass();
+		endProfiledPass(rendered_image.number_of_samples);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Write the rendered image to a Radiance .hdr file
+	///////////////////////////////////////////////////////////////////////////
+	bool saveImage(const std::string & filename)
+	{
+		// The first row of rendered_image is the bottom of the screen
+		const int w = rendered_image.width, h = rendered_image.height;
+		vector<vec3> flipped(rendered_image.data.size());
+		for (int y = 0; y < h; y++) {
+			std::copy(rendered_image.data.begin() + (h - 1 - y) * w, rendered_image.data.begin() + (h - y) * w, flipped.begin() + y * w);
+		}
+		return stbi_write_hdr(filename.c_str(), w, h, 3, &flipped[0].x) != 0;
 	}
 };
@@ -1,9 +1,14 @@
 #pragma once
 #include <glm/glm.hpp>
 #include <vector>
+#include <atomic>
+#include <stdint.h>
 #include <Model.h>
 #include <omp.h>
 #include "HDRImage.h"
+#include "embree.h"
+#include "raydifferential.h"
+#include "numa.h"
 
 #ifdef M_PI
 #undef M_PI
@@ -15,6 +20,15 @@ using namespace glm;
 
 namespace pathtracer
 {
+	///////////////////////////////////////////////////////////////////////////////
+	// Available integrators
+	///////////////////////////////////////////////////////////////////////////////
+	enum Integrator {
+		PATH_TRACING = 0,
+		BIDIRECTIONAL_PATH_TRACING = 1,
+		PHOTON_MAPPING = 2
+	};
+
 	///////////////////////////////////////////////////////////////////////////////
 	// Path Tracer settings
 	///////////////////////////////////////////////////////////////////////////////
@@ -22,6 +36,31 @@ namespace pathtracer
 		int subsampling;
 		int max_bounces;
 		int max_paths_per_pixel;
+		bool path_guiding;
+		int integrator;
+		// Shade primary hits from the world space radiance cache (path
+		// tracing integrator only)
+		bool use_radiance_cache;
+		// Keep the first hits of the camera rays in the G-buffer (path
+		// tracing integrator only), see gbuffer.h
+		bool use_gbuffer;
+		// Warp the image into the new view when the camera moves, instead
+		// of restarting (path tracing integrator only), see reprojection.h
+		bool use_reprojection;
+		// Only trace the pixels in [crop_min, crop_max) (screen coordinates,
+		// in [0,1]^2 from the lower left corner). The other pixels keep what
+		// was traced before. Disables reprojection.
+		bool use_crop;
+		vec2 crop_min, crop_max;
+		// Take every sample with random numbers that only depend on (seed,
+		// pixel, sample index), so that the image is the same for any
+		// number of threads. Disables the radiance cache, whose contents
+		// depend on the order in which pixels are traced.
+		bool deterministic;
+		uint32_t seed;
+		// The camera model (see Projection in camera.h). The panoramas
+		// ignore the field of view and the aspect ratio of the image.
+		int projection;
 	} settings; 
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -37,7 +76,9 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	extern struct Image {
 		int width, height, number_of_samples = 0; 
-		std::vector<glm::vec3> data;
+		// Rows are traced with a static schedule, and the first thread to
+		// touch them (see resize()) owns them on NUMA machines
+		PixelBuffer data;
 		float * getPtr() { return &data[0].x; }
 	} rendered_image;
 
@@ -50,6 +91,19 @@ namespace pathtracer
 		vec3  position;
 	} point_light;
 
+	///////////////////////////////////////////////////////////////////////////
+	// Return the radiance from a certain direction wi from the environment
+	// map. 
+	///////////////////////////////////////////////////////////////////////////
+	vec3 Lenvironment(const vec3 & wi);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Calculate the radiance going from one point (r.hitPosition()) in one 
+	// direction (-r.d), through path tracing. If a differential is given for
+	// the primary ray, it is tracked along the path to filter textures.
+	///////////////////////////////////////////////////////////////////////////
+	vec3 Li(Ray & primary_ray, const RayDifferential * primary_differential = nullptr);
+
 	///////////////////////////////////////////////////////////////////////////
 	// Restart rendering of image
 	///////////////////////////////////////////////////////////////////////////
@@ -57,13 +111,27 @@ namespace pathtracer
 
 	///////////////////////////////////////////////////////////////////////////
 	// On window resize, window size is passed in, actual size of pathtraced
-	// image may be smaller (if we're subsampling for speed)
+	// image may be smaller (if we're subsampling for speed). With a crop
+	// region, the old image is scaled to the new size instead of cleared.
 	///////////////////////////////////////////////////////////////////////////
 	void resize(int w, int h);
 
+	///////////////////////////////////////////////////////////////////////////
+	// Set (from any thread) to stop the pass that is being traced. The
+	// remaining pixels are skipped and the pass is not counted, so the image
+	// must be restarted after a cancelled pass. tracePaths() does not clear
+	// it.
+	///////////////////////////////////////////////////////////////////////////
+	extern std::atomic<bool> cancel_tracing;
+
 	///////////////////////////////////////////////////////////////////////////
 	// Trace one path per pixel
 	///////////////////////////////////////////////////////////////////////////
 	void tracePaths(vec3 camera_pos, vec3 camera_dir, vec3 camera_up);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Write the rendered image to a Radiance .hdr file
+	///////////////////////////////////////////////////////////////////////////
+	bool saveImage(const std::string & filename);
 };
 
@@ -0,0 +1,321 @@
+#include "bdpt.h"
+#include "Pathtracer.h"
+#include "material.h"
+#include "sampling.h"
+#include "texture.h"
+#include "AtomicFloat.h"
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Light tracing contributions. Any thread may splat to any pixel, so the
+	// buffer is accumulated with atomic adds (in fixed point, so that the
+	// result does not depend on the order of the adds).
+	///////////////////////////////////////////////////////////////////////////
+	struct SplatBuffer {
+		int width = 0, height = 0;
+		std::vector<AtomicFixed> data;
+	} splat_buffer;
+
+	void clearSplats(int width, int height)
+	{
+		splat_buffer.width = width;
+		splat_buffer.height = height;
+		splat_buffer.data.assign(width * height * 3, AtomicFixed(0.0f));
+	}
+
+	void addSplats(PixelBuffer & image, float weight, const ivec4 & region)
+	{
+#pragma omp parallel for schedule(static)
+		for (int y = region.y; y < region.w; y++) {
+			for (int x = region.x; x < region.z; x++) {
+				const int i = y * splat_buffer.width + x;
+				image[i] += weight * vec3(splat_buffer.data[i * 3 + 0].get(),
+					splat_buffer.data[i * 3 + 1].get(), splat_buffer.data[i * 3 + 2].get());
+			}
+		}
+	}
+
+	static void splat(const vec2 & screen_coord, const vec3 & L)
+	{
+		const int x = std::min(int(screen_coord.x * splat_buffer.width), splat_buffer.width - 1);
+		const int y = std::min(int(screen_coord.y * splat_buffer.height), splat_buffer.height - 1);
+		const int i = (y * splat_buffer.width + x) * 3;
+		splat_buffer.data[i + 0].add(L.x);
+		splat_buffer.data[i + 1].add(L.y);
+		splat_buffer.data[i + 2].add(L.z);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// A vertex of a camera or light subpath. The first vertex of a subpath is
+	// the camera or the point light, the rest lie on surfaces. pdf_fwd is the
+	// area density with which the vertex was generated by its own subpath, 
+	// and pdf_rev the density with which it would have been generated by a 
+	// subpath coming from the other direction.
+	///////////////////////////////////////////////////////////////////////////
+	enum VertexType { CAMERA_VERTEX, LIGHT_VERTEX, SURFACE_VERTEX };
+	struct PathVertex {
+		VertexType type;
+		vec3 position;
+		vec3 geometry_normal;
+		vec3 shading_normal;
+		// Direction towards the previous vertex of the subpath
+		vec3 wo;
+		// Throughput of the subpath up to and including this vertex
+		vec3 beta;
+		const labhelper::Material * material = nullptr;
+		// Base color of the material (textured) at the vertex
+		vec3 color;
+		float pdf_fwd = 0.0f, pdf_rev = 0.0f;
+		// Set for specular vertices, which can not be connected to
+		bool delta = false;
+	};
+	const int max_subpath_vertices = 18;
+
+	// Turns the pdf of zero (used for delta distributions) into something
+	// that cancels out in the MIS weight ratios
+	static float remap0(float f) { return f != 0.0f ? f : 1.0f; }
+
+	static vec3 offsetFrom(const PathVertex & v, const vec3 & w)
+	{
+		return v.position + EPSILON * (dot(w, v.geometry_normal) > 0.0f ? 1.0f : -1.0f) * v.geometry_normal;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Convert a solid angle density at 'from' to an area density at 'to'
+	///////////////////////////////////////////////////////////////////////////
+	static float pdfToArea(float pdf, const PathVertex & from, const PathVertex & to)
+	{
+		const vec3 d = to.position - from.position;
+		const float dist2 = dot(d, d);
+		if (dist2 == 0.0f) return 0.0f;
+		if (to.type == SURFACE_VERTEX) pdf *= abs(dot(to.geometry_normal, d / sqrt(dist2)));
+		return pdf / dist2;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Brdf value and pdf at a surface vertex
+	///////////////////////////////////////////////////////////////////////////
+	static vec3 f(const PathVertex & v, const vec3 & wi, const vec3 & wo)
+	{
+		Diffuse diffuse(v.color);
+		return diffuse.f(wi, wo, v.shading_normal);
+	}
+
+	static float pdf(const PathVertex & v, const vec3 & wi, const vec3 & wo)
+	{
+		Diffuse diffuse(v.color);
+		return diffuse.pdf(wi, wo, v.shading_normal);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Extend a subpath, whose first vertex is path[0], along ray. pdf_dir is
+	// the solid angle pdf with which ray was sampled. For camera subpaths, 
+	// emission that is hit directly (the strategies with no light subpath 
+	// vertices) is added to Le, and so is the environment, also when it is
+	// seen from the last vertex. Returns the number of vertices.
+	///////////////////////////////////////////////////////////////////////////
+	static int randomWalk(Ray ray, vec3 beta, float pdf_dir, PathVertex * path, int max_vertices, vec3 * Le)
+	{
+		int n = 1;
+		while (true) {
+			if (n == max_vertices) {
+				if (Le && !intersect(ray)) *Le += beta * Lenvironment(ray.d);
+				break;
+			}
+			if (!intersect(ray)) {
+				if (Le) *Le += beta * Lenvironment(ray.d);
+				break;
+			}
+			Intersection hit = getIntersection(ray);
+			PathVertex & v = path[n];
+			PathVertex & prev = path[n - 1];
+			v.type = SURFACE_VERTEX;
+			v.position = hit.position;
+			v.geometry_normal = hit.geometry_normal;
+			v.shading_normal = hit.shading_normal;
+			v.wo = hit.wo;
+			v.beta = beta;
+			v.material = hit.material;
+			v.color = baseColor(hit);
+			v.delta = false;
+			v.pdf_fwd = pdfToArea(pdf_dir, prev, v);
+			v.pdf_rev = 0.0f;
+			n++;
+			if (Le) *Le += beta * hit.material->m_emission * v.color;
+
+			// Sample the next direction
+			Diffuse diffuse(v.color);
+			vec3 wi;
+			float pdf_fwd;
+			vec3 brdf = diffuse.sample_wi(wi, hit.wo, hit.shading_normal, pdf_fwd);
+			if (pdf_fwd < EPSILON) break;
+			beta = beta * brdf * abs(dot(wi, hit.shading_normal)) / pdf_fwd;
+			if (beta == vec3(0.0f)) break;
+			// The density of sampling the reverse direction, at this vertex
+			prev.pdf_rev = pdfToArea(diffuse.pdf(hit.wo, wi, hit.shading_normal), v, prev);
+			pdf_dir = pdf_fwd;
+			ray = Ray(offsetFrom(v, wi), wi);
+		}
+		return n;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The balance heuristic weight for the path made of the first s light 
+	// subpath vertices and first t camera subpath vertices. Follows the 
+	// formulation in PBRT (3rd ed., 16.3.4): the weight is expressed through
+	// ratios of the pdfs of neighbouring strategies.
+	///////////////////////////////////////////////////////////////////////////
+	static float misWeight(const PathVertex * light_path, int s, const PathVertex * camera_path, int t, const Camera & camera)
+	{
+		if (s + t == 2) return 1.0f;
+		float light_rev[max_subpath_vertices], camera_rev[max_subpath_vertices];
+		for (int i = 0; i < s; i++) light_rev[i] = light_path[i].pdf_rev;
+		for (int i = 0; i < t; i++) camera_rev[i] = camera_path[i].pdf_rev;
+
+		///////////////////////////////////////////////////////////////////////
+		// The connection changes the reverse pdfs of the vertices at and 
+		// next to the connection.
+		///////////////////////////////////////////////////////////////////////
+		const PathVertex & zc = camera_path[t - 1];
+		const PathVertex & yc = light_path[s - 1];
+		const vec3 y_to_z = normalize(zc.position - yc.position);
+		// Density of the light subpath generating zc
+		if (s == 1) camera_rev[t - 1] = pdfToArea(1.0f / (4.0f * M_PI), yc, zc);
+		else camera_rev[t - 1] = pdfToArea(pdf(yc, y_to_z, yc.wo), yc, zc);
+		// Density of the light subpath generating the vertex before zc
+		if (t > 2) camera_rev[t - 2] = pdfToArea(pdf(zc, zc.wo, -y_to_z), zc, camera_path[t - 2]);
+		// Density of the camera subpath generating yc
+		if (s > 1) {
+			if (t == 1) light_rev[s - 1] = pdfToArea(camera.pdfDirection(-y_to_z), zc, yc);
+			else light_rev[s - 1] = pdfToArea(pdf(zc, -y_to_z, zc.wo), zc, yc);
+		}
+		// Density of the camera subpath generating the vertex before yc
+		if (s > 2) light_rev[s - 2] = pdfToArea(pdf(yc, yc.wo, y_to_z), yc, light_path[s - 2]);
+
+		///////////////////////////////////////////////////////////////////////
+		// Sum the pdf ratios of all other strategies that generate this path
+		///////////////////////////////////////////////////////////////////////
+		float sum_ri = 0.0f;
+		float ri = 1.0f;
+		for (int i = t - 1; i > 0; i--) {
+			ri *= remap0(camera_rev[i]) / remap0(camera_path[i].pdf_fwd);
+			if (!camera_path[i].delta && !camera_path[i - 1].delta) sum_ri += ri;
+		}
+		ri = 1.0f;
+		for (int i = s - 1; i >= 0; i--) {
+			ri *= remap0(light_rev[i]) / remap0(light_path[i].pdf_fwd);
+			// The point light can not be hit by a camera subpath
+			const bool delta_light_vertex = i > 0 ? light_path[i - 1].delta : true;
+			if (!light_path[i].delta && !delta_light_vertex) sum_ri += ri;
+		}
+		return 1.0f / (1.0f + sum_ri);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Connect the first s light subpath vertices with the first t camera
+	// subpath vertices, and return the (unweighted) contribution. For t == 1
+	// the screen coordinate the path lands on is returned as well.
+	///////////////////////////////////////////////////////////////////////////
+	static vec3 connect(const PathVertex * light_path, int s, const PathVertex * camera_path, int t,
+		const Camera & camera, vec2 & screen_coord)
+	{
+		const PathVertex & zc = camera_path[t - 1];
+		const PathVertex & yc = light_path[s - 1];
+		if (zc.delta || yc.delta) return vec3(0.0f);
+		const vec3 d = zc.position - yc.position;
+		const float dist = length(d);
+		if (dist < EPSILON) return vec3(0.0f);
+		const vec3 y_to_z = d / dist;
+		vec3 L;
+		if (t == 1) {
+			// Light tracing: connect a light subpath vertex to the camera
+			if (!camera.project(yc.position, screen_coord)) return vec3(0.0f);
+			L = yc.beta * f(yc, y_to_z, yc.wo) * abs(dot(y_to_z, yc.shading_normal)) /
+				(dist * dist) * camera.pdfDirection(-y_to_z);
+		}
+		else if (s == 1) {
+			// Next event estimation towards the point light
+			L = zc.beta * f(zc, -y_to_z, zc.wo) * yc.beta * abs(dot(y_to_z, zc.shading_normal)) / (dist * dist);
+		}
+		else {
+			L = yc.beta * f(yc, y_to_z, yc.wo) * f(zc, -y_to_z, zc.wo) * zc.beta *
+				abs(dot(y_to_z, yc.shading_normal)) * abs(dot(y_to_z, zc.shading_normal)) / (dist * dist);
+		}
+		if (L == vec3(0.0f)) return L;
+		// Visibility
+		vec3 from = yc.type == SURFACE_VERTEX ? offsetFrom(yc, y_to_z) : yc.position;
+		vec3 to = zc.type == SURFACE_VERTEX ? offsetFrom(zc, -y_to_z) : zc.position;
+		Ray shadow_ray(from, normalize(to - from), 0.0f, length(to - from));
+		if (occluded(shadow_ray)) return vec3(0.0f);
+		return L;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Bidirectional path tracing
+	///////////////////////////////////////////////////////////////////////////
+	vec3 LiBidirectional(Ray & primary_ray, const Camera & camera)
+	{
+		// A path with max_bounces surface interactions between the light and
+		// the camera can be generated by subpaths of up to max_bounces + 1
+		// vertices (the light or camera vertex and max_bounces surface
+		// vertices), which is where Li() stops as well.
+		const int max_vertices = std::min(settings.max_bounces + 1, max_subpath_vertices);
+		vec3 L(0.0f);
+
+		///////////////////////////////////////////////////////////////////////
+		// Camera subpath. Rays are generated through uniformly distributed
+		// screen coordinates, so beta = We * cos / pdf = 1.
+		///////////////////////////////////////////////////////////////////////
+		PathVertex camera_path[max_subpath_vertices];
+		camera_path[0].type = CAMERA_VERTEX;
+		camera_path[0].position = primary_ray.o;
+		camera_path[0].geometry_normal = camera_path[0].shading_normal = camera.direction;
+		camera_path[0].beta = vec3(1.0f);
+		camera_path[0].pdf_fwd = 1.0f;
+		const int nof_camera_vertices = randomWalk(primary_ray, vec3(1.0f), camera.pdfDirection(primary_ray.d),
+			camera_path, max_vertices, &L);
+
+		///////////////////////////////////////////////////////////////////////
+		// Light subpath, starting on the point light, emitted uniformly in 
+		// all directions.
+		///////////////////////////////////////////////////////////////////////
+		PathVertex light_path[max_subpath_vertices];
+		const vec3 intensity = point_light.intensity_multiplier * point_light.color;
+		light_path[0].type = LIGHT_VERTEX;
+		light_path[0].position = point_light.position;
+		light_path[0].beta = intensity;
+		light_path[0].pdf_fwd = 1.0f;
+		int nof_light_vertices = 1;
+		if (intensity != vec3(0.0f)) {
+			const vec3 w = uniformSampleSphere();
+			const float pdf_dir = 1.0f / (4.0f * M_PI);
+			nof_light_vertices = randomWalk(Ray(point_light.position, w), intensity / pdf_dir, pdf_dir,
+				light_path, max_vertices, nullptr);
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Combine all strategies. s == 0 (hitting an emitter) has already
+		// been added by the camera random walk; the point light and the 
+		// pinhole can not be hit, so s == 0 is the only way to reach emitting
+		// surfaces and the environment, and t == 0 is never possible.
+		///////////////////////////////////////////////////////////////////////
+		for (int t = 1; t <= nof_camera_vertices; t++) {
+			for (int s = 1; s <= nof_light_vertices; s++) {
+				const int depth = s + t - 2;
+				if ((s == 1 && t == 1) || depth > settings.max_bounces) continue;
+				vec2 screen_coord;
+				vec3 contribution = connect(light_path, s, camera_path, t, camera, screen_coord);
+				if (contribution == vec3(0.0f)) continue;
+				contribution *= misWeight(light_path, s, camera_path, t, camera);
+				if (t == 1) splat(screen_coord, contribution);
+				else L += contribution;
+			}
+		}
+		return L;
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "embree.h"
+#include "camera.h"
+#include "numa.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Bidirectional path tracing. Traces one camera subpath (starting with 
+	// primary_ray) and one light subpath, and combines all ways of connecting
+	// them with multiple importance sampling. Returns the radiance estimate 
+	// for the pixel primary_ray goes through. Paths that connect directly to
+	// the camera (light tracing) can contribute to any pixel and are splatted
+	// into a shared buffer instead.
+	///////////////////////////////////////////////////////////////////////////
+	vec3 LiBidirectional(Ray & primary_ray, const Camera & camera);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Clear the light tracing splat buffer before a pass
+	///////////////////////////////////////////////////////////////////////////
+	void clearSplats(int width, int height);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add the splatted contributions of a pass, scaled by weight, to the
+	// pixels [region.x, region.z) x [region.y, region.w) of an image
+	///////////////////////////////////////////////////////////////////////////
+	void addSplats(PixelBuffer & image, float weight, const ivec4 & region);
+}
@@ -0,0 +1,555 @@
+///////////////////////////////////////////////////////////////////////////////
+// pathtracer_bench: headless performance measurements of the pathtracer,
+// written as JSON (to stdout, or to --output). Usage:
+//   pathtracer_bench [--scenes cornell,ship,...] [--width W] [--height H]
+//                    [--passes N] [--bounces N] [--integrators pt,bdpt,guided]
+//                    [--pools shared,separate] [--threads N] [--pin]
+//                    [--pin-to-nodes] [--no-hyperthreads] [--replicate-scene]
+//                    [--alpha-test off,filter,retrace] [--compact-shading]
+//                    [--compare-bvh]
+//                    [--scenes-dir dir] [--output file.json]
+// Each scene is measured with each thread pool configuration (see
+// threads.h) in a process of its own (the benchmark runs itself with
+// --scene <name> --pool <pool>), so that load times and peak memory use are
+// not affected by the scenes measured before it. Renders are deterministic, and
+// the hash of each image is reported so that runs can be checked for equal
+// output as well as for speed. Alpha tested geometry (see embree.h) is 
+// measured with filter functions by default; the tree scene compares the
+// ways of alpha testing when run with each. With --compact-shading, hits are
+// shaded from quantized data (see shading_data.h), whose precision against the
+// float data of the models is reported with its size. With --compare-bvh,
+// the in-tree BVH (see bvh.h) is built over each scene as well, and traces
+// the same rays as the tracer of the build (Embree, unless built without).
+///////////////////////////////////////////////////////////////////////////////
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include <omp.h>
+#include <Model.h>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "camera.h"
+#include "sampling.h"
+#include "guiding.h"
+#include "threads.h"
+#include "numa.h"
+#include "shading_data.h"
+#include "bvh.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#define popen _popen
+#define pclose _pclose
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace glm;
+using namespace std;
+
+#ifdef PATHTRACER_BVH
+static const char * TRACER = "bvh";
+#else
+static const char * TRACER = "embree";
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// The scenes, and where to look at them from
+///////////////////////////////////////////////////////////////////////////////
+struct BenchScene {
+	string name;
+	vector<pair<string, mat4>> models;
+	// If false, the camera looks at the center of the scene bounds
+	bool has_camera;
+	vec3 camera_position, camera_target;
+};
+
+static vector<BenchScene> benchScenes()
+{
+	return {
+		{ "cornell", { { "cornell.obj", mat4(1.0f) } }, false, vec3(0.0f), vec3(0.0f) },
+		{ "ship", { { "NewShip.obj", translate(vec3(0.0f, 10.0f, 0.0f)) }, { "landingpad2.obj", mat4(1.0f) } },
+			true, vec3(-30.0f, 10.0f, 30.0f), vec3(0.0f, 10.0f, 0.0f) },
+		{ "bigsphere", { { "BigSphere.obj", mat4(1.0f) } }, false, vec3(0.0f), vec3(0.0f) },
+		{ "island2", { { "island2.obj", mat4(1.0f) } }, false, vec3(0.0f), vec3(0.0f) },
+		{ "city", { { "city.obj", mat4(1.0f) } }, false, vec3(0.0f), vec3(0.0f) },
+		{ "tree", { { "Tree.obj", mat4(1.0f) } }, false, vec3(0.0f), vec3(0.0f) },
+	};
+}
+
+struct BenchOptions {
+	vector<string> scenes;
+	vector<string> integrators = { "pt", "bdpt" };
+	vector<string> pools = { "shared", "separate" };
+	int threads = 0;
+	bool pin_threads = false;
+	bool pin_to_nodes = false;
+	bool replicate_scene = false;
+	bool use_hyperthreads = true;
+	string alpha_test = "filter";
+	bool compact_shading = false;
+	bool compare_bvh = false;
+	string scenes_dir = "../scenes/";
+	string output;
+	int width = 320, height = 240;
+	int passes = 16;
+	int bounces = 4;
+};
+
+static vector<string> split(const string & list)
+{
+	vector<string> result;
+	stringstream ss(list);
+	string item;
+	while (getline(ss, item, ',')) if (!item.empty()) result.push_back(item);
+	return result;
+}
+
+static double secondsSince(const chrono::steady_clock::time_point & start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static double peakMemoryMB()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return double(counters.PeakWorkingSetSize) / (1024.0 * 1024.0);
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return double(usage.ru_maxrss) / (1024.0 * 1024.0);
+#else
+	return double(usage.ru_maxrss) / 1024.0;
+#endif
+#endif
+}
+
+static string imageHash()
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	const uint8_t * bytes = (const uint8_t *)pathtracer::rendered_image.getPtr();
+	const size_t size = pathtracer::rendered_image.data.size() * sizeof(vec3);
+	for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	char text[17];
+	snprintf(text, sizeof(text), "%016llx", (unsigned long long)hash);
+	return text;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Trace one ray through each pixel, and count the rays per second. Only the
+// traversal is measured (no shading). Rays are traced with trace(ray), by
+// default the tracer of the build (see embree.h).
+///////////////////////////////////////////////////////////////////////////////
+static bool traceScene(pathtracer::Ray & ray)
+{
+	return pathtracer::intersect(ray);
+}
+
+template <typename Trace>
+static double primaryRaysPerSecond(const pathtracer::Camera & camera, const BenchOptions & options, vector<vec3> & hits,
+	vector<char> & hit_mask, Trace trace)
+{
+	const int w = options.width, h = options.height;
+	hits.assign(w * h, vec3(0.0f));
+	hit_mask.assign(w * h, 0);
+	const auto start = chrono::steady_clock::now();
+	for (int pass = 0; pass < options.passes; pass++) {
+#pragma omp parallel for schedule(dynamic, 4)
+		for (int y = 0; y < h; y++) {
+			for (int x = 0; x < w; x++) {
+				pathtracer::Ray ray(camera.position, camera.rayDirection(vec2((x + 0.5f) / w, (y + 0.5f) / h)));
+				if (trace(ray)) {
+					hits[y * w + x] = ray.o + (ray.tfar * 0.999f) * ray.d;
+					hit_mask[y * w + x] = 1;
+				}
+			}
+		}
+	}
+	return double(w) * double(h) * double(options.passes) / secondsSince(start);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Look up the shading data (getIntersection()) of the hit through each pixel,
+// and count the hits per second. The rays are traced once, beforehand.
+///////////////////////////////////////////////////////////////////////////////
+static double shadedHitsPerSecond(const pathtracer::Camera & camera, const BenchOptions & options)
+{
+	const int w = options.width, h = options.height;
+	vector<pathtracer::Ray> rays;
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			pathtracer::Ray ray(camera.position, camera.rayDirection(vec2((x + 0.5f) / w, (y + 0.5f) / h)));
+			if (pathtracer::intersect(ray)) rays.push_back(ray);
+		}
+	}
+	const int n = int(rays.size());
+	float sum = 0.0f;
+	const auto start = chrono::steady_clock::now();
+	for (int pass = 0; pass < options.passes; pass++) {
+#pragma omp parallel for schedule(static) reduction(+:sum)
+		for (int i = 0; i < n; i++) {
+			const pathtracer::Intersection hit = pathtracer::getIntersection(rays[i]);
+			sum += hit.shading_normal.x + hit.texture_coordinate.x;
+		}
+	}
+	const double seconds = secondsSince(start);
+	// Keeps the lookups from being optimized away
+	volatile float result = sum;
+	(void)result;
+	return n > 0 ? double(n) * double(options.passes) / seconds : 0.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Trace rays in uniformly random directions from the primary hit points,
+// like (worst case) diffuse bounces do
+///////////////////////////////////////////////////////////////////////////////
+template <typename Trace>
+static double incoherentRaysPerSecond(const BenchOptions & options, const vector<vec3> & hits, const vector<char> & hit_mask,
+	Trace trace)
+{
+	const int n = int(hits.size());
+	int64_t nof_rays = 0;
+	const auto start = chrono::steady_clock::now();
+	for (int pass = 0; pass < options.passes; pass++) {
+#pragma omp parallel for schedule(dynamic, 256) reduction(+:nof_rays)
+		for (int i = 0; i < n; i++) {
+			if (!hit_mask[i]) continue;
+			pathtracer::beginSampleStream(0, uint32_t(i), uint32_t(pass));
+			pathtracer::Ray ray(hits[i], pathtracer::uniformSampleSphere());
+			pathtracer::endSampleStream();
+			trace(ray);
+			nof_rays++;
+		}
+	}
+	const double seconds = secondsSince(start);
+	return nof_rays > 0 ? double(nof_rays) / seconds : 0.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Build the in-tree BVH (see bvh.h) over the scene and trace the same rays
+// with it as with the tracer of the build, for comparison. Also counts the
+// primary rays that hit the same triangle with both.
+///////////////////////////////////////////////////////////////////////////////
+static void compareBVH(const pathtracer::Camera & camera, const BenchOptions & options, const vector<vec3> & hits,
+	const vector<char> & hit_mask, ostream & json)
+{
+	pathtracer::BVH bvh;
+	auto start = chrono::steady_clock::now();
+	bvh.buildScene();
+	const double build_seconds = secondsSince(start);
+	auto trace = [&bvh](pathtracer::Ray & ray) { return bvh.intersect(ray); };
+	vector<vec3> bvh_hits;
+	vector<char> bvh_hit_mask;
+	const double primary = primaryRaysPerSecond(camera, options, bvh_hits, bvh_hit_mask, trace);
+	const double incoherent = incoherentRaysPerSecond(options, hits, hit_mask, trace);
+
+	const int w = options.width, h = options.height;
+	int64_t nof_same = 0;
+#pragma omp parallel for schedule(dynamic, 4) reduction(+:nof_same)
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			pathtracer::Ray ray(camera.position, camera.rayDirection(vec2((x + 0.5f) / w, (y + 0.5f) / h)));
+			pathtracer::Ray bvh_ray = ray;
+			pathtracer::intersect(ray);
+			bvh.intersect(bvh_ray);
+			if (ray.geomID == bvh_ray.geomID && (ray.geomID == RTC_INVALID_GEOMETRY_ID || ray.primID == bvh_ray.primID)) nof_same++;
+		}
+	}
+
+	json << "      \"bvh\": { \"width\": " << bvh.width() << ", \"build_s\": " << build_seconds <<
+		", \"memory_mb\": " << double(bvh.memoryUsage()) / (1024.0 * 1024.0) <<
+		", \"primary_rays_per_s\": " << primary << ", \"incoherent_rays_per_s\": " << incoherent <<
+		", \"same_primary_hits\": " << double(nof_same) / (double(w) * double(h)) << " },\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Measure one scene and write the result as a JSON object
+///////////////////////////////////////////////////////////////////////////////
+static bool benchScene(const BenchScene & scene, const BenchOptions & options, ostream & json)
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Load
+	///////////////////////////////////////////////////////////////////////////
+	vector<pair<labhelper::Model *, mat4>> models;
+	auto start = chrono::steady_clock::now();
+	for (auto & m : scene.models) {
+		models.push_back(make_pair(labhelper::loadModelFromOBJ(options.scenes_dir + m.first, false), m.second));
+	}
+	const double load_seconds = secondsSince(start);
+	size_t nof_triangles = 0;
+	for (auto & m : models) nof_triangles += m.first->m_positions.size() / 3;
+
+	start = chrono::steady_clock::now();
+	for (auto & m : models) pathtracer::addModel(m.first, m.second);
+	const double add_seconds = secondsSince(start);
+	start = chrono::steady_clock::now();
+	pathtracer::buildBVH();
+	const double bvh_seconds = secondsSince(start);
+
+	// Size of the shading data, and the precision of the compact data
+	size_t float_shading_bytes = 0, compact_shading_bytes = 0;
+	float max_normal_error = 0.0f, max_uv_error = 0.0f;
+	for (auto & m : models) {
+		float_shading_bytes += pathtracer::CompactShadingData::modelMemoryUsage(m.first);
+		const pathtracer::CompactShadingData * data = pathtracer::getCompactShadingData(m.first);
+		if (data == nullptr) continue;
+		compact_shading_bytes += data->memoryUsage();
+		float normal_error, uv_error;
+		data->precision(m.first, normal_error, uv_error);
+		max_normal_error = std::max(max_normal_error, normal_error);
+		max_uv_error = std::max(max_uv_error, uv_error);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Camera, light and settings
+	///////////////////////////////////////////////////////////////////////////
+	vec3 bounds_min, bounds_max;
+	pathtracer::getSceneBounds(bounds_min, bounds_max);
+	const vec3 center = 0.5f * (bounds_min + bounds_max);
+	const float radius = 0.5f * length(bounds_max - bounds_min);
+	vec3 camera_position = center + 2.0f * radius * normalize(vec3(-1.0f, 0.6f, 1.0f));
+	vec3 camera_target = center;
+	if (scene.has_camera) {
+		camera_position = scene.camera_position;
+		camera_target = scene.camera_target;
+	}
+	const vec3 camera_direction = normalize(camera_target - camera_position);
+	const vec3 world_up(0.0f, 1.0f, 0.0f);
+	const vec3 camera_up = normalize(cross(normalize(cross(camera_direction, world_up)), camera_direction));
+	pathtracer::point_light.intensity_multiplier = 2500.0f * (radius * radius) / (50.0f * 50.0f);
+	pathtracer::point_light.color = vec3(1.0f);
+	pathtracer::point_light.position = center + vec3(0.2f, 0.8f, 0.2f) * radius;
+
+	pathtracer::settings.subsampling = 1;
+	pathtracer::settings.max_bounces = options.bounces;
+	pathtracer::settings.max_paths_per_pixel = 0;
+	pathtracer::settings.use_radiance_cache = false;
+	pathtracer::settings.use_gbuffer = false;
+	pathtracer::settings.use_reprojection = false;
+	pathtracer::settings.deterministic = true;
+	pathtracer::settings.seed = 0;
+	pathtracer::resize(options.width, options.height);
+	const pathtracer::Camera camera(camera_position, camera_direction, camera_up, 45.0f, float(options.width) / float(options.height));
+
+	///////////////////////////////////////////////////////////////////////////
+	// Rays and samples
+	///////////////////////////////////////////////////////////////////////////
+	vector<vec3> hits;
+	vector<char> hit_mask;
+	const double primary = primaryRaysPerSecond(camera, options, hits, hit_mask, traceScene);
+	const double incoherent = incoherentRaysPerSecond(options, hits, hit_mask, traceScene);
+	const double shaded = shadedHitsPerSecond(camera, options);
+
+	json << "    {\n";
+	json << "      \"name\": \"" << scene.name << "\",\n";
+	json << "      \"tracer\": \"" << TRACER << "\",\n";
+	json << "      \"pool\": \"" << (pathtracer::thread_settings.shared_pool ? "shared" : "separate") << "\",\n";
+	json << "      \"alpha_test\": \"" << options.alpha_test << "\",\n";
+	json << "      \"compact_shading\": " << (options.compact_shading ? "true" : "false") << ",\n";
+	json << "      \"threads\": " << pathtracer::threadCount() << ",\n";
+	json << "      \"numa_nodes\": " << pathtracer::numaNodeCount() << ",\n";
+	json << "      \"triangles\": " << nof_triangles << ",\n";
+	json << "      \"obj_load_s\": " << load_seconds << ",\n";
+	json << "      \"add_models_s\": " << add_seconds << ",\n";
+	json << "      \"bvh_build_s\": " << bvh_seconds << ",\n";
+	json << "      \"primary_rays_per_s\": " << primary << ",\n";
+	json << "      \"incoherent_rays_per_s\": " << incoherent << ",\n";
+	json << "      \"shaded_hits_per_s\": " << shaded << ",\n";
+	if (options.compare_bvh) compareBVH(camera, options, hits, hit_mask, json);
+	json << "      \"float_shading_data_mb\": " << double(float_shading_bytes) / (1024.0 * 1024.0) << ",\n";
+	if (options.compact_shading) {
+		json << "      \"compact_shading_data_mb\": " << double(compact_shading_bytes) / (1024.0 * 1024.0) << ",\n";
+		json << "      \"max_normal_error_deg\": " << max_normal_error << ",\n";
+		json << "      \"max_uv_error\": " << max_uv_error << ",\n";
+	}
+	json << "      \"integrators\": [";
+	for (size_t i = 0; i < options.integrators.size(); i++) {
+		const string & name = options.integrators[i];
+		if (name == "pt" || name == "guided") {
+			pathtracer::settings.integrator = pathtracer::PATH_TRACING;
+		}
+		else if (name == "bdpt") {
+			pathtracer::settings.integrator = pathtracer::BIDIRECTIONAL_PATH_TRACING;
+		}
+		else {
+			cerr << "Unknown integrator " << name << "\n";
+			return false;
+		}
+		pathtracer::settings.path_guiding = name == "guided";
+		pathtracer::restart();
+		start = chrono::steady_clock::now();
+		for (int pass = 0; pass < options.passes; pass++) {
+			pathtracer::tracePaths(camera_position, camera_direction, camera_up);
+		}
+		const double seconds = secondsSince(start);
+		json << (i > 0 ? "," : "") << "\n        { \"name\": \"" << name << "\", \"samples_per_s\": " <<
+			double(options.width) * double(options.height) * double(options.passes) / seconds <<
+			", \"seconds\": " << seconds << ", \"image_hash\": \"" << imageHash() << "\" }";
+	}
+	json << "\n      ],\n";
+	json << "      \"peak_rss_mb\": " << peakMemoryMB() << "\n";
+	json << "    }";
+
+	for (auto & m : models) labhelper::freeModel(m.first);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions options;
+	string single_scene;
+	for (int i = 1; i < argc; i++) {
+		const string arg = argv[i];
+		const bool has_value = i + 1 < argc;
+		if (arg == "--scene" && has_value) single_scene = argv[++i];
+		else if (arg == "--scenes" && has_value) options.scenes = split(argv[++i]);
+		else if (arg == "--pool" && has_value) options.pools = { argv[++i] };
+		else if (arg == "--pools" && has_value) options.pools = split(argv[++i]);
+		else if (arg == "--threads" && has_value) options.threads = atoi(argv[++i]);
+		else if (arg == "--pin") options.pin_threads = true;
+		else if (arg == "--pin-to-nodes") options.pin_threads = options.pin_to_nodes = true;
+		else if (arg == "--replicate-scene") options.replicate_scene = true;
+		else if (arg == "--no-hyperthreads") options.use_hyperthreads = false;
+		else if (arg == "--alpha-test" && has_value) options.alpha_test = argv[++i];
+		else if (arg == "--compact-shading") options.compact_shading = true;
+		else if (arg == "--compare-bvh") options.compare_bvh = true;
+		else if (arg == "--integrators" && has_value) options.integrators = split(argv[++i]);
+		else if (arg == "--scenes-dir" && has_value) options.scenes_dir = argv[++i];
+		else if (arg == "--output" && has_value) options.output = argv[++i];
+		else if (arg == "--width" && has_value) options.width = atoi(argv[++i]);
+		else if (arg == "--height" && has_value) options.height = atoi(argv[++i]);
+		else if (arg == "--passes" && has_value) options.passes = atoi(argv[++i]);
+		else if (arg == "--bounces" && has_value) options.bounces = atoi(argv[++i]);
+		else {
+			cerr << "Unknown argument: " << arg << "\n";
+			return 1;
+		}
+	}
+	if (options.width <= 0 || options.height <= 0 || options.passes <= 0) {
+		cerr << "Width, height and passes must be positive\n";
+		return 1;
+	}
+	if (options.alpha_test != "off" && options.alpha_test != "filter" && options.alpha_test != "retrace") {
+		cerr << "Unknown alpha test: " << options.alpha_test << "\n";
+		return 1;
+	}
+	for (auto & pool : options.pools) {
+		if (pool != "shared" && pool != "separate") {
+			cerr << "Unknown thread pool configuration: " << pool << "\n";
+			return 1;
+		}
+	}
+	if (!options.scenes_dir.empty() && options.scenes_dir.back() != '/' && options.scenes_dir.back() != '\\') {
+		options.scenes_dir += "/";
+	}
+	const vector<BenchScene> scenes = benchScenes();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Measure a single scene. Only the JSON goes to stdout, everything the
+	// loaders print is sent to stderr.
+	///////////////////////////////////////////////////////////////////////////
+	if (!single_scene.empty()) {
+		for (auto & scene : scenes) {
+			if (scene.name != single_scene) continue;
+			ostream json(cout.rdbuf());
+			json.precision(6);
+			cout.rdbuf(cerr.rdbuf());
+			pathtracer::environment.map.load(options.scenes_dir + "envmaps/001.hdr");
+			pathtracer::environment.multiplier = 1.0f;
+			pathtracer::thread_settings.threads = options.threads;
+			pathtracer::thread_settings.pin_threads = options.pin_threads;
+			pathtracer::thread_settings.pin_to_nodes = options.pin_to_nodes;
+			pathtracer::numa_settings.replicate_scene = options.replicate_scene;
+			pathtracer::thread_settings.use_hyperthreads = options.use_hyperthreads;
+			pathtracer::thread_settings.shared_pool = options.pools.front() == "shared";
+			pathtracer::scene_settings.alpha_test = options.alpha_test == "off" ? pathtracer::ALPHA_TEST_OFF :
+				(options.alpha_test == "retrace" ? pathtracer::ALPHA_TEST_RETRACE : pathtracer::ALPHA_TEST_FILTER);
+			pathtracer::scene_settings.compact_shading = options.compact_shading;
+			return benchScene(scene, options, json) ? 0 : 1;
+		}
+		cerr << "Unknown scene: " << single_scene << "\n";
+		return 1;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Run every scene in a process of its own
+	///////////////////////////////////////////////////////////////////////////
+	if (options.scenes.empty()) {
+		for (auto & scene : scenes) options.scenes.push_back(scene.name);
+	}
+	string common_arguments = " --width " + to_string(options.width) + " --height " + to_string(options.height) +
+		" --passes " + to_string(options.passes) + " --bounces " + to_string(options.bounces) +
+		" --scenes-dir \"" + options.scenes_dir + "\" --integrators ";
+	for (size_t i = 0; i < options.integrators.size(); i++) common_arguments += (i > 0 ? "," : "") + options.integrators[i];
+	common_arguments += " --threads " + to_string(options.threads);
+	if (options.pin_threads) common_arguments += " --pin";
+	if (options.pin_to_nodes) common_arguments += " --pin-to-nodes";
+	if (options.replicate_scene) common_arguments += " --replicate-scene";
+	if (!options.use_hyperthreads) common_arguments += " --no-hyperthreads";
+	common_arguments += " --alpha-test " + options.alpha_test;
+	if (options.compact_shading) common_arguments += " --compact-shading";
+	if (options.compare_bvh) common_arguments += " --compare-bvh";
+
+	stringstream json;
+	json << "{\n";
+#ifdef NDEBUG
+	json << "  \"build\": \"release\",\n";
+#else
+	json << "  \"build\": \"debug\",\n";
+#endif
+	json << "  \"requested_threads\": " << options.threads << ",\n";
+	json << "  \"pinned\": " << (options.pin_threads ? (options.pin_to_nodes ? "\"nodes\"" : "\"processors\"") : "false") << ",\n";
+	json << "  \"replicated_scene\": " << (options.replicate_scene ? "true" : "false") << ",\n";
+	json << "  \"width\": " << options.width << ",\n";
+	json << "  \"height\": " << options.height << ",\n";
+	json << "  \"passes\": " << options.passes << ",\n";
+	json << "  \"bounces\": " << options.bounces << ",\n";
+	json << "  \"scenes\": [\n";
+	bool all_ok = true;
+	vector<pair<string, string>> runs;
+	for (auto & scene : options.scenes) {
+		for (auto & pool : options.pools) runs.push_back(make_pair(scene, pool));
+	}
+	for (size_t i = 0; i < runs.size(); i++) {
+		cerr << "Benchmarking " << runs[i].first << " (" << runs[i].second << " thread pool)...\n";
+		const string command = "\"" + string(argv[0]) + "\" --scene " + runs[i].first + " --pool " + runs[i].second + common_arguments;
+		string result;
+		FILE * child = popen(command.c_str(), "r");
+		if (child != nullptr) {
+			char buffer[4096];
+			size_t n;
+			while ((n = fread(buffer, 1, sizeof(buffer), child)) > 0) result.append(buffer, n);
+		}
+		const bool ok = child != nullptr && pclose(child) == 0 && !result.empty();
+		if (!ok) {
+			all_ok = false;
+			result = "    { \"name\": \"" + runs[i].first + "\", \"pool\": \"" + runs[i].second + "\", \"error\": \"benchmark failed\" }";
+		}
+		json << result << (i + 1 < runs.size() ? ",\n" : "\n");
+	}
+	json << "  ]\n}\n";
+
+	if (options.output.empty()) {
+		cout << json.str();
+	}
+	else {
+		FILE * file = fopen(options.output.c_str(), "w");
+		if (file == nullptr) {
+			cerr << "Could not write " << options.output << "\n";
+			return 1;
+		}
+		fputs(json.str().c_str(), file);
+		fclose(file);
+	}
+	return all_ok ? 0 : 1;
+}
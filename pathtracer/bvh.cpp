@@ -0,0 +1,467 @@
+#include "bvh.h"
+#include "geometry.h"
+#include <algorithm>
+#include <memory>
+#include <omp.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define BVH_SSE
+#endif
+#if defined(__AVX__)
+#define BVH_AVX
+#endif
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Build parameters. SAH costs are relative to the cost of a triangle
+	// test.
+	///////////////////////////////////////////////////////////////////////////
+	static const int NOF_BINS = 16;
+	static const float TRAVERSAL_COST = 1.0f;
+	static const uint32_t MAX_LEAF_SIZE = 8;
+	// Subtrees with more triangles than this are built as tasks of their own
+	static const uint32_t TASK_SIZE = 4096;
+	// Deeper than this, nodes are split in the middle of their triangles,
+	// so that the BVH is at most MAX_SAH_DEPTH + 32 levels deep and the
+	// traversal stack (of nodes of width 8 at most) cannot overflow
+	static const int MAX_SAH_DEPTH = 32;
+	static const int STACK_SIZE = 64 * 7 + 1;
+
+	namespace
+	{
+		struct Box
+		{
+			vec3 lower = vec3(FLT_MAX), upper = vec3(-FLT_MAX);
+			void grow(const vec3 & p) { lower = min(lower, p); upper = max(upper, p); }
+			void grow(const Box & b) { lower = min(lower, b.lower); upper = max(upper, b.upper); }
+			float area() const
+			{
+				const vec3 e = upper - lower;
+				return e.x < 0.0f ? 0.0f : 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+			}
+		};
+
+		struct BuildNode
+		{
+			Box box;
+			unique_ptr<BuildNode> children[2];
+			// The triangles of a leaf, in Builder::references
+			uint32_t first, count;
+			bool isLeaf() const { return children[0] == nullptr; }
+		};
+
+		struct Builder
+		{
+			vector<Box> boxes;
+			vector<vec3> centroids;
+			// Triangle indices, partitioned in place as the tree is built, so
+			// that the triangles of each leaf end up next to each other
+			vector<uint32_t> references;
+
+			BuildNode * build(uint32_t begin, uint32_t end, int depth);
+		};
+
+		///////////////////////////////////////////////////////////////////////
+		// Build the subtree over references [begin, end)
+		///////////////////////////////////////////////////////////////////////
+		BuildNode * Builder::build(uint32_t begin, uint32_t end, int depth)
+		{
+			BuildNode * node = new BuildNode;
+			node->first = begin;
+			node->count = end - begin;
+			Box centroid_box;
+			for (uint32_t i = begin; i < end; i++) {
+				node->box.grow(boxes[references[i]]);
+				centroid_box.grow(centroids[references[i]]);
+			}
+			if (node->count <= 2) return node;
+
+			///////////////////////////////////////////////////////////////////
+			// Bin the centroids along each axis and find the split between
+			// two bins with the lowest SAH cost
+			///////////////////////////////////////////////////////////////////
+			const vec3 extent = centroid_box.upper - centroid_box.lower;
+			const vec3 scale = float(NOF_BINS) / max(extent, vec3(FLT_MIN));
+			auto bin = [&](uint32_t reference, int axis) {
+				const float x = (centroids[reference][axis] - centroid_box.lower[axis]) * scale[axis];
+				return std::min(int(x), NOF_BINS - 1);
+			};
+			float best_cost = FLT_MAX;
+			int best_axis = -1, best_bin = 0;
+			for (int axis = 0; axis < 3 && depth < MAX_SAH_DEPTH; axis++) {
+				if (extent[axis] <= 0.0f) continue;
+				Box bin_boxes[NOF_BINS];
+				uint32_t bin_counts[NOF_BINS] = {};
+				for (uint32_t i = begin; i < end; i++) {
+					const int b = bin(references[i], axis);
+					bin_counts[b]++;
+					bin_boxes[b].grow(boxes[references[i]]);
+				}
+				float right_costs[NOF_BINS];
+				Box right;
+				uint32_t right_count = 0;
+				for (int b = NOF_BINS - 1; b > 0; b--) {
+					right.grow(bin_boxes[b]);
+					right_count += bin_counts[b];
+					right_costs[b] = right.area() * right_count;
+				}
+				Box left;
+				uint32_t left_count = 0;
+				for (int b = 0; b < NOF_BINS - 1; b++) {
+					left.grow(bin_boxes[b]);
+					left_count += bin_counts[b];
+					const float cost = left.area() * left_count + right_costs[b + 1];
+					if (left_count > 0 && left_count < node->count && cost < best_cost) {
+						best_cost = cost;
+						best_axis = axis;
+						best_bin = b;
+					}
+				}
+			}
+			const float leaf_cost = node->box.area() * node->count;
+			const float split_cost = TRAVERSAL_COST * node->box.area() + best_cost;
+			if (node->count <= MAX_LEAF_SIZE && (best_axis < 0 || split_cost >= leaf_cost)) return node;
+
+			uint32_t middle = begin + node->count / 2;
+			if (best_axis >= 0) {
+				middle = uint32_t(partition(references.begin() + begin, references.begin() + end,
+					[&](uint32_t reference) { return bin(reference, best_axis) <= best_bin; }) - references.begin());
+			}
+			else if (depth >= MAX_SAH_DEPTH && extent != vec3(0.0f)) {
+				// Split in the middle of the widest axis
+				const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+				nth_element(references.begin() + begin, references.begin() + middle, references.begin() + end,
+					[&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+			}
+			if (node->count > TASK_SIZE) {
+				BuildNode * left = nullptr;
+#pragma omp task shared(left)
+				left = build(begin, middle, depth + 1);
+				node->children[1].reset(build(middle, end, depth + 1));
+#pragma omp taskwait
+				node->children[0].reset(left);
+			}
+			else {
+				node->children[0].reset(build(begin, middle, depth + 1));
+				node->children[1].reset(build(middle, end, depth + 1));
+			}
+			return node;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Collapse a binary subtree into nodes of width N: the child with the
+	// largest box is replaced by its children until there are N of them
+	///////////////////////////////////////////////////////////////////////////
+	template <int N>
+	static uint32_t collapse(const BuildNode * node, vector<BVH::Node<N>> & nodes)
+	{
+		const BuildNode * children[N];
+		int nof_children = 0;
+		if (node->isLeaf()) {
+			// Only the root
+			children[nof_children++] = node;
+		}
+		else {
+			children[nof_children++] = node->children[0].get();
+			children[nof_children++] = node->children[1].get();
+		}
+		while (nof_children < N) {
+			int largest = -1;
+			for (int i = 0; i < nof_children; i++) {
+				if (children[i]->isLeaf()) continue;
+				if (largest < 0 || children[i]->box.area() > children[largest]->box.area()) largest = i;
+			}
+			if (largest < 0) break;
+			const BuildNode * opened = children[largest];
+			children[largest] = opened->children[0].get();
+			children[nof_children++] = opened->children[1].get();
+		}
+		// The children are added after this node, which may move it
+		const uint32_t index = uint32_t(nodes.size());
+		nodes.emplace_back();
+		BVH::Node<N> wide;
+		for (int i = 0; i < N; i++) {
+			const Box box = i < nof_children ? children[i]->box : Box();
+			for (int axis = 0; axis < 3; axis++) {
+				wide.bounds[axis][i] = box.lower[axis];
+				wide.bounds[axis + 3][i] = box.upper[axis];
+			}
+			wide.child[i] = wide.count[i] = 0;
+			if (i >= nof_children) continue;
+			if (children[i]->isLeaf()) {
+				wide.child[i] = children[i]->first;
+				wide.count[i] = children[i]->count;
+			}
+			else {
+				wide.child[i] = collapse(children[i], nodes);
+			}
+		}
+		nodes[index] = wide;
+		return index;
+	}
+
+	int BVH::defaultWidth()
+	{
+#ifdef BVH_AVX
+		return 8;
+#else
+		return 4;
+#endif
+	}
+
+	BVH::BVH(int width)
+		: node_width(width == 8 ? 8 : 4), bounds_min(0.0f), bounds_max(0.0f)
+	{
+	}
+
+	void BVH::build(const vector<BVHTriangle> & input)
+	{
+		nodes4.clear();
+		nodes8.clear();
+		triangles.clear();
+		bounds_min = bounds_max = vec3(0.0f);
+		const int n = int(input.size());
+		if (n == 0) return;
+
+		Builder builder;
+		builder.boxes.resize(n);
+		builder.centroids.resize(n);
+		builder.references.resize(n);
+#pragma omp parallel for
+		for (int i = 0; i < n; i++) {
+			Box & box = builder.boxes[i];
+			box.grow(input[i].v0);
+			box.grow(input[i].v1);
+			box.grow(input[i].v2);
+			builder.centroids[i] = 0.5f * (box.lower + box.upper);
+			builder.references[i] = uint32_t(i);
+		}
+		unique_ptr<BuildNode> root;
+#pragma omp parallel
+		{
+#pragma omp single
+			root.reset(builder.build(0, uint32_t(n), 0));
+		}
+		bounds_min = root->box.lower;
+		bounds_max = root->box.upper;
+
+		triangles.resize(n);
+#pragma omp parallel for
+		for (int i = 0; i < n; i++) {
+			const BVHTriangle & t = input[builder.references[i]];
+			triangles[i] = { t.v0, t.v1 - t.v0, t.v2 - t.v0, t.geom_ID, t.prim_ID };
+		}
+		if (node_width == 8) collapse(root.get(), nodes8);
+		else collapse(root.get(), nodes4);
+	}
+
+	void BVH::buildScene()
+	{
+		const vector<SceneMesh> & meshes = getSceneMeshes();
+		size_t nof_triangles = 0;
+		vector<size_t> first_triangles;
+		for (auto & m : meshes) {
+			first_triangles.push_back(nof_triangles);
+			nof_triangles += m.mesh->m_number_of_vertices / 3;
+		}
+		vector<BVHTriangle> scene_triangles(nof_triangles);
+#pragma omp parallel for schedule(dynamic, 1)
+		for (int i = 0; i < int(meshes.size()); i++) {
+			const SceneMesh & m = meshes[i];
+			const vec3 * positions = &m.model->m_positions[m.mesh->m_start_index];
+			for (uint32_t t = 0; t < m.mesh->m_number_of_vertices / 3; t++) {
+				BVHTriangle & triangle = scene_triangles[first_triangles[i] + t];
+				triangle.v0 = vec3(m.model_matrix * vec4(positions[t * 3 + 0], 1.0f));
+				triangle.v1 = vec3(m.model_matrix * vec4(positions[t * 3 + 1], 1.0f));
+				triangle.v2 = vec3(m.model_matrix * vec4(positions[t * 3 + 2], 1.0f));
+				triangle.geom_ID = m.geom_ID;
+				triangle.prim_ID = t;
+			}
+		}
+		filter = scene_settings.alpha_test != ALPHA_TEST_OFF ? isOpaqueHit : nullptr;
+		build(scene_triangles);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// A ray as the node tests need it
+	///////////////////////////////////////////////////////////////////////////
+	struct TraversalRay
+	{
+		vec3 origin, inv_direction;
+		// The rows of Node::bounds with the near and far planes of each axis
+		int near[3], far[3];
+
+		TraversalRay(const Ray & ray) : origin(ray.o)
+		{
+			for (int axis = 0; axis < 3; axis++) {
+				// Parallel to the planes of an axis, no plane is ever hit
+				const float d = ray.d[axis];
+				inv_direction[axis] = 1.0f / (abs(d) > 1e-20f ? d : (d < 0.0f ? -1e-20f : 1e-20f));
+				near[axis] = d < 0.0f ? axis + 3 : axis;
+				far[axis] = d < 0.0f ? axis : axis + 3;
+			}
+		}
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Test a ray against the boxes of the children of a node. Returns a bit
+	// mask of the children that are hit, and their entry distances in t.
+	///////////////////////////////////////////////////////////////////////////
+	template <int N>
+	static inline uint32_t intersectChildren(const BVH::Node<N> & node, const TraversalRay & r, float tnear, float tfar, float * t)
+	{
+		uint32_t mask = 0;
+		for (int i = 0; i < N; i++) {
+			float t0 = tnear, t1 = tfar;
+			for (int axis = 0; axis < 3; axis++) {
+				t0 = std::max(t0, (node.bounds[r.near[axis]][i] - r.origin[axis]) * r.inv_direction[axis]);
+				t1 = std::min(t1, (node.bounds[r.far[axis]][i] - r.origin[axis]) * r.inv_direction[axis]);
+			}
+			t[i] = t0;
+			if (t0 <= t1) mask |= 1u << i;
+		}
+		return mask;
+	}
+
+	// Nodes are not aligned (std::vector does not align them), so the
+	// bounds are loaded unaligned
+#ifdef BVH_SSE
+	static inline uint32_t intersectChildren(const BVH::Node<4> & node, const TraversalRay & r, float tnear, float tfar, float * t)
+	{
+		__m128 t0 = _mm_set1_ps(tnear), t1 = _mm_set1_ps(tfar);
+		for (int axis = 0; axis < 3; axis++) {
+			const __m128 o = _mm_set1_ps(r.origin[axis]), inv_d = _mm_set1_ps(r.inv_direction[axis]);
+			t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.near[axis]]), o), inv_d));
+			t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.far[axis]]), o), inv_d));
+		}
+		_mm_storeu_ps(t, t0);
+		return uint32_t(_mm_movemask_ps(_mm_cmple_ps(t0, t1)));
+	}
+#endif
+#ifdef BVH_AVX
+	static inline uint32_t intersectChildren(const BVH::Node<8> & node, const TraversalRay & r, float tnear, float tfar, float * t)
+	{
+		__m256 t0 = _mm256_set1_ps(tnear), t1 = _mm256_set1_ps(tfar);
+		for (int axis = 0; axis < 3; axis++) {
+			const __m256 o = _mm256_set1_ps(r.origin[axis]), inv_d = _mm256_set1_ps(r.inv_direction[axis]);
+			t0 = _mm256_max_ps(t0, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.near[axis]]), o), inv_d));
+			t1 = _mm256_min_ps(t1, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.far[axis]]), o), inv_d));
+		}
+		_mm256_storeu_ps(t, t0);
+		return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+	}
+#endif
+
+	///////////////////////////////////////////////////////////////////////////
+	// Moller-Trumbore ray/triangle test. A hit closer than ray.tfar that the
+	// filter keeps is written to the ray.
+	///////////////////////////////////////////////////////////////////////////
+	static inline bool intersectTriangle(const BVH::Triangle & triangle, Ray & ray, BVHHitFilter filter)
+	{
+		const vec3 p = cross(ray.d, triangle.e2);
+		const float det = dot(triangle.e1, p);
+		if (det == 0.0f) return false;
+		const float inv_det = 1.0f / det;
+		const vec3 s = ray.o - triangle.v0;
+		const float u = dot(s, p) * inv_det;
+		if (u < 0.0f || u > 1.0f) return false;
+		const vec3 q = cross(s, triangle.e1);
+		const float v = dot(ray.d, q) * inv_det;
+		if (v < 0.0f || u + v > 1.0f) return false;
+		const float t = dot(triangle.e2, q) * inv_det;
+		if (!(t > ray.tnear && t < ray.tfar)) return false;
+		if (filter != nullptr && !filter(triangle.geom_ID, triangle.prim_ID, u, v)) return false;
+		ray.tfar = t;
+		ray.u = u;
+		ray.v = v;
+		ray.n = cross(triangle.e2, triangle.e1);
+		ray.geomID = triangle.geom_ID;
+		ray.primID = triangle.prim_ID;
+		ray.instID = RTC_INVALID_GEOMETRY_ID;
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Find the closest hit, or any hit
+	///////////////////////////////////////////////////////////////////////////
+	template <int N, bool ANY_HIT>
+	static bool traverse(const vector<BVH::Node<N>> & nodes, const vector<BVH::Triangle> & triangles,
+		BVHHitFilter filter, Ray & ray)
+	{
+		if (nodes.empty()) return false;
+		const TraversalRay r(ray);
+		struct Entry {
+			uint32_t node;
+			float t;
+		};
+		Entry stack[STACK_SIZE];
+		int size = 0;
+		stack[size++] = { 0, ray.tnear };
+		bool hit = false;
+		while (size > 0) {
+			const Entry entry = stack[--size];
+			// A closer hit has been found since the node was pushed
+			if (entry.t > ray.tfar) continue;
+			const BVH::Node<N> & node = nodes[entry.node];
+			float t[N];
+			const uint32_t mask = intersectChildren(node, r, ray.tnear, ray.tfar, t);
+			// Leaves are tested right away, child nodes are pushed
+			Entry children[N];
+			int nof_children = 0;
+			for (int i = 0; i < N; i++) {
+				if ((mask & (1u << i)) == 0) continue;
+				if (node.count[i] == 0) {
+					children[nof_children++] = { node.child[i], t[i] };
+					continue;
+				}
+				for (uint32_t k = node.child[i]; k < node.child[i] + node.count[i]; k++) {
+					if (intersectTriangle(triangles[k], ray, filter)) {
+						if (ANY_HIT) return true;
+						hit = true;
+					}
+				}
+			}
+			// The farthest first, so that the closest is traversed next
+			for (int i = 1; i < nof_children; i++) {
+				const Entry e = children[i];
+				int j = i;
+				for (; j > 0 && children[j - 1].t < e.t; j--) children[j] = children[j - 1];
+				children[j] = e;
+			}
+			for (int i = 0; i < nof_children; i++) stack[size++] = children[i];
+		}
+		return hit;
+	}
+
+	bool BVH::intersect(Ray & ray) const
+	{
+		if (node_width == 8) return traverse<8, false>(nodes8, triangles, filter, ray);
+		return traverse<4, false>(nodes4, triangles, filter, ray);
+	}
+
+	bool BVH::occluded(Ray & ray) const
+	{
+		// Only whether there is a hit is reported, like Embree does
+		Ray r = ray;
+		const bool hit = node_width == 8 ? traverse<8, true>(nodes8, triangles, filter, r) :
+			traverse<4, true>(nodes4, triangles, filter, r);
+		if (hit) ray.geomID = 0;
+		return hit;
+	}
+
+	void BVH::getBounds(vec3 & lower, vec3 & upper) const
+	{
+		lower = bounds_min;
+		upper = bounds_max;
+	}
+
+	size_t BVH::memoryUsage() const
+	{
+		return nodes4.size() * sizeof(Node<4>) + nodes8.size() * sizeof(Node<8>) + triangles.size() * sizeof(Triangle);
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include "embree.h"
+#include <glm/glm.hpp>
+#include <vector>
+#include <stdint.h>
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// In-tree ray tracing core, which traces the scene in builds without
+	// Embree (see PATHTRACER_EMBREE in CMakeLists.txt, and bvh_scene.cpp)
+	// and is compared with Embree by the benchmark (see bench.cpp).
+	//
+	// A binary BVH is built with binned SAH, with a task per subtree, and
+	// collapsed into a BVH of width 4 or 8. Its nodes hold the boxes of their
+	// children in arrays, so that a ray is tested against all of them at
+	// once with SSE (width 4) or AVX (width 8, if built with AVX). Leaves
+	// hold a few triangles, which are tested one by one with Moller-Trumbore.
+	// Hits are reported as Embree reports them: the barycentric coordinates
+	// u and v of the second and third vertex, and the unnormalized geometry
+	// normal (v0 - v1) x (v2 - v0).
+	///////////////////////////////////////////////////////////////////////////
+	struct BVHTriangle
+	{
+		glm::vec3 v0, v1, v2;
+		uint32_t geom_ID, prim_ID;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Called for each hit found during traversal, returns whether to keep it
+	// (like an Embree filter function)
+	///////////////////////////////////////////////////////////////////////////
+	typedef bool (*BVHHitFilter)(uint32_t geom_ID, uint32_t prim_ID, float u, float v);
+
+	class BVH
+	{
+	public:
+		// The widest node the build has SIMD instructions for
+		static int defaultWidth();
+		explicit BVH(int width = defaultWidth());
+
+		// Replaces the BVH. Not thread safe, the triangles are copied.
+		void build(const std::vector<BVHTriangle> & triangles);
+		// Build over the meshes of the scene (see getSceneMeshes()) in world
+		// space, skipping the transparent hits of alpha tested meshes
+		void buildScene();
+		// Find the closest hit between ray.tnear and ray.tfar
+		bool intersect(Ray & ray) const;
+		// Find any hit, and set geomID to 0 if there is one
+		bool occluded(Ray & ray) const;
+
+		void getBounds(glm::vec3 & bounds_min, glm::vec3 & bounds_max) const;
+		int width() const { return node_width; }
+		size_t memoryUsage() const;
+
+		BVHHitFilter filter = nullptr;
+
+		///////////////////////////////////////////////////////////////////////
+		// Internal: a node of a BVH of width N. The boxes of its children are
+		// stored as lower x, y, z and upper x, y, z arrays. Empty slots have
+		// inverted boxes, which no ray hits.
+		///////////////////////////////////////////////////////////////////////
+		template <int N>
+		struct Node
+		{
+			float bounds[6][N];
+			// The index of a child node, or of the first triangle of a leaf
+			uint32_t child[N];
+			// The number of triangles of a leaf, 0 for child nodes
+			uint32_t count[N];
+		};
+		// Triangles as Moller-Trumbore tests them, in the order of the leaves
+		struct Triangle
+		{
+			glm::vec3 v0, e1, e2;
+			uint32_t geom_ID, prim_ID;
+		};
+	private:
+		int node_width;
+		std::vector<Node<4>> nodes4;
+		std::vector<Node<8>> nodes8;
+		std::vector<Triangle> triangles;
+		glm::vec3 bounds_min, bounds_max;
+	};
+}
@@ -0,0 +1,70 @@
+#include "embree.h"
+#include "geometry.h"
+#include "bvh.h"
+#include "profiling.h"
+#include "threads.h"
+#include <iostream>
+
+using namespace std;
+using namespace glm;
+
+///////////////////////////////////////////////////////////////////////////////
+// The scene of embree.h, traced with the in-tree BVH (see bvh.h) in builds
+// without Embree. All meshes are in one BVH, in world space: models are not
+// instanced, so moving a model rebuilds the whole BVH, and the scene is not
+// replicated per NUMA node. Transparent hits of alpha tested meshes are
+// always skipped during traversal (ALPHA_TEST_RETRACE is the same as
+// ALPHA_TEST_FILTER).
+///////////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+	static BVH scene_bvh;
+
+	void getSceneBounds(vec3 & bounds_min, vec3 & bounds_max)
+	{
+		scene_bvh.getBounds(bounds_min, bounds_max);
+	}
+
+	void addModel(const labhelper::Model * model, const mat4 & model_matrix, bool animated)
+	{
+		static bool threads_are_initialized = false;
+		if (!threads_are_initialized) {
+			threads_are_initialized = true;
+			initializeThreads();
+		}
+		cout << "Adding " << model->m_name << " to the BVH scene..." << flush;
+		int nof_alpha_tested = 0;
+		for (auto & mesh : model->m_meshes) {
+			const uint32_t geom_ID = addMeshGeometry(model, mesh, model_matrix, false);
+			if (alpha_tested_meshes[geom_ID] != nullptr) nof_alpha_tested++;
+		}
+		if (nof_alpha_tested > 0) cout << "(" << nof_alpha_tested << " alpha tested meshes) ";
+		cout << "done.\n";
+	}
+
+	void setModelTransform(const labhelper::Model * model, const mat4 & model_matrix)
+	{
+		setMeshTransforms(model, model_matrix);
+	}
+
+	void buildBVH()
+	{
+		cout << "Building BVH" << scene_bvh.width() << "..." << flush;
+		scene_bvh.buildScene();
+		cout << "done (" << scene_bvh.memoryUsage() / (1024 * 1024) << " MB).\n";
+	}
+
+	bool intersect(Ray & r)
+	{
+		PROFILE_SCOPE(PROFILE_INTERSECT);
+		PROFILE_COUNT(PROFILE_RAYS, 1);
+		return scene_bvh.intersect(r);
+	}
+
+	bool occluded(Ray & r)
+	{
+		PROFILE_SCOPE(PROFILE_INTERSECT);
+		PROFILE_COUNT(PROFILE_SHADOW_RAYS, 1);
+		return scene_bvh.occluded(r);
+	}
+}
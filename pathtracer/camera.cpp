@@ -0,0 +1,163 @@
+#include "camera.h"
+#include "Pathtracer.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// The cube map faces, in the order of the image: the major axis, and the
+	// axes that the face coordinates s (left to right) and t (top to bottom)
+	// run along, as in the OpenGL specification
+	///////////////////////////////////////////////////////////////////////////
+	static const vec3 cube_face_axis[6][3] = {
+		{ vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 0.0f, -1.0f), vec3(0.0f, -1.0f, 0.0f) },
+		{ vec3(-1.0f, 0.0f, 0.0f), vec3(0.0f, 0.0f, 1.0f), vec3(0.0f, -1.0f, 0.0f) },
+		{ vec3(0.0f, 1.0f, 0.0f), vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 0.0f, 1.0f) },
+		{ vec3(0.0f, -1.0f, 0.0f), vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 0.0f, -1.0f) },
+		{ vec3(0.0f, 0.0f, 1.0f), vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, -1.0f, 0.0f) },
+		{ vec3(0.0f, 0.0f, -1.0f), vec3(-1.0f, 0.0f, 0.0f), vec3(0.0f, -1.0f, 0.0f) }
+	};
+
+	Camera::Camera(const vec3 & _position, const vec3 & _direction, const vec3 & _up, float _fov, float _aspect_ratio,
+		int _projection)
+		: position(_position), direction(_direction), fov(_fov), aspect_ratio(_aspect_ratio), projection(_projection)
+	{
+		right = normalize(cross(direction, _up));
+		up = normalize(cross(right, direction));
+		// Calculate the lower left corner of a virtual screen, a vector X
+		// that points from there to the lower left corner, and a vector Y
+		// that points to the upper left corner
+		vec3 A = direction * cos(fov / 2.0f * (M_PI / 180.0f));
+		vec3 B = up * sin(fov / 2.0f * (M_PI / 180.0f));
+		vec3 C = right * sin(fov / 2.0f * (M_PI / 180.0f)) * aspect_ratio;
+		lower_right_corner = A - C - B;
+		X = 2.0f * ((A - B) - lower_right_corner);
+		Y = 2.0f * ((A - C) - lower_right_corner);
+	}
+
+	vec3 Camera::panoramaDirection(const vec2 & screen_coord, vec3 & dx, vec3 & dy) const
+	{
+		if (projection == EQUIRECTANGULAR) {
+			// The top row of the image looks up, like the environment maps
+			const float phi = 2.0f * M_PI * screen_coord.x;
+			const float theta = M_PI * (1.0f - screen_coord.y);
+			const float sin_theta = sin(theta), cos_theta = cos(theta);
+			const float sin_phi = sin(phi), cos_phi = cos(phi);
+			dx = 2.0f * M_PI * vec3(-sin_theta * sin_phi, 0.0f, sin_theta * cos_phi);
+			dy = -M_PI * vec3(cos_theta * cos_phi, -sin_theta, cos_theta * sin_phi);
+			return vec3(sin_theta * cos_phi, cos_theta, sin_theta * sin_phi);
+		}
+		// A 90 degree pinhole per face, with d = v / |v| as in
+		// rayDifferential()
+		const int face = clamp(int(screen_coord.x * 6.0f), 0, 5);
+		const vec3 * axis = cube_face_axis[face];
+		const float s = screen_coord.x * 6.0f - float(face), t = 1.0f - screen_coord.y;
+		const vec3 v = axis[0] + (2.0f * s - 1.0f) * axis[1] + (2.0f * t - 1.0f) * axis[2];
+		const float inv_length = 1.0f / length(v);
+		const vec3 d = v * inv_length;
+		const vec3 dvdx = 12.0f * axis[1], dvdy = -2.0f * axis[2];
+		dx = (dvdx - dot(d, dvdx) * d) * inv_length;
+		dy = (dvdy - dot(d, dvdy) * d) * inv_length;
+		return d;
+	}
+
+	vec2 Camera::panoramaScreenCoord(const vec3 & d) const
+	{
+		if (projection == EQUIRECTANGULAR) {
+			// (acos() is imprecise near the poles, and the coordinates may
+			// round up to 1)
+			const float theta = atan(length(vec2(d.x, d.z)), d.y);
+			float phi = atan(d.z, d.x);
+			if (phi < 0.0f) phi += 2.0f * M_PI;
+			const float x = phi / (2.0f * M_PI);
+			return vec2(x < 1.0f ? x : 0.0f, std::min(1.0f - theta / M_PI, std::nextafter(1.0f, 0.0f)));
+		}
+		const vec3 a = abs(d);
+		const int face = a.x >= a.y && a.x >= a.z ? (d.x > 0.0f ? 0 : 1) :
+			a.y >= a.z ? (d.y > 0.0f ? 2 : 3) : (d.z > 0.0f ? 4 : 5);
+		const vec3 * axis = cube_face_axis[face];
+		const float major = dot(d, axis[0]);
+		const float s = 0.5f * (dot(d, axis[1]) / major + 1.0f), t = 0.5f * (dot(d, axis[2]) / major + 1.0f);
+		return vec2((float(face) + s) / 6.0f, 1.0f - t);
+	}
+
+	float Camera::panoramaPdf(const vec3 & d) const
+	{
+		if (projection == EQUIRECTANGULAR) {
+			// dw = sin(theta) dtheta dphi = 2 pi^2 sin(theta) dx dy
+			const float sin_theta = length(vec2(d.x, d.z));
+			return sin_theta > 0.0f ? 1.0f / (2.0f * M_PI * M_PI * sin_theta) : 0.0f;
+		}
+		// The pinhole pdf of a face, which is picked with probability 1/6.
+		// The screen plane of a face is at distance 1 and 2 wide and high.
+		const vec3 a = abs(d);
+		const float cos_theta = std::max(a.x, std::max(a.y, a.z));
+		return 1.0f / (24.0f * cos_theta * cos_theta * cos_theta);
+	}
+
+	vec3 Camera::rayDirection(const vec2 & screen_coord) const
+	{
+		if (projection != PINHOLE) {
+			vec3 dx, dy;
+			const vec3 d = panoramaDirection(screen_coord, dx, dy);
+			return d.x * right + d.y * up - d.z * direction;
+		}
+		return normalize(lower_right_corner + screen_coord.x * X + screen_coord.y * Y);
+	}
+
+	RayDifferential Camera::rayDifferential(const vec2 & screen_coord, int width, int height) const
+	{
+		if (projection != PINHOLE) {
+			vec3 dx, dy;
+			panoramaDirection(screen_coord, dx, dy);
+			RayDifferential rd;
+			rd.dddx = (dx.x * right + dx.y * up - dx.z * direction) / float(width);
+			rd.dddy = (dy.x * right + dy.y * up - dy.z * direction) / float(height);
+			return rd;
+		}
+		// d = v / |v| gives dd = (dv - (d . dv) d) / |v|
+		const vec3 v = lower_right_corner + screen_coord.x * X + screen_coord.y * Y;
+		const float inv_length = 1.0f / length(v);
+		const vec3 d = v * inv_length;
+		const vec3 dvdx = X / float(width), dvdy = Y / float(height);
+		RayDifferential rd;
+		rd.dddx = (dvdx - dot(d, dvdx) * d) * inv_length;
+		rd.dddy = (dvdy - dot(d, dvdy) * d) * inv_length;
+		return rd;
+	}
+
+	bool Camera::project(const vec3 & p, vec2 & screen_coord) const
+	{
+		const vec3 d = p - position;
+		if (projection != PINHOLE) {
+			if (d == vec3(0.0f)) return false;
+			screen_coord = panoramaScreenCoord(normalize(vec3(dot(d, right), dot(d, up), -dot(d, direction))));
+			return screen_coord.x >= 0.0f && screen_coord.x < 1.0f && screen_coord.y >= 0.0f && screen_coord.y < 1.0f;
+		}
+		const float z = dot(d, direction);
+		if (z <= 0.0f) return false;
+		// Scale d so that it ends on the screen plane
+		const vec3 q = d * (dot(lower_right_corner, direction) / z) - lower_right_corner;
+		screen_coord = vec2(dot(q, X) / dot(X, X), dot(q, Y) / dot(Y, Y));
+		return screen_coord.x >= 0.0f && screen_coord.x < 1.0f && screen_coord.y >= 0.0f && screen_coord.y < 1.0f;
+	}
+
+	float Camera::pdfDirection(const vec3 & d) const
+	{
+		if (projection != PINHOLE) {
+			return panoramaPdf(normalize(vec3(dot(d, right), dot(d, up), -dot(d, direction))));
+		}
+		///////////////////////////////////////////////////////////////////////
+		// A screen point at distance r and angle theta to the view direction
+		// covers dA = r^2 / cos(theta) dw. With r = s / cos(theta), where s 
+		// is the distance to the screen plane, we get the pdf below.
+		///////////////////////////////////////////////////////////////////////
+		const float cos_theta = dot(normalize(d), direction);
+		if (cos_theta <= 0.0f) return 0.0f;
+		const float s = dot(lower_right_corner, direction);
+		return (s * s) / (length(X) * length(Y) * cos_theta * cos_theta * cos_theta);
+	}
+}
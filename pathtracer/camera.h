@@ -0,0 +1,59 @@
+#pragma once
+#include <glm/glm.hpp>
+#include "raydifferential.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// How screen coordinates map to ray directions. The panoramas see all
+	// directions, in the frame of the camera (x is right, y is up and z is
+	// -direction), so that a camera looking down -z with y up renders them
+	// in world space:
+	//   EQUIRECTANGULAR: longitude and latitude like the environment maps
+	//     (see Lenvironment()), for an image twice as wide as high
+	//   CUBEMAP: the faces +x, -x, +y, -y, +z, -z from left to right, each
+	//     oriented like an OpenGL cube map face, for an image six times as
+	//     wide as high
+	///////////////////////////////////////////////////////////////////////////
+	enum Projection {
+		PINHOLE = 0,
+		EQUIRECTANGULAR = 1,
+		CUBEMAP = 2
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// A camera at a point. The pinhole camera shoots rays through a virtual
+	// screen, spanned by the vectors X and Y from its lower right corner.
+	// Screen coordinates are in [0,1]^2, from the lower left corner of the
+	// image.
+	///////////////////////////////////////////////////////////////////////////
+	struct Camera
+	{
+		vec3 position, direction, up, right;
+		float fov, aspect_ratio;
+		vec3 lower_right_corner, X, Y;
+		int projection = PINHOLE;
+		Camera() {}
+		// fov and aspect_ratio only apply to the pinhole camera
+		Camera(const vec3 & position, const vec3 & direction, const vec3 & up, float fov, float aspect_ratio,
+			int projection = PINHOLE);
+		// The (normalized) direction of the ray through a screen coordinate
+		vec3 rayDirection(const vec2 & screen_coord) const;
+		// The differential of the ray through a screen coordinate, for an
+		// image of the given resolution
+		RayDifferential rayDifferential(const vec2 & screen_coord, int width, int height) const;
+		// Find the screen coordinate that p projects to. Returns false if p is
+		// not visible on screen.
+		bool project(const vec3 & p, vec2 & screen_coord) const;
+		// The solid angle pdf of direction d, when rays are generated through
+		// uniformly distributed screen coordinates
+		float pdfDirection(const vec3 & d) const;
+	private:
+		// The panoramas, with directions in the camera frame
+		vec3 panoramaDirection(const vec2 & screen_coord, vec3 & dx, vec3 & dy) const;
+		vec2 panoramaScreenCoord(const vec3 & d) const;
+		float panoramaPdf(const vec3 & d) const;
+	};
+}
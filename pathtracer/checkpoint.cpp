@@ -0,0 +1,389 @@
+#include "checkpoint.h"
+#include <iostream>
+#include <cstring>
+#include <cstddef>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Pathtracer.h"
+#include "sampling.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	CheckpointSettings checkpoint_settings = { true, 30.0f, "pathtracer.checkpoint" };
+
+	///////////////////////////////////////////////////////////////////////////
+	// File layout: a FileHeader, then two slots (page aligned), each of
+	// which is a SlotHeader followed by width * height pixels
+	///////////////////////////////////////////////////////////////////////////
+	const char checkpoint_magic[8] = { 'P', 'T', 'C', 'K', 'P', 'T', '\0', '\0' };
+	const uint32_t checkpoint_version = 3;
+
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t header_size;
+		int32_t width, height;
+		uint64_t slot_offset[2];
+	};
+
+	struct SlotHeader {
+		// Zero if the slot has never been written. Written last, after the
+		// rest of the slot is on disk.
+		uint64_t sequence;
+		// Of everything in the slot after this field
+		uint64_t checksum;
+		int32_t number_of_samples;
+		// The seed the random number generators had when rendering started
+		uint32_t random_seed;
+		vec3 camera_pos, camera_dir, camera_up;
+		int32_t subsampling;
+		int32_t max_bounces;
+		int32_t integrator;
+		int32_t path_guiding;
+		int32_t use_radiance_cache;
+		int32_t projection;
+		// Pixels outside of the crop region hold the image from before it
+		// was set
+		int32_t use_crop;
+		vec2 crop_min, crop_max;
+	};
+
+	static size_t slotSize(int width, int height)
+	{
+		const size_t page = size_t(sysconf(_SC_PAGESIZE));
+		const size_t size = sizeof(SlotHeader) + size_t(width) * size_t(height) * sizeof(vec3);
+		return (size + page - 1) / page * page;
+	}
+
+	static size_t fileSize(int width, int height)
+	{
+		return size_t(sysconf(_SC_PAGESIZE)) + 2 * slotSize(width, height);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// FNV-1a over 64 bit words (sizes are multiples of 4 bytes, so there is
+	// at most one 32 bit word left over)
+	///////////////////////////////////////////////////////////////////////////
+	static uint64_t checksum(const void * data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+	{
+		const uint8_t * p = (const uint8_t *)data;
+		for (; size >= 8; p += 8, size -= 8) {
+			uint64_t word;
+			memcpy(&word, p, 8);
+			hash = (hash ^ word) * 0x100000001b3ull;
+		}
+		for (; size > 0; p++, size--) hash = (hash ^ *p) * 0x100000001b3ull;
+		return hash;
+	}
+
+	static uint64_t slotChecksum(const SlotHeader & header, const vec3 * pixels, size_t nof_pixels)
+	{
+		const uint8_t * fields = (const uint8_t *)&header + offsetof(SlotHeader, number_of_samples);
+		const uint64_t hash = checksum(fields, sizeof(SlotHeader) - offsetof(SlotHeader, number_of_samples));
+		return checksum(pixels, nof_pixels * sizeof(vec3), hash);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The mapped checkpoint file
+	///////////////////////////////////////////////////////////////////////////
+	struct MappedFile {
+		int fd = -1;
+		uint8_t * data = nullptr;
+		size_t size = 0;
+		// Where the newest complete checkpoint is (when writing)
+		int newest_slot = -1;
+		uint64_t newest_sequence = 0;
+		FileHeader * header() const { return (FileHeader *)data; }
+		SlotHeader * slot(int i) const { return (SlotHeader *)(data + header()->slot_offset[i]); }
+		vec3 * pixels(int i) const { return (vec3 *)(slot(i) + 1); }
+		bool isOpen() const { return data != nullptr; }
+	};
+
+	static void closeFile(MappedFile & file)
+	{
+		if (file.data != nullptr) munmap(file.data, file.size);
+		if (file.fd >= 0) close(file.fd);
+		file = MappedFile();
+	}
+
+	static bool mapFile(MappedFile & file, const string & filename, bool writable)
+	{
+		file.fd = open(filename.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+		if (file.fd < 0) return false;
+		struct stat info;
+		if (fstat(file.fd, &info) != 0) {
+			closeFile(file);
+			return false;
+		}
+		file.size = size_t(info.st_size);
+		if (file.size < sizeof(FileHeader)) {
+			// A new (empty) file is sized by openForWriting
+			if (writable) return true;
+			closeFile(file);
+			return false;
+		}
+		void * data = mmap(nullptr, file.size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file.fd, 0);
+		if (data == MAP_FAILED) {
+			closeFile(file);
+			return false;
+		}
+		file.data = (uint8_t *)data;
+		return true;
+	}
+
+	static bool hasValidHeader(const MappedFile & file, int width, int height)
+	{
+		const FileHeader * h = file.header();
+		return file.size >= sizeof(FileHeader) &&
+			memcmp(h->magic, checkpoint_magic, sizeof(checkpoint_magic)) == 0 &&
+			h->version == checkpoint_version && h->header_size == sizeof(FileHeader) &&
+			(width < 0 || (h->width == width && h->height == height)) &&
+			file.size >= fileSize(h->width, h->height);
+	}
+
+	// The slot with the newest complete checkpoint, or -1
+	static int newestSlot(const MappedFile & file)
+	{
+		const size_t nof_pixels = size_t(file.header()->width) * size_t(file.header()->height);
+		int newest = -1;
+		for (int i = 0; i < 2; i++) {
+			const SlotHeader * slot = file.slot(i);
+			if (slot->sequence == 0) continue;
+			if (newest >= 0 && slot->sequence < file.slot(newest)->sequence) continue;
+			if (slot->checksum != slotChecksum(*slot, file.pixels(i), nof_pixels)) continue;
+			newest = i;
+		}
+		return newest;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// (Re)create the file for a new image size. Keeps the existing file if
+	// it already has the right size, so that its checkpoints survive until
+	// they are replaced.
+	///////////////////////////////////////////////////////////////////////////
+	static bool openForWriting(MappedFile & file, const string & filename, int width, int height)
+	{
+		if (file.isOpen() && hasValidHeader(file, width, height)) return true;
+		closeFile(file);
+		if (!mapFile(file, filename, true)) return false;
+		if (file.isOpen() && hasValidHeader(file, width, height)) {
+			file.newest_slot = newestSlot(file);
+			file.newest_sequence = file.newest_slot < 0 ? 0 : file.slot(file.newest_slot)->sequence;
+			return true;
+		}
+		if (file.data != nullptr) munmap(file.data, file.size);
+		file.data = nullptr;
+		file.size = fileSize(width, height);
+		if (ftruncate(file.fd, 0) != 0 || ftruncate(file.fd, off_t(file.size)) != 0) {
+			closeFile(file);
+			return false;
+		}
+		void * data = mmap(nullptr, file.size, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+		if (data == MAP_FAILED) {
+			closeFile(file);
+			return false;
+		}
+		file.data = (uint8_t *)data;
+		FileHeader * h = file.header();
+		memcpy(h->magic, checkpoint_magic, sizeof(checkpoint_magic));
+		h->version = checkpoint_version;
+		h->header_size = sizeof(FileHeader);
+		h->width = width;
+		h->height = height;
+		h->slot_offset[0] = size_t(sysconf(_SC_PAGESIZE));
+		h->slot_offset[1] = h->slot_offset[0] + slotSize(width, height);
+		// The new (zero filled) slots have sequence 0, so they are empty
+		return msync(file.data, file.size, MS_SYNC) == 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The background writer. The render thread fills `pending` and flags it
+	// (if the writer is not busy with the previous one); the writer swaps it
+	// with its own buffer and writes that without holding the lock.
+	///////////////////////////////////////////////////////////////////////////
+	struct Snapshot {
+		SlotHeader header;
+		int width = 0, height = 0;
+		vector<vec3> pixels;
+	};
+
+	static struct Writer {
+		thread worker;
+		mutex lock;
+		condition_variable wake, written;
+		bool has_pending = false, busy = false, quit = false;
+		Snapshot pending, writing;
+		MappedFile file;
+		atomic<int> last_samples{ 0 };
+		chrono::steady_clock::time_point last_checkpoint = chrono::steady_clock::now();
+	} writer;
+
+	// The seed given to the random number generators when rendering
+	// started (0 if they were never reseeded)
+	static uint32_t random_seed = 0;
+
+	static void writeSnapshot(const Snapshot & snapshot)
+	{
+		MappedFile & file = writer.file;
+		if (!openForWriting(file, checkpoint_settings.filename, snapshot.width, snapshot.height)) {
+			cout << "ERROR: Could not open checkpoint file " << checkpoint_settings.filename << "\n";
+			return;
+		}
+		const int target = file.newest_slot == 0 ? 1 : 0;
+		SlotHeader * slot = file.slot(target);
+		// The sequence number of the snapshot is 0, so the slot is invalid
+		// until it is complete
+		*slot = snapshot.header;
+		memcpy(file.pixels(target), snapshot.pixels.data(), snapshot.pixels.size() * sizeof(vec3));
+		slot->checksum = slotChecksum(snapshot.header, snapshot.pixels.data(), snapshot.pixels.size());
+		const size_t size = sizeof(SlotHeader) + snapshot.pixels.size() * sizeof(vec3);
+		if (msync(slot, size, MS_SYNC) != 0) return;
+		// Only now is the slot marked as the newest checkpoint
+		slot->sequence = file.newest_sequence + 1;
+		if (msync(slot, size_t(sysconf(_SC_PAGESIZE)), MS_SYNC) != 0) return;
+		file.newest_slot = target;
+		file.newest_sequence = slot->sequence;
+		writer.last_samples = snapshot.header.number_of_samples;
+	}
+
+	static void writerThread()
+	{
+		unique_lock<mutex> guard(writer.lock);
+		while (true) {
+			writer.wake.wait(guard, [] { return writer.has_pending || writer.quit; });
+			if (!writer.has_pending) break;
+			swap(writer.pending, writer.writing);
+			writer.has_pending = false;
+			writer.busy = true;
+			guard.unlock();
+			writeSnapshot(writer.writing);
+			guard.lock();
+			writer.busy = false;
+			writer.written.notify_all();
+		}
+	}
+
+	// Hand the current image to the writer. Returns false if the writer is
+	// still busy with the previous checkpoint (and wait is false).
+	static bool takeSnapshot(const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up, bool wait)
+	{
+		unique_lock<mutex> guard(writer.lock);
+		if (wait) writer.written.wait(guard, [] { return !writer.has_pending && !writer.busy; });
+		if (writer.has_pending || writer.busy) return false;
+		Snapshot & s = writer.pending;
+		memset(&s.header, 0, sizeof(s.header));
+		s.header.number_of_samples = rendered_image.number_of_samples;
+		s.header.random_seed = random_seed;
+		s.header.camera_pos = camera_pos;
+		s.header.camera_dir = camera_dir;
+		s.header.camera_up = camera_up;
+		s.header.subsampling = settings.subsampling;
+		s.header.max_bounces = settings.max_bounces;
+		s.header.integrator = settings.integrator;
+		s.header.path_guiding = settings.path_guiding ? 1 : 0;
+		s.header.use_radiance_cache = settings.use_radiance_cache ? 1 : 0;
+		s.header.projection = settings.projection;
+		s.header.use_crop = settings.use_crop ? 1 : 0;
+		s.header.crop_min = settings.crop_min;
+		s.header.crop_max = settings.crop_max;
+		s.width = rendered_image.width;
+		s.height = rendered_image.height;
+		s.pixels.assign(rendered_image.data.begin(), rendered_image.data.end());
+		writer.has_pending = true;
+		if (!writer.worker.joinable()) writer.worker = thread(writerThread);
+		writer.wake.notify_one();
+		return true;
+	}
+
+	static bool shouldCheckpoint()
+	{
+		return checkpoint_settings.enabled && settings.integrator != PHOTON_MAPPING &&
+			rendered_image.number_of_samples > 0;
+	}
+
+	void updateCheckpoint(const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up)
+	{
+		if (!shouldCheckpoint()) return;
+		const auto now = chrono::steady_clock::now();
+		if (chrono::duration<float>(now - writer.last_checkpoint).count() < checkpoint_settings.interval) return;
+		if (takeSnapshot(camera_pos, camera_dir, camera_up, false)) writer.last_checkpoint = now;
+	}
+
+	void finishCheckpoints(const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up)
+	{
+		if (shouldCheckpoint()) takeSnapshot(camera_pos, camera_dir, camera_up, true);
+		{
+			lock_guard<mutex> guard(writer.lock);
+			writer.quit = true;
+		}
+		writer.wake.notify_one();
+		if (writer.worker.joinable()) writer.worker.join();
+		closeFile(writer.file);
+	}
+
+	int lastCheckpointSamples()
+	{
+		return writer.last_samples;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Resume
+	///////////////////////////////////////////////////////////////////////////
+	bool resumeFromCheckpoint(int window_width, int window_height, vec3 & camera_pos, vec3 & camera_dir, vec3 & camera_up)
+	{
+		MappedFile file;
+		if (!mapFile(file, checkpoint_settings.filename, false)) return false;
+		const int newest = hasValidHeader(file, -1, -1) ? newestSlot(file) : -1;
+		if (newest < 0) {
+			closeFile(file);
+			return false;
+		}
+		const SlotHeader & slot = *file.slot(newest);
+		const int width = file.header()->width, height = file.header()->height;
+		if (slot.subsampling < 1 || window_width / slot.subsampling != width || window_height / slot.subsampling != height) {
+			cout << "Not resuming from " << checkpoint_settings.filename << ", it was rendered at another size.\n";
+			closeFile(file);
+			return false;
+		}
+		settings.subsampling = slot.subsampling;
+		settings.max_bounces = slot.max_bounces;
+		settings.integrator = slot.integrator;
+		settings.path_guiding = slot.path_guiding != 0;
+		settings.use_radiance_cache = slot.use_radiance_cache != 0;
+		settings.projection = slot.projection;
+		settings.use_crop = slot.use_crop != 0;
+		settings.crop_min = slot.crop_min;
+		settings.crop_max = slot.crop_max;
+		camera_pos = slot.camera_pos;
+		camera_dir = slot.camera_dir;
+		camera_up = slot.camera_up;
+		resize(window_width, window_height);
+		memcpy(rendered_image.data.data(), file.pixels(newest), rendered_image.data.size() * sizeof(vec3));
+		rendered_image.number_of_samples = slot.number_of_samples;
+		writer.last_samples = slot.number_of_samples;
+		///////////////////////////////////////////////////////////////////////
+		// Generators seeded as before would repeat the samples that are
+		// already in the image, so derive a new seed from the old one and
+		// the number of samples taken with it.
+		///////////////////////////////////////////////////////////////////////
+		random_seed = (slot.random_seed ^ 0x5bd1e995u) * 0x9E3779B9u + uint32_t(slot.number_of_samples);
+		seedRandom(random_seed);
+		cout << "Resumed from " << checkpoint_settings.filename << " at " << slot.number_of_samples << " samples per pixel.\n";
+		closeFile(file);
+		return true;
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <stdint.h>
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Checkpoint settings
+	///////////////////////////////////////////////////////////////////////////
+	extern struct CheckpointSettings {
+		bool enabled;
+		// Seconds between checkpoints
+		float interval;
+		std::string filename;
+	} checkpoint_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Checkpoints of the accumulated image are kept in a memory mapped file
+	// with a versioned header and two slots. Each checkpoint goes to the slot
+	// that does not hold the newest one, and is only marked as valid (with a
+	// sequence number and checksum) once all of it has been written, so the
+	// file always holds at least one complete checkpoint. The image is
+	// copied and then written by a background thread, so tracing goes on
+	// while the file is updated.
+	///////////////////////////////////////////////////////////////////////////
+
+	///////////////////////////////////////////////////////////////////////////
+	// Call after each pass. Takes a checkpoint if checkpoints are enabled,
+	// interval seconds have passed since the last one, and the last one has
+	// been written. Photon mapping renders are not checkpointed, since the
+	// image is only a small part of their state.
+	///////////////////////////////////////////////////////////////////////////
+	void updateCheckpoint(const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Continue from the newest checkpoint in the checkpoint file, if it was
+	// rendered at the given window size. Restores the image, the settings
+	// that affect it (including the crop region) and the camera (with its
+	// projection), and reseeds the random number generators so that the
+	// samples that were already taken are not repeated. Returns false (and
+	// changes nothing) if there is no usable checkpoint.
+	///////////////////////////////////////////////////////////////////////////
+	bool resumeFromCheckpoint(int window_width, int window_height, vec3 & camera_pos, vec3 & camera_dir, vec3 & camera_up);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Write a last checkpoint (waiting for it), and stop the writer thread
+	///////////////////////////////////////////////////////////////////////////
+	void finishCheckpoints(const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Number of samples per pixel in the last checkpoint that was written
+	///////////////////////////////////////////////////////////////////////////
+	int lastCheckpointSamples();
+}
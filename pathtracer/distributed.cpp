@@ -0,0 +1,359 @@
+#include "distributed.h"
+#include <iostream>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "guiding.h"
+#include "net.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	DistributedSettings distributed_settings = { 8, 60.0f, 0 };
+
+	///////////////////////////////////////////////////////////////////////////
+	// Protocol. A worker says HELLO, the coordinator answers with the JOB and
+	// then sends one CHUNK at a time, which the worker answers with a RESULT
+	// (the header followed by the per pixel sums). DONE ends the job.
+	///////////////////////////////////////////////////////////////////////////
+	enum MessageType : uint32_t {
+		HELLO = 1,
+		JOB = 2,
+		CHUNK = 3,
+		RESULT = 4,
+		DONE = 5
+	};
+
+	const uint32_t protocol_magic = 0x50544431; // "PTD1"
+	const uint32_t protocol_version = 2;
+
+	struct HelloMessage {
+		uint32_t magic, version;
+	};
+
+	struct JobMessage {
+		int32_t width, height;
+		vec3 camera_pos, camera_dir, camera_up;
+		int32_t max_bounces;
+		int32_t integrator;
+		int32_t path_guiding;
+		uint32_t seed;
+		int32_t use_crop;
+		vec2 crop_min, crop_max;
+	};
+
+	struct ChunkMessage {
+		uint32_t id;
+		uint32_t first_sample;
+		uint32_t nof_samples;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// The seed of one sample of the image
+	///////////////////////////////////////////////////////////////////////////
+	static uint32_t sampleSeed(uint32_t seed, uint32_t sample)
+	{
+		return seed ^ (sample * 0x9E3779B9u);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Coordinator
+	///////////////////////////////////////////////////////////////////////////
+	struct WorkerConnection {
+		// The chunk this worker is rendering, or -1
+		int chunk = -1;
+		bool has_job = false;
+	};
+
+	static bool writeCheckpoint(const string & filename)
+	{
+		// Write to a temporary file first, so that a crash while writing
+		// never destroys the last good checkpoint
+		const string temporary = filename + ".tmp";
+		if (!saveImage(temporary) || rename(temporary.c_str(), filename.c_str()) != 0) {
+			cout << "ERROR: Could not write " << filename << "\n";
+			return false;
+		}
+		return true;
+	}
+
+	bool runCoordinator(const string & address, const RenderJob & job, const string & output_filename)
+	{
+		if (settings.integrator == PHOTON_MAPPING) {
+			// The progressive radius reduction of each pixel depends on all
+			// earlier passes, so independent estimates can not be merged
+			cout << "ERROR: Photon mapping can not be used for distributed rendering.\n";
+			return false;
+		}
+		const int listen_socket = listenOn(address);
+		if (listen_socket < 0) {
+			cout << "ERROR: Could not listen on " << address << "\n";
+			return false;
+		}
+
+		JobMessage job_message;
+		job_message.width = job.width;
+		job_message.height = job.height;
+		job_message.camera_pos = job.camera_pos;
+		job_message.camera_dir = job.camera_dir;
+		job_message.camera_up = job.camera_up;
+		job_message.max_bounces = settings.max_bounces;
+		job_message.integrator = settings.integrator;
+		job_message.path_guiding = settings.path_guiding ? 1 : 0;
+		job_message.seed = distributed_settings.seed;
+		job_message.use_crop = job.use_crop ? 1 : 0;
+		job_message.crop_min = job.crop_min;
+		job_message.crop_max = job.crop_max;
+
+		///////////////////////////////////////////////////////////////////////
+		// Split the samples into chunks
+		///////////////////////////////////////////////////////////////////////
+		const int samples_per_chunk = std::max(1, distributed_settings.samples_per_chunk);
+		vector<ChunkMessage> chunks;
+		for (int first = 0; first < job.samples; first += samples_per_chunk) {
+			chunks.push_back({ uint32_t(chunks.size()), uint32_t(first), uint32_t(std::min(samples_per_chunk, job.samples - first)) });
+		}
+		deque<int> pending;
+		for (size_t i = 0; i < chunks.size(); i++) pending.push_back(int(i));
+		vector<bool> chunk_done(chunks.size(), false);
+
+		const size_t nof_pixels = size_t(job.width) * size_t(job.height);
+		vector<dvec3> sums(nof_pixels, dvec3(0.0));
+		int samples_done = 0;
+		rendered_image.width = job.width;
+		rendered_image.height = job.height;
+		rendered_image.data.assign(nof_pixels, vec3(0.0f));
+		rendered_image.number_of_samples = 0;
+
+		map<int, WorkerConnection> workers;
+		auto dropWorker = [&](int s, const char * reason) {
+			const int chunk = workers[s].chunk;
+			if (chunk >= 0 && !chunk_done[chunk]) pending.push_front(chunk);
+			cout << "Coordinator: lost worker " << s << " (" << reason << ")" <<
+				(chunk >= 0 ? ", chunk " + to_string(chunk) + " will be rendered again" : "") << "\n";
+			closeConnection(s);
+			workers.erase(s);
+		};
+		// Give an idle worker the next chunk, if there is one
+		auto assignChunk = [&](int s) -> bool {
+			WorkerConnection & worker = workers[s];
+			if (!worker.has_job || worker.chunk >= 0 || pending.empty()) return true;
+			worker.chunk = pending.front();
+			pending.pop_front();
+			return sendMessage(s, CHUNK, &chunks[worker.chunk], sizeof(ChunkMessage));
+		};
+
+		cout << "Coordinator: rendering " << job.samples << " samples of " << job.width << "x" << job.height <<
+			" in " << chunks.size() << " chunks, waiting for workers on " << address << "\n";
+		auto last_checkpoint = chrono::steady_clock::now();
+		vector<uint8_t> payload;
+		while (samples_done < job.samples) {
+			vector<pollfd> fds;
+			fds.push_back({ listen_socket, POLLIN, 0 });
+			for (auto & worker : workers) fds.push_back({ worker.first, POLLIN, 0 });
+			if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) {
+				cout << "ERROR: poll() failed\n";
+				break;
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// New workers
+			///////////////////////////////////////////////////////////////////
+			if (fds[0].revents & POLLIN) {
+				const int s = acceptConnection(listen_socket);
+				if (s >= 0) {
+					workers[s] = WorkerConnection();
+					cout << "Coordinator: worker " << s << " connected (" << workers.size() << " workers)\n";
+				}
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Messages from (or disconnected) workers
+			///////////////////////////////////////////////////////////////////
+			for (size_t i = 1; i < fds.size(); i++) {
+				if (fds[i].revents == 0) continue;
+				const int s = fds[i].fd;
+				uint32_t type;
+				if (!receiveMessage(s, type, payload)) {
+					dropWorker(s, "connection closed");
+					continue;
+				}
+				WorkerConnection & worker = workers[s];
+				if (type == HELLO) {
+					HelloMessage hello = { 0, 0 };
+					if (payload.size() == sizeof(hello)) memcpy(&hello, payload.data(), sizeof(hello));
+					if (hello.magic != protocol_magic || hello.version != protocol_version) {
+						dropWorker(s, "incompatible worker");
+						continue;
+					}
+					if (!sendMessage(s, JOB, &job_message, sizeof(job_message))) {
+						dropWorker(s, "send failed");
+						continue;
+					}
+					worker.has_job = true;
+				}
+				else if (type == RESULT) {
+					ChunkMessage chunk;
+					if (payload.size() != sizeof(chunk) + nof_pixels * sizeof(vec3)) {
+						dropWorker(s, "malformed result");
+						continue;
+					}
+					memcpy(&chunk, payload.data(), sizeof(chunk));
+					if (int(chunk.id) != worker.chunk) {
+						dropWorker(s, "unexpected result");
+						continue;
+					}
+					worker.chunk = -1;
+					// If the chunk was handed out again it may already be done
+					if (!chunk_done[chunk.id]) {
+						chunk_done[chunk.id] = true;
+						const float * pixel_sums = (const float *)(payload.data() + sizeof(chunk));
+						for (size_t p = 0; p < nof_pixels; p++) {
+							sums[p] += dvec3(pixel_sums[3 * p + 0], pixel_sums[3 * p + 1], pixel_sums[3 * p + 2]);
+						}
+						samples_done += chunk.nof_samples;
+						cout << "Coordinator: " << samples_done << "/" << job.samples << " samples done\n";
+					}
+				}
+				else {
+					dropWorker(s, "unexpected message");
+					continue;
+				}
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Hand out pending chunks to all idle workers, not only to those
+			// that sent a message: an idle worker sends nothing until it gets
+			// a CHUNK, and the chunk of a lost worker may come back at any time
+			///////////////////////////////////////////////////////////////////
+			vector<int> idle;
+			for (auto & worker : workers) {
+				if (worker.second.has_job && worker.second.chunk < 0) idle.push_back(worker.first);
+			}
+			for (int s : idle) {
+				if (!assignChunk(s)) dropWorker(s, "send failed");
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Update the merged image, and write it now and then
+			///////////////////////////////////////////////////////////////////
+			const bool finished = samples_done >= job.samples;
+			const auto now = chrono::steady_clock::now();
+			if (finished || chrono::duration<float>(now - last_checkpoint).count() > distributed_settings.checkpoint_interval) {
+				if (samples_done > 0) {
+					const double inv_samples = 1.0 / double(samples_done);
+					for (size_t p = 0; p < nof_pixels; p++) rendered_image.data[p] = vec3(sums[p] * inv_samples);
+					rendered_image.number_of_samples = samples_done;
+					writeCheckpoint(output_filename);
+				}
+				last_checkpoint = now;
+			}
+		}
+
+		for (auto & worker : workers) {
+			sendMessage(worker.first, DONE, nullptr, 0);
+			closeConnection(worker.first);
+		}
+		closeConnection(listen_socket);
+		if (address.compare(0, 5, "unix:") == 0) unlink(address.substr(5).c_str());
+		return samples_done >= job.samples;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Worker
+	///////////////////////////////////////////////////////////////////////////
+	bool runWorker(const string & address)
+	{
+		// The coordinator may not be up yet
+		int s = -1;
+		for (int attempt = 0; attempt < 60 && s < 0; attempt++) {
+			s = connectTo(address);
+			if (s < 0) this_thread::sleep_for(chrono::seconds(1));
+		}
+		if (s < 0) {
+			cout << "ERROR: Could not connect to " << address << "\n";
+			return false;
+		}
+		const HelloMessage hello = { protocol_magic, protocol_version };
+		if (!sendMessage(s, HELLO, &hello, sizeof(hello))) {
+			closeConnection(s);
+			return false;
+		}
+
+		JobMessage job;
+		bool has_job = false;
+		vector<uint8_t> payload;
+		vector<vec3> pixel_sums;
+		uint32_t type;
+		while (receiveMessage(s, type, payload)) {
+			if (type == JOB && payload.size() == sizeof(job)) {
+				memcpy(&job, payload.data(), sizeof(job));
+				settings.subsampling = 1;
+				settings.max_bounces = job.max_bounces;
+				settings.max_paths_per_pixel = 0;
+				settings.integrator = job.integrator;
+				settings.path_guiding = job.path_guiding != 0;
+				// So that a sample is the same whichever worker takes it
+				// (with guiding, see CHUNK below)
+				settings.deterministic = true;
+				settings.use_radiance_cache = false;
+				settings.use_gbuffer = false;
+				settings.use_reprojection = false;
+				settings.use_crop = false;
+				resize(job.width, job.height);
+				// Set after resize(), so that the pixels outside of the crop
+				// region are cleared
+				settings.use_crop = job.use_crop != 0;
+				settings.crop_min = job.crop_min;
+				settings.crop_max = job.crop_max;
+				has_job = true;
+			}
+			else if (type == CHUNK && has_job && payload.size() == sizeof(ChunkMessage)) {
+				ChunkMessage chunk;
+				memcpy(&chunk, payload.data(), sizeof(chunk));
+				// The guiding distribution survives restarts, so it would
+				// carry what the chunks this worker rendered before taught
+				// it. It is learned anew from the samples of each chunk.
+				if (settings.path_guiding) {
+					vec3 bounds_min, bounds_max;
+					getSceneBounds(bounds_min, bounds_max);
+					sd_tree.reset(bounds_min, bounds_max);
+				}
+				restart();
+				for (uint32_t i = 0; i < chunk.nof_samples; i++) {
+					// Sample i of the chunk uses streams (seed of the sample,
+					// pixel, i), whatever the number of threads
+					settings.seed = sampleSeed(job.seed, chunk.first_sample + i);
+					tracePaths(job.camera_pos, job.camera_dir, job.camera_up);
+				}
+				// The image holds the average, send the sum
+				pixel_sums.resize(rendered_image.data.size());
+				for (size_t p = 0; p < pixel_sums.size(); p++) pixel_sums[p] = rendered_image.data[p] * float(chunk.nof_samples);
+				if (!sendMessage(s, RESULT, &chunk, sizeof(chunk), pixel_sums.data(), pixel_sums.size() * sizeof(vec3))) break;
+			}
+			else if (type == DONE) {
+				closeConnection(s);
+				return true;
+			}
+			else {
+				cout << "ERROR: Unexpected message from coordinator\n";
+				break;
+			}
+		}
+		closeConnection(s);
+		return false;
+	}
+}
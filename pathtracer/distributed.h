@@ -0,0 +1,55 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <stdint.h>
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Distributed rendering settings
+	///////////////////////////////////////////////////////////////////////////
+	extern struct DistributedSettings {
+		// Number of samples per pixel in each piece of work handed to a
+		// worker. Smaller chunks lose less work when a worker dies, but cost
+		// more network traffic. With path guiding, each chunk learns its
+		// own guiding distribution, so larger chunks are guided better.
+		int samples_per_chunk;
+		// Seconds between writes of the partial image
+		float checkpoint_interval;
+		// Sample s of the image is rendered with random seed (seed, s), no
+		// matter which worker renders it
+		uint32_t seed;
+	} distributed_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// A final frame render, split by samples per pixel
+	///////////////////////////////////////////////////////////////////////////
+	struct RenderJob {
+		int width, height;
+		int samples;
+		vec3 camera_pos, camera_dir, camera_up;
+		// Only render this region (see Settings), leaving the rest black
+		bool use_crop = false;
+		vec2 crop_min = vec2(0.0f), crop_max = vec2(1.0f);
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Listen on address and hand out ranges of samples of job to the workers
+	// that connect, until all samples are done. Workers may connect and
+	// disconnect (or die) at any time; the work of a worker that is lost is
+	// handed to another one. The sums of the samples sent back are merged
+	// into rendered_image, which is written to output_filename (as .hdr)
+	// every checkpoint_interval seconds and when the job is finished.
+	// Integrator, max_bounces and path_guiding are taken from settings.
+	///////////////////////////////////////////////////////////////////////////
+	bool runCoordinator(const std::string & address, const RenderJob & job, const std::string & output_filename);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Connect to a coordinator and render what it asks for, until it is done.
+	// The scene must already be loaded (the same scene as for the other
+	// workers).
+	///////////////////////////////////////////////////////////////////////////
+	bool runWorker(const std::string & address);
+}
@@ -1,6 +1,13 @@
 #include "embree.h"
+#include "geometry.h"
+#include "profiling.h"
+#include "threads.h"
+#include "numa.h"
 #include <iostream>
 #include <map>
+#include <memory>
+#include <set>
+#include <omp.h>
 
 
 using namespace std; 
@@ -13,15 +20,28 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	RTCDevice embree_device;
 	RTCScene  embree_scene;
+	// With a replicated scene, the copy used by the threads of each NUMA
+	// node (embree_scene is the one of the first thread)
+	vector<RTCScene> scene_replicas;
 
 	///////////////////////////////////////////////////////////////////////////
-	// Build an acceleration structure for the scene
+	// The scene that the calling thread should trace
 	///////////////////////////////////////////////////////////////////////////
-	void buildBVH()
+	static inline RTCScene threadScene()
 	{
-		cout << "Embree building BVH..." << flush;
-		rtcCommit(embree_scene);
-		cout << "done.\n";
+		if (scene_replicas.empty()) return embree_scene;
+		return scene_replicas[threadNode(omp_get_thread_num())];
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Get the axis aligned bounding box of the scene (after buildBVH())
+	///////////////////////////////////////////////////////////////////////////
+	void getSceneBounds(vec3 & bounds_min, vec3 & bounds_max)
+	{
+		RTCBounds bounds;
+		rtcGetBounds(embree_scene, bounds);
+		bounds_min = vec3(bounds.lower_x, bounds.lower_y, bounds.lower_z);
+		bounds_max = vec3(bounds.upper_x, bounds.upper_y, bounds.upper_z);
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -34,15 +54,154 @@ namespace pathtracer
 	}
 
 	///////////////////////////////////////////////////////////////////////////
-	// Used to map an Embree geometry ID to our scene Meshes and Materials
+	// Filter function for intersection and occlusion rays. Called for each
+	// hit found during traversal, which is rejected by invalidating it.
+	///////////////////////////////////////////////////////////////////////////
+	static void alphaTestFilter(void * user_data, RTCRay & ray)
+	{
+		if (isTransparent(*(const AlphaTestedMesh *)user_data, ray.primID, ray.u, ray.v)) {
+			ray.geomID = RTC_INVALID_GEOMETRY_ID;
+		}
+	}
+
+	static void setAlphaTestFilter(RTCScene scene, uint32_t geom_ID, AlphaTestedMesh * m)
+	{
+		rtcSetUserData(scene, geom_ID, m);
+		rtcSetIntersectionFilterFunction(scene, geom_ID, alphaTestFilter);
+		rtcSetOcclusionFilterFunction(scene, geom_ID, alphaTestFilter);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Models that are not in world space (transformed or animated) are 
+	// instanced: their meshes are in a scene of their own, in model space, 
+	// with one copy per replica (indexed as scene_replicas).
+	///////////////////////////////////////////////////////////////////////////
+	struct InstancedModel
+	{
+		vector<RTCScene> scenes;
+		uint32_t instance_ID;
+	};
+	map<const labhelper::Model *, InstancedModel> instanced_models;
+	// The scenes of the instanced models that have not been committed yet,
+	// with the node of their replica
+	vector<pair<int, RTCScene>> uncommitted_model_scenes;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Triangle indices 0, 1, 2, ..., shared by all meshes (vertices are not
+	// indexed). Buffers are only added, never reallocated, as Embree keeps 
+	// pointers to them.
+	///////////////////////////////////////////////////////////////////////////
+	static vector<unique_ptr<vector<int>>> identity_indices;
+
+	static const int * identityIndices(uint32_t n)
+	{
+		if (identity_indices.empty() || identity_indices.back()->size() < n) {
+			vector<int> * indices = new vector<int>(std::max(n, identity_indices.empty() ? 0u : 2 * uint32_t(identity_indices.back()->size())));
+			for (size_t i = 0; i < indices->size(); i++) (*indices)[i] = int(i);
+			identity_indices.emplace_back(indices);
+		}
+		return identity_indices.back()->data();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Embree reads vertices with 16 byte loads, so the 4 bytes after the last
+	// vertex of a shared vertex buffer must be allocated. This is the case
+	// for all meshes but the last one of a model, and for the last one if
+	// the positions have spare capacity (see loadModelFromOBJ()).
+	///////////////////////////////////////////////////////////////////////////
+	static bool canShareVertices(const labhelper::Model * model, const labhelper::Mesh & mesh)
+	{
+		return mesh.m_start_index + mesh.m_number_of_vertices < model->m_positions.capacity();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add a mesh (in the space of its model) to a scene. Its vertices are 
+	// read directly from the model if possible, and copied otherwise.
+	///////////////////////////////////////////////////////////////////////////
+	static void newMeshGeometry(RTCScene scene, uint32_t geom_ID, const labhelper::Model * model,
+		const labhelper::Mesh & mesh, AlphaTestedMesh * filter)
+	{
+		rtcNewTriangleMesh2(scene, RTC_GEOMETRY_STATIC, mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices, 1, geom_ID);
+		if (canShareVertices(model, mesh)) {
+			rtcSetBuffer2(scene, geom_ID, RTC_VERTEX_BUFFER, model->m_positions.data(),
+				mesh.m_start_index * sizeof(vec3), sizeof(vec3), mesh.m_number_of_vertices);
+			rtcSetBuffer2(scene, geom_ID, RTC_INDEX_BUFFER, identityIndices(mesh.m_number_of_vertices),
+				0, 3 * sizeof(int), mesh.m_number_of_vertices / 3);
+		}
+		if (filter != nullptr) setAlphaTestFilter(scene, geom_ID, filter);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Copy the vertices and the indices of a mesh to a geometry
+	///////////////////////////////////////////////////////////////////////////
+	static void fillMeshBuffers(RTCScene scene, uint32_t geom_ID, const labhelper::Model * model,
+		const labhelper::Mesh & mesh)
+	{
+		vec4 * embree_vertices = (vec4 *)rtcMapBuffer(scene, geom_ID, RTC_VERTEX_BUFFER);
+		for (uint32_t i = 0; i < mesh.m_number_of_vertices; i++) {
+			embree_vertices[i] = vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+		}
+		rtcUnmapBuffer(scene, geom_ID, RTC_VERTEX_BUFFER);
+		int * embree_tri_idxs = (int *)rtcMapBuffer(scene, geom_ID, RTC_INDEX_BUFFER);
+		for (uint32_t i = 0; i < mesh.m_number_of_vertices; i++) {
+			embree_tri_idxs[i] = i;
+		}
+		rtcUnmapBuffer(scene, geom_ID, RTC_INDEX_BUFFER);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Set the transform of an instanced model
 	///////////////////////////////////////////////////////////////////////////
-	map<uint32_t, const labhelper::Model *> map_geom_ID_to_model;
-	map<uint32_t, const labhelper::Mesh *> map_geom_ID_to_mesh;
+	static void setInstanceTransform(const labhelper::Model * model, const InstancedModel & instance, 
+		const mat4 & model_matrix)
+	{
+		setMeshTransforms(model, model_matrix);
+		for (RTCScene scene : scene_replicas.empty() ? vector<RTCScene>(1, embree_scene) : scene_replicas) {
+			if (scene == nullptr) continue;
+			rtcSetTransform2(scene, instance.instance_ID, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &model_matrix[0][0]);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Build an acceleration structure for the scene
+	///////////////////////////////////////////////////////////////////////////
+	void buildBVH()
+	{
+		cout << "Embree building BVH..." << flush;
+		// The scenes of new instanced models are built first, as the BVH of
+		// the scene refers to theirs
+		if (!scene_replicas.empty()) {
+			// The threads of each node build the BVH of its replica, so
+			// that it is allocated on that node
+#pragma omp parallel
+			{
+				const int node = threadNode(omp_get_thread_num());
+				for (auto & m : uncommitted_model_scenes) {
+					if (m.first == node) rtcCommitJoin(m.second);
+				}
+				rtcCommitJoin(scene_replicas[node]);
+			}
+		}
+		else if (thread_settings.shared_pool) {
+			// The tracing threads build the BVH
+#pragma omp parallel
+			{
+				for (auto & m : uncommitted_model_scenes) rtcCommitJoin(m.second);
+				rtcCommitJoin(embree_scene);
+			}
+		}
+		else {
+			for (auto & m : uncommitted_model_scenes) rtcCommit(m.second);
+			rtcCommit(embree_scene);
+		}
+		uncommitted_model_scenes.clear();
+		cout << "done.\n";
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Add a model to the embree scene
 	///////////////////////////////////////////////////////////////////////////
-	void addModel(const labhelper::Model * model, const mat4 & model_matrix)
+	void addModel(const labhelper::Model * model, const mat4 & model_matrix, bool animated)
 	{
 		///////////////////////////////////////////////////////////////////////
 		// Lazy initialize embree on first use
@@ -51,57 +210,104 @@ namespace pathtracer
 		static bool embree_is_initialized = false;
 		if (!embree_is_initialized) {
 			embree_is_initialized = true;
-			embree_device = rtcNewDevice();
+			initializeThreads();
+			const string config = embreeDeviceConfig();
+			embree_device = rtcNewDevice(config.empty() ? nullptr : config.c_str());
 			rtcDeviceSetErrorFunction(embree_device, embreeErrorHandler);
-			embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+			// One scene per NUMA node that has (pinned) threads
+			const RTCSceneFlags scene_flags = scene_settings.dynamic ? RTC_SCENE_DYNAMIC : RTC_SCENE_STATIC;
+			set<int> nodes;
+			for (int t = 0; t < threadCount(); t++) nodes.insert(threadNode(t));
+			if (numa_settings.replicate_scene && thread_settings.shared_pool && nodes.size() > 1 && *nodes.begin() >= 0) {
+				scene_replicas.assign(numaNodeCount(), nullptr);
+				for (int node : nodes) {
+					scene_replicas[node] = rtcDeviceNewScene(embree_device, scene_flags, RTC_INTERSECT1);
+				}
+				embree_scene = scene_replicas[threadNode(0)];
+				cout << "(" << nodes.size() << " replicas) ";
+			}
+			else {
+				embree_scene = rtcDeviceNewScene(embree_device, scene_flags, RTC_INTERSECT1);
+			}
 		}
 		cout << "done.\n";
 
 		///////////////////////////////////////////////////////////////////////
-		// Transform and add each mesh in the model as a geometry in embree, 
-		// and create mappings so that we can connect an embree geom_ID to a 
-		// Material. 
+		// Add each mesh in the model as a geometry in embree, and create 
+		// mappings so that we can connect an embree geom_ID to a Material. 
+		// Models in world space are added to the scene, and share their 
+		// vertices with embree. Other models are instanced.
 		///////////////////////////////////////////////////////////////////////
 		cout << "Adding " << model->m_name << " to embree scene..." << flush;
+		if (animated && !scene_settings.dynamic) {
+			cout << "(not animated, the scene is static) ";
+			animated = false;
+		}
+		const bool instanced = animated || model_matrix != mat4(1.0f);
+		// The scenes the meshes go to, indexed as scene_replicas
+		const vector<RTCScene> & top_scenes = scene_replicas.empty() ? vector<RTCScene>(1, embree_scene) : scene_replicas;
+		vector<RTCScene> scenes = top_scenes;
+		if (instanced) {
+			for (size_t i = 0; i < scenes.size(); i++) {
+				if (scenes[i] == nullptr) continue;
+				scenes[i] = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+				uncommitted_model_scenes.push_back(make_pair(int(i), scenes[i]));
+			}
+		}
+		int nof_alpha_tested = 0, nof_copied = 0;
 		for (auto & mesh : model->m_meshes) {
-			uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC,
-				mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
-			map_geom_ID_to_mesh[geom_ID] = &mesh;
-			map_geom_ID_to_model[geom_ID] = model;
-			// Transform and commit vertices
-			vec4 * embree_vertices = (vec4 *)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-			for (uint32_t i = 0; i < mesh.m_number_of_vertices; i++) {
-				embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+			// Embree reports hits through instances in model space
+			const uint32_t geom_ID = addMeshGeometry(model, mesh, model_matrix, instanced);
+			if (alpha_tested_meshes[geom_ID] != nullptr) nof_alpha_tested++;
+			AlphaTestedMesh * filter = scene_settings.alpha_test == ALPHA_TEST_FILTER ? alpha_tested_meshes[geom_ID].get() : nullptr;
+			// The replicas get the same geometry IDs
+			for (RTCScene scene : scenes) {
+				if (scene != nullptr) newMeshGeometry(scene, geom_ID, model, mesh, filter);
 			}
-			rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-			// Commit triangle indices
-			int * embree_tri_idxs = (int *)rtcMapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
-			for (uint32_t i = 0; i < mesh.m_number_of_vertices; i++) {
-				embree_tri_idxs[i] = i;
+			if (canShareVertices(model, mesh)) continue;
+			nof_copied++;
+			if (scene_replicas.empty()) {
+				fillMeshBuffers(scenes[0], geom_ID, model, mesh);
+				continue;
 			}
-			rtcUnmapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
+			// Each replica is written by the first thread of its node
+#pragma omp parallel
+			{
+				const int thread = omp_get_thread_num();
+				bool first_of_node = true;
+				for (int t = 0; t < thread; t++) {
+					if (threadNode(t) == threadNode(thread)) first_of_node = false;
+				}
+				if (first_of_node) fillMeshBuffers(scenes[threadNode(thread)], geom_ID, model, mesh);
+			}
+		}
+		if (instanced) {
+			InstancedModel & instance = instanced_models[model];
+			instance.scenes = scenes;
+			instance.instance_ID = newGeometryID();
+			for (size_t i = 0; i < scenes.size(); i++) {
+				if (scenes[i] != nullptr) rtcNewInstance3(top_scenes[i], scenes[i], 1, instance.instance_ID);
+			}
+			setInstanceTransform(model, instance, model_matrix);
+			cout << "(instanced) ";
 		}
+		if (nof_alpha_tested > 0) cout << "(" << nof_alpha_tested << " alpha tested meshes) ";
+		if (nof_copied > 0) cout << "(" << nof_copied << " meshes copied) ";
 		cout << "done.\n";
 	}
 
 	///////////////////////////////////////////////////////////////////////////
-	// Extract an intersection from an embree ray.
+	// Move an animated model
 	///////////////////////////////////////////////////////////////////////////
-	Intersection getIntersection(const Ray & r) 
+	void setModelTransform(const labhelper::Model * model, const mat4 & model_matrix)
 	{
-		const labhelper::Model * model = map_geom_ID_to_model[r.geomID];
-		const labhelper::Mesh * mesh = map_geom_ID_to_mesh[r.geomID];
-		Intersection i;
-		i.material = &(model->m_materials[mesh->m_material_idx]);
-		vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-		vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-		vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
-		float w = 1.0f - (r.u + r.v);
-		i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
-		i.geometry_normal = -normalize(r.n);
-		i.position = r.o + r.tfar * r.d;
-		i.wo = normalize(-r.d);
-		return i;
+		auto it = instanced_models.find(model);
+		if (it == instanced_models.end()) return;
+		setInstanceTransform(model, it->second, model_matrix);
+		for (size_t i = 0; i < it->second.scenes.size(); i++) {
+			if (it->second.scenes[i] == nullptr) continue;
+			rtcUpdate(scene_replicas.empty() ? embree_scene : scene_replicas[i], it->second.instance_ID);
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -109,8 +315,26 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	bool intersect(Ray &r)
 	{
-		rtcIntersect(embree_scene, *((RTCRay *)&r));
-		return r.geomID != RTC_INVALID_GEOMETRY_ID;
+		PROFILE_SCOPE(PROFILE_INTERSECT);
+		PROFILE_COUNT(PROFILE_RAYS, 1);
+		rtcIntersect(threadScene(), *((RTCRay *)&r));
+		if (scene_settings.alpha_test == ALPHA_TEST_RETRACE) {
+			// Trace on from transparent hits, just past them so that they
+			// are not found again
+			const float tfar = r.tfar;
+			while (r.geomID != RTC_INVALID_GEOMETRY_ID && alpha_tested_meshes[r.geomID] != nullptr &&
+				isTransparent(*alpha_tested_meshes[r.geomID], r.primID, r.u, r.v)) {
+				PROFILE_COUNT(PROFILE_RAYS, 1);
+				r.tnear = r.tfar * (1.0f + 1e-5f) + 1e-5f;
+				r.tfar = tfar;
+				r.geomID = r.primID = r.instID = RTC_INVALID_GEOMETRY_ID;
+				rtcIntersect(threadScene(), *((RTCRay *)&r));
+			}
+		}
+		if (r.geomID == RTC_INVALID_GEOMETRY_ID) return false;
+		// Geometry normals are in world space everywhere else
+		geometryNormalToWorld(r);
+		return true;
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -119,7 +343,25 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	bool occluded(Ray &r)
 	{
-		rtcOccluded(embree_scene, *((RTCRay *)&r));
+		PROFILE_SCOPE(PROFILE_INTERSECT);
+		PROFILE_COUNT(PROFILE_SHADOW_RAYS, 1);
+		if (scene_settings.alpha_test == ALPHA_TEST_RETRACE) {
+			// Occlusion rays do not tell what they hit, so the closest hits
+			// are traced until an opaque one is found
+			Ray ray = r;
+			rtcIntersect(threadScene(), *((RTCRay *)&ray));
+			while (ray.geomID != RTC_INVALID_GEOMETRY_ID && alpha_tested_meshes[ray.geomID] != nullptr &&
+				isTransparent(*alpha_tested_meshes[ray.geomID], ray.primID, ray.u, ray.v)) {
+				PROFILE_COUNT(PROFILE_SHADOW_RAYS, 1);
+				ray.tnear = ray.tfar * (1.0f + 1e-5f) + 1e-5f;
+				ray.tfar = r.tfar;
+				ray.geomID = ray.primID = ray.instID = RTC_INVALID_GEOMETRY_ID;
+				rtcIntersect(threadScene(), *((RTCRay *)&ray));
+			}
+			r.geomID = ray.geomID == RTC_INVALID_GEOMETRY_ID ? RTC_INVALID_GEOMETRY_ID : 0;
+			return r.geomID != RTC_INVALID_GEOMETRY_ID;
+		}
+		rtcOccluded(threadScene(), *((RTCRay *)&r));
 		return r.geomID != RTC_INVALID_GEOMETRY_ID;
 	}
 }
\ No newline at end of file
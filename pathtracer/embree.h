@@ -1,22 +1,96 @@
 #pragma once
+#ifndef PATHTRACER_BVH
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_ray.h>
+#else
+// Built without Embree, rays are traced with the in-tree BVH (see bvh.h)
+#include <float.h>
+#include <stdint.h>
+#define RTC_INVALID_GEOMETRY_ID ((unsigned)-1)
+#define RTCORE_ALIGN(n) alignas(n)
+#endif
 #include "Model.h"
 #include <glm/glm.hpp>
 #include <map>
+#include <vector>
 
 namespace pathtracer
 {
 	///////////////////////////////////////////////////////////////////////////
-	// Add a model to the embree scene
+	// How hits on the transparent texels of meshes with an alpha mask in their
+	// color texture (leaves, for example) are skipped
 	///////////////////////////////////////////////////////////////////////////
-	void addModel(const labhelper::Model * model, const glm::mat4 & model_matrix);
+	enum AlphaTest {
+		// Alpha is ignored, all hits are opaque
+		ALPHA_TEST_OFF = 0,
+		// Embree filter functions reject transparent hits during traversal
+		ALPHA_TEST_FILTER = 1,
+		// Rays are traced again from transparent hits (for comparison)
+		ALPHA_TEST_RETRACE = 2
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Scene settings. They must be made before the first model is added.
+	///////////////////////////////////////////////////////////////////////////
+	extern struct SceneSettings {
+		int alpha_test;
+		// Build a dynamic Embree scene, in which models added as animated can
+		// be moved (see setModelTransform()). Moving a model only changes the
+		// transform of its instance, so when the scene is committed again 
+		// the BVHs of all models are reused, and only the BVH over them is
+		// rebuilt.
+		bool dynamic;
+		// Shade from quantized normals and texture coordinates (see
+		// CompactShadingData) instead of the float ones of the models, which
+		// halves the shading data read per hit
+		bool compact_shading;
+	} scene_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add a model to the embree scene. Embree reads the vertices of the model
+	// from m_positions, which must stay as they are while the model is in
+	// the scene. Models with a transform (or animated, in a dynamic scene, 
+	// which can be moved afterwards) are instanced.
+	///////////////////////////////////////////////////////////////////////////
+	void addModel(const labhelper::Model * model, const glm::mat4 & model_matrix, bool animated = false);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Move an animated model. Call buildBVH() when all models have been
+	// moved, before tracing.
+	///////////////////////////////////////////////////////////////////////////
+	void setModelTransform(const labhelper::Model * model, const glm::mat4 & model_matrix);
 
 	///////////////////////////////////////////////////////////////////////////
 	// Build an acceleration structure for the scene
 	///////////////////////////////////////////////////////////////////////////
 	void buildBVH();
 
+	///////////////////////////////////////////////////////////////////////////
+	// Get the axis aligned bounding box of the scene (after buildBVH())
+	///////////////////////////////////////////////////////////////////////////
+	void getSceneBounds(glm::vec3 & bounds_min, glm::vec3 & bounds_max);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The meshes that have been added to the scene, with the transform of the
+	// model they belong to
+	///////////////////////////////////////////////////////////////////////////
+	struct SceneMesh
+	{
+		const labhelper::Model * model;
+		const labhelper::Mesh * mesh;
+		glm::mat4 model_matrix;
+		// The geometry ID of its hits
+		uint32_t geom_ID;
+	};
+	const std::vector<SceneMesh> & getSceneMeshes();
+
+	///////////////////////////////////////////////////////////////////////////
+	// The compact shading data of a model that has been added, or nullptr if
+	// scene_settings.compact_shading is off
+	///////////////////////////////////////////////////////////////////////////
+	class CompactShadingData;
+	const CompactShadingData * getCompactShadingData(const labhelper::Model * model);
+
 	///////////////////////////////////////////////////////////////////////////
 	// This struct is what an embree Ray must look like. It contains the 
 	// information about the ray to be shot and (after intersect() has been 
@@ -55,6 +129,12 @@ namespace pathtracer
 		glm::vec3 geometry_normal; 
 		glm::vec3 shading_normal;
 		glm::vec3 wo; 
+		glm::vec2 texture_coordinate;
+		// Derivatives of the position with respect to the texture coordinates
+		glm::vec3 dpdu, dpdv;
+		// Texture coordinate footprint of a pixel, if a ray differential was
+		// traced along with the ray (zero otherwise)
+		glm::vec2 duvdx, duvdy;
 		const labhelper::Material * material;
 	};
 	Intersection getIntersection(const Ray & r); 
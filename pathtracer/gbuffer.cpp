@@ -0,0 +1,82 @@
+#include "gbuffer.h"
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	GBufferSettings gbuffer_settings;
+	GBuffer gbuffer;
+
+	void GBuffer::update(const Camera & camera, int w, int h, const ivec4 & r)
+	{
+		const int s = std::max(1, std::min(64, gbuffer_settings.samples_per_pixel));
+		if (camera.position == camera_pos && camera.direction == camera_dir && camera.up == camera_up &&
+			camera.projection == projection && w == width && h == height && s == samples && r == region) {
+			return;
+		}
+		region = r;
+		camera_pos = camera.position;
+		camera_dir = camera.direction;
+		camera_up = camera.up;
+		projection = camera.projection;
+		width = w;
+		height = h;
+		samples = s;
+		cached_samples = 0;
+		// Only reallocated when the size changes, camera moves reuse the
+		// memory
+		hits.resize(size_t(width) * height * samples);
+	}
+
+	void GBuffer::clear()
+	{
+		decltype(hits)().swap(hits);
+		width = height = 0;
+		cached_samples = 0;
+	}
+
+	void GBuffer::storeFirstHit(int pixel, int sample, const vec2 & screen_coord, const Ray & r)
+	{
+		FirstHit & hit = hits[size_t(pixel) * samples + sample];
+		hit.screen_coord = screen_coord;
+		hit.t = r.tfar;
+		hit.geomID = r.geomID;
+		hit.primID = r.primID;
+		hit.u = r.u;
+		hit.v = r.v;
+		hit.n = r.n;
+	}
+
+	void GBuffer::storeMiss(int pixel, int sample, const vec2 & screen_coord, const vec3 & environment_radiance)
+	{
+		FirstHit & hit = hits[size_t(pixel) * samples + sample];
+		hit.screen_coord = screen_coord;
+		hit.geomID = hit.primID = RTC_INVALID_GEOMETRY_ID;
+		hit.n = environment_radiance;
+	}
+
+	bool GBuffer::restoreFirstHit(int pixel, int sample, Ray & r) const
+	{
+		const FirstHit & hit = hits[size_t(pixel) * samples + sample];
+		r.geomID = hit.geomID;
+		r.primID = hit.primID;
+		if (hit.geomID == RTC_INVALID_GEOMETRY_ID) return false;
+		r.tfar = hit.t;
+		r.u = hit.u;
+		r.v = hit.v;
+		r.n = hit.n;
+		return true;
+	}
+
+	int GBuffer::cachedSampleCount() const
+	{
+		int count = 0;
+		for (int s = 0; s < samples; s++) count += isCached(s) ? 1 : 0;
+		return count;
+	}
+}
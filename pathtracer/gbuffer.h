@@ -0,0 +1,77 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <stdint.h>
+#include "embree.h"
+#include "camera.h"
+#include "numa.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// G-buffer settings. The G-buffer keeps the first hit of the camera rays
+	// of a few jitter samples per pixel, so that when only materials or
+	// lights change, passes restart from the first hit instead of tracing
+	// the camera rays again.
+	///////////////////////////////////////////////////////////////////////////
+	extern struct GBufferSettings {
+		// Jitter samples per pixel that are kept (at most 64). Pass i uses
+		// sample i % samples_per_pixel, so antialiasing only converges to
+		// these samples.
+		int samples_per_pixel = 8;
+	} gbuffer_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The cached first hits. They are only valid for the camera and image
+	// size they were traced with (see update()), but stay valid over
+	// restarts.
+	///////////////////////////////////////////////////////////////////////////
+	class GBuffer
+	{
+	public:
+		struct FirstHit {
+			// Position of the sample on the image, in [0,1]^2
+			vec2 screen_coord;
+			// The Embree hit: distance (the position is camera_pos + t * d),
+			// triangle, barycentrics (which give the shading normal and
+			// texture coordinate) and geometry normal. For misses, geomID is
+			// RTC_INVALID_GEOMETRY_ID and n holds the environment map
+			// radiance, without the multiplier.
+			float t;
+			uint32_t geomID, primID;
+			float u, v;
+			vec3 n;
+		};
+		// Discard all samples unless they were traced from this camera (and
+		// projection) at this image size, for the same pixels ([x, z) x [y, w))
+		void update(const Camera & camera, int width, int height, const ivec4 & region);
+		void clear();
+		// The sample that a pass uses, and whether it has been traced
+		int sampleIndex(int pass) const { return pass % samples; }
+		bool isCached(int sample) const { return ((cached_samples >> sample) & 1) != 0; }
+		const FirstHit & firstHit(int pixel, int sample) const { return hits[size_t(pixel) * samples + sample]; }
+		// Store a camera ray after intersect(), or a miss
+		void storeFirstHit(int pixel, int sample, const vec2 & screen_coord, const Ray & r);
+		void storeMiss(int pixel, int sample, const vec2 & screen_coord, const vec3 & environment_radiance);
+		// Set the hit data of a camera ray (whose origin and direction are
+		// set) from the cache. Returns false for a miss.
+		bool restoreFirstHit(int pixel, int sample, Ray & r) const;
+		// Mark the sample as cached, once a pass has stored all of its pixels
+		void endPass(int sample) { cached_samples |= uint64_t(1) << sample; }
+		int cachedSampleCount() const;
+		size_t memoryUsage() const { return hits.size() * sizeof(FirstHit); }
+	private:
+		// Sample s of pixel p is at p * samples + s. The allocator leaves
+		// new memory untouched, so that the tracing threads place it.
+		std::vector<FirstHit, UninitializedAllocator<FirstHit>> hits;
+		vec3 camera_pos, camera_dir, camera_up;
+		int projection = PINHOLE;
+		int width = 0, height = 0, samples = 1;
+		ivec4 region;
+		uint64_t cached_samples = 0;
+	};
+
+	extern GBuffer gbuffer;
+}
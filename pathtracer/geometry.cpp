@@ -0,0 +1,141 @@
+#include "geometry.h"
+#include "shading_data.h"
+#include "profiling.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	SceneSettings scene_settings = { ALPHA_TEST_FILTER, false, false };
+
+	map<uint32_t, const labhelper::Model *> map_geom_ID_to_model;
+	map<uint32_t, const labhelper::Mesh *> map_geom_ID_to_mesh;
+	map<uint32_t, mat3> map_geom_ID_to_linear_transform;
+	map<uint32_t, mat3> map_geom_ID_to_normal_transform;
+	vector<SceneMesh> scene_meshes;
+	vector<unique_ptr<AlphaTestedMesh>> alpha_tested_meshes;
+	vector<unique_ptr<mat3>> instance_normal_transforms;
+
+	///////////////////////////////////////////////////////////////////////////
+	// With compact shading, the shading data of each model, and of the model
+	// of each geometry by geometry ID
+	///////////////////////////////////////////////////////////////////////////
+	map<const labhelper::Model *, unique_ptr<CompactShadingData>> compact_shading_data;
+	vector<const CompactShadingData *> geom_ID_to_shading_data;
+
+	static uint32_t next_geom_ID = 0;
+
+	const vector<SceneMesh> & getSceneMeshes()
+	{
+		return scene_meshes;
+	}
+
+	const CompactShadingData * getCompactShadingData(const labhelper::Model * model)
+	{
+		auto data = compact_shading_data.find(model);
+		return data != compact_shading_data.end() ? data->second.get() : nullptr;
+	}
+
+	uint32_t newGeometryID()
+	{
+		const uint32_t geom_ID = next_geom_ID++;
+		alpha_tested_meshes.resize(next_geom_ID);
+		instance_normal_transforms.resize(next_geom_ID);
+		geom_ID_to_shading_data.resize(next_geom_ID);
+		return geom_ID;
+	}
+
+	uint32_t addMeshGeometry(const labhelper::Model * model, const labhelper::Mesh & mesh,
+		const mat4 & model_matrix, bool model_space_hits)
+	{
+		const uint32_t geom_ID = newGeometryID();
+		map_geom_ID_to_mesh[geom_ID] = &mesh;
+		map_geom_ID_to_model[geom_ID] = model;
+		map_geom_ID_to_linear_transform[geom_ID] = mat3(model_matrix);
+		const mat3 normal_transform = transpose(inverse(mat3(model_matrix)));
+		map_geom_ID_to_normal_transform[geom_ID] = normal_transform;
+		scene_meshes.push_back({ model, &mesh, model_matrix, geom_ID });
+		if (model_space_hits) {
+			instance_normal_transforms[geom_ID].reset(new mat3(normal_transform));
+		}
+		// CPU copy of the color texture, for shading, and its alpha mask
+		const labhelper::Texture & color_texture = model->m_materials[mesh.m_material_idx].m_color_texture;
+		addTexture(color_texture, 4, true);
+		const AlphaMask * mask = scene_settings.alpha_test != ALPHA_TEST_OFF && !model->m_texture_coordinates.empty() ?
+			getAlphaMask(color_texture) : nullptr;
+		if (mask != nullptr) alpha_tested_meshes[geom_ID].reset(new AlphaTestedMesh{ model, &mesh, mask });
+		// Models added more than once share their shading data
+		if (scene_settings.compact_shading) {
+			unique_ptr<CompactShadingData> & data = compact_shading_data[model];
+			if (data == nullptr) data.reset(new CompactShadingData(model));
+			geom_ID_to_shading_data[geom_ID] = data.get();
+		}
+		return geom_ID;
+	}
+
+	void setMeshTransforms(const labhelper::Model * model, const mat4 & model_matrix)
+	{
+		for (auto & m : scene_meshes) {
+			if (m.model == model) m.model_matrix = model_matrix;
+		}
+		const mat3 normal_transform = transpose(inverse(mat3(model_matrix)));
+		for (auto & g : map_geom_ID_to_model) {
+			if (g.second != model) continue;
+			map_geom_ID_to_linear_transform[g.first] = mat3(model_matrix);
+			map_geom_ID_to_normal_transform[g.first] = normal_transform;
+			if (instance_normal_transforms[g.first] != nullptr) *instance_normal_transforms[g.first] = normal_transform;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Extract an intersection from a ray
+	///////////////////////////////////////////////////////////////////////////
+	Intersection getIntersection(const Ray & r) 
+	{
+		PROFILE_SCOPE(PROFILE_GET_INTERSECTION);
+		const labhelper::Model * model = map_geom_ID_to_model[r.geomID];
+		const labhelper::Mesh * mesh = map_geom_ID_to_mesh[r.geomID];
+		Intersection i;
+		const uint32_t triangle = (mesh->m_start_index / 3) + r.primID;
+		vec3 n0, n1, n2;
+		vec2 uv0, uv1, uv2;
+		// The UI changes the material of a mesh, so it is not packed
+		i.material = &(model->m_materials[mesh->m_material_idx]);
+		const CompactShadingData * shading_data = geom_ID_to_shading_data[r.geomID];
+		if (shading_data != nullptr) {
+			shading_data->normals(triangle, n0, n1, n2);
+			shading_data->textureCoordinates(triangle, uv0, uv1, uv2);
+		}
+		else {
+			n0 = model->m_normals[triangle * 3 + 0];
+			n1 = model->m_normals[triangle * 3 + 1];
+			n2 = model->m_normals[triangle * 3 + 2];
+			uv0 = model->m_texture_coordinates[triangle * 3 + 0];
+			uv1 = model->m_texture_coordinates[triangle * 3 + 1];
+			uv2 = model->m_texture_coordinates[triangle * 3 + 2];
+		}
+		float w = 1.0f - (r.u + r.v);
+		i.shading_normal = normalize(map_geom_ID_to_normal_transform[r.geomID] * (w * n0 + r.u * n1 + r.v * n2));
+		i.texture_coordinate = w * uv0 + r.u * uv1 + r.v * uv2;
+		// Solve for dp/du and dp/dv from the triangle edges (in world space)
+		const uint32_t first_vertex = mesh->m_start_index + r.primID * 3;
+		const mat3 & transform = map_geom_ID_to_linear_transform[r.geomID];
+		const vec3 e1 = transform * (model->m_positions[first_vertex + 1] - model->m_positions[first_vertex]);
+		const vec3 e2 = transform * (model->m_positions[first_vertex + 2] - model->m_positions[first_vertex]);
+		const vec2 duv1 = uv1 - uv0, duv2 = uv2 - uv0;
+		const float det = duv1.x * duv2.y - duv1.y * duv2.x;
+		if (abs(det) > 1e-12f) {
+			i.dpdu = (duv2.y * e1 - duv1.y * e2) / det;
+			i.dpdv = (duv1.x * e2 - duv2.x * e1) / det;
+		}
+		else {
+			i.dpdu = i.dpdv = vec3(0.0f);
+		}
+		i.duvdx = i.duvdy = vec2(0.0f);
+		i.geometry_normal = -normalize(r.n);
+		i.position = r.o + r.tfar * r.d;
+		i.wo = normalize(-r.d);
+		return i;
+	}
+}
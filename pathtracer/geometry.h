@@ -0,0 +1,84 @@
+#pragma once
+#include "embree.h"
+#include "texture.h"
+#include <glm/glm.hpp>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// The meshes of the scene by geometry ID, shared by the two ray tracing
+	// cores that implement embree.h: Embree (embree.cpp) and the in-tree BVH
+	// (bvh_scene.cpp). Geometry IDs are unique over the whole scene, so that
+	// the geometry ID of a hit tells which mesh was hit, also through an
+	// instance.
+	///////////////////////////////////////////////////////////////////////////
+	extern std::map<uint32_t, const labhelper::Model *> map_geom_ID_to_model;
+	extern std::map<uint32_t, const labhelper::Mesh *> map_geom_ID_to_mesh;
+	extern std::map<uint32_t, glm::mat3> map_geom_ID_to_linear_transform;
+	// The inverse transpose of the linear transform, for the shading normals
+	// (which are kept in model space)
+	extern std::map<uint32_t, glm::mat3> map_geom_ID_to_normal_transform;
+	extern std::vector<SceneMesh> scene_meshes;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The meshes with an alpha mask, by geometry ID (nullptr for the others).
+	// An entry is the user data of the Embree filter functions of its
+	// geometry, so entries never move.
+	///////////////////////////////////////////////////////////////////////////
+	struct AlphaTestedMesh
+	{
+		const labhelper::Model * model;
+		const labhelper::Mesh * mesh;
+		const AlphaMask * mask;
+	};
+	extern std::vector<std::unique_ptr<AlphaTestedMesh>> alpha_tested_meshes;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Whether a hit is on a transparent texel
+	///////////////////////////////////////////////////////////////////////////
+	inline bool isTransparent(const AlphaTestedMesh & m, uint32_t prim_ID, float u, float v)
+	{
+		const glm::vec2 * uvs = &m.model->m_texture_coordinates[m.mesh->m_start_index + prim_ID * 3];
+		return !m.mask->opaque((1.0f - (u + v)) * uvs[0] + u * uvs[1] + v * uvs[2]);
+	}
+
+	inline bool isOpaqueHit(uint32_t geom_ID, uint32_t prim_ID, float u, float v)
+	{
+		const AlphaTestedMesh * m = alpha_tested_meshes[geom_ID].get();
+		return m == nullptr || !isTransparent(*m, prim_ID, u, v);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Hits on meshes that are traced in model space report their geometry
+	// normals in model space, they are transformed with these (by geometry
+	// ID, nullptr for meshes traced in world space)
+	///////////////////////////////////////////////////////////////////////////
+	extern std::vector<std::unique_ptr<glm::mat3>> instance_normal_transforms;
+
+	inline void geometryNormalToWorld(Ray & r)
+	{
+		const glm::mat3 * normal_transform = instance_normal_transforms[r.geomID].get();
+		if (normal_transform != nullptr) r.n = *normal_transform * r.n;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// A geometry ID for something that is not a mesh (an instance)
+	///////////////////////////////////////////////////////////////////////////
+	uint32_t newGeometryID();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Give a mesh of a model that is added to the scene a geometry ID, and
+	// set up its shading: the CPU copy of its color texture and its alpha
+	// mask, and its compact shading data if scene_settings asks for it.
+	///////////////////////////////////////////////////////////////////////////
+	uint32_t addMeshGeometry(const labhelper::Model * model, const labhelper::Mesh & mesh,
+		const glm::mat4 & model_matrix, bool model_space_hits);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Update the transforms of the meshes of a model that has moved
+	///////////////////////////////////////////////////////////////////////////
+	void setMeshTransforms(const labhelper::Model * model, const glm::mat4 & model_matrix);
+}
@@ -0,0 +1,296 @@
+#include "guiding.h"
+#include "Pathtracer.h"
+#include "sampling.h"
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	GuidingSettings guiding_settings;
+	SDTree sd_tree;
+
+	// Quadtrees deeper than this are not useful at float precision
+	const int max_dtree_depth = 20;
+	// Keeps a single very bright directional distribution from eating the
+	// whole memory budget
+	const size_t max_dtree_nodes = 10000;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Area preserving mapping between directions and the unit square
+	///////////////////////////////////////////////////////////////////////////
+	static vec2 dirToCanonical(const vec3 & d)
+	{
+		const float cos_theta = std::min(std::max(d.z, -1.0f), 1.0f);
+		float phi = atan2(d.y, d.x);
+		if (phi < 0.0f) phi += 2.0f * M_PI;
+		return vec2((cos_theta + 1.0f) * 0.5f, std::min(phi / (2.0f * M_PI), 0.99999f));
+	}
+
+	static vec3 canonicalToDir(const vec2 & p)
+	{
+		const float cos_theta = 2.0f * p.x - 1.0f;
+		const float sin_theta = sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+		const float phi = 2.0f * M_PI * p.y;
+		return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+	}
+
+	// Which of the four quadrants p lies in, and p remapped into it
+	static int childIndex(vec2 & p)
+	{
+		int i = 0;
+		if (p.x >= 0.5f) { i |= 1; p.x = 2.0f * p.x - 1.0f; } else { p.x = 2.0f * p.x; }
+		if (p.y >= 0.5f) { i |= 2; p.y = 2.0f * p.y - 1.0f; } else { p.y = 2.0f * p.y; }
+		return i;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The directional quadtree
+	///////////////////////////////////////////////////////////////////////////
+	DTree::DTree()
+	{
+		nodes.resize(1);
+	}
+
+	void DTree::record(const vec3 & d, float value)
+	{
+		sample_count.add(1.0f);
+		vec2 p = dirToCanonical(d);
+		uint32_t idx = 0;
+		while (true) {
+			const int i = childIndex(p);
+			nodes[idx].sum[i].add(value);
+			if (nodes[idx].isLeaf(i)) break;
+			idx = nodes[idx].children[i];
+		}
+	}
+
+	vec3 DTree::sample() const
+	{
+		if (!(totalEnergy() > 0.0f)) {
+			return uniformSampleSphere();
+		}
+		vec2 origin(0.0f);
+		float scale = 1.0f;
+		uint32_t idx = 0;
+		while (true) {
+			const Node & node = nodes[idx];
+			float r = randf() * node.total();
+			int i = 0;
+			while (i < 3 && r >= node.sum[i].get()) { r -= node.sum[i].get(); i++; }
+			scale *= 0.5f;
+			origin += scale * vec2(float(i & 1), float(i >> 1));
+			if (node.isLeaf(i)) break;
+			idx = node.children[i];
+		}
+		return canonicalToDir(origin + scale * vec2(randf(), randf()));
+	}
+
+	float DTree::pdf(const vec3 & d) const
+	{
+		if (!(totalEnergy() > 0.0f)) return 1.0f / (4.0f * M_PI);
+		vec2 p = dirToCanonical(d);
+		float result = 1.0f;
+		uint32_t idx = 0;
+		while (true) {
+			const Node & node = nodes[idx];
+			const int i = childIndex(p);
+			const float total = node.total();
+			if (!(total > 0.0f)) return 0.0f;
+			result *= 4.0f * node.sum[i].get() / total;
+			if (node.isLeaf(i) || result == 0.0f) break;
+			idx = node.children[i];
+		}
+		return result / (4.0f * M_PI);
+	}
+
+	void DTree::refine(const DTree & previous, float threshold, size_t max_nodes)
+	{
+		///////////////////////////////////////////////////////////////////////
+		// Walk the previous tree and subdivide every quadrant that received
+		// more than 'threshold' of the total energy. Quadrants that were
+		// leaves in the previous tree but still need subdivision distribute
+		// their energy evenly among their new children.
+		///////////////////////////////////////////////////////////////////////
+		struct Entry { uint32_t node; int previous_node; float energy; int depth; };
+		nodes.clear();
+		nodes.resize(1);
+		sample_count = AtomicFloat(0.0f);
+		const float total = previous.totalEnergy();
+		if (!(total > 0.0f)) return;
+		vector<Entry> stack;
+		stack.push_back({ 0, 0, total, 1 });
+		while (!stack.empty()) {
+			Entry e = stack.back();
+			stack.pop_back();
+			for (int i = 0; i < 4; i++) {
+				float energy = e.energy * 0.25f;
+				int previous_child = -1;
+				if (e.previous_node >= 0) {
+					const Node & pn = previous.nodes[e.previous_node];
+					energy = pn.sum[i].get();
+					if (!pn.isLeaf(i)) previous_child = pn.children[i];
+				}
+				if (energy / total > threshold && e.depth < max_dtree_depth && nodes.size() < max_nodes) {
+					const uint32_t child = uint32_t(nodes.size());
+					nodes.push_back(Node());
+					nodes[e.node].children[i] = child;
+					stack.push_back({ child, previous_child, energy, e.depth + 1 });
+				}
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The SD-tree
+	///////////////////////////////////////////////////////////////////////////
+	void SDTree::reset(const vec3 & _bounds_min, const vec3 & _bounds_max)
+	{
+		// Use a cube slightly larger than the scene so that all splits are
+		// "square" and no point ends up exactly on the boundary.
+		const vec3 extent = _bounds_max - _bounds_min;
+		const float size = 1.01f * std::max(extent.x, std::max(extent.y, extent.z));
+		bounds_min = 0.5f * (_bounds_min + _bounds_max) - vec3(0.5f * size);
+		bounds_size = vec3(size);
+		nodes.clear();
+		nodes.resize(1);
+		dtrees.clear();
+		dtrees.resize(1);
+		iteration = 0;
+		passes_in_iteration = 0;
+	}
+
+	uint32_t SDTree::dtreeIndex(const vec3 & p) const
+	{
+		vec3 q = clamp((p - bounds_min) / bounds_size, vec3(0.0f), vec3(0.99999f));
+		uint32_t idx = 0;
+		while (!nodes[idx].isLeaf()) {
+			const int axis = nodes[idx].axis;
+			if (q[axis] < 0.5f) {
+				q[axis] = 2.0f * q[axis];
+				idx = nodes[idx].children[0];
+			}
+			else {
+				q[axis] = 2.0f * q[axis] - 1.0f;
+				idx = nodes[idx].children[1];
+			}
+		}
+		return nodes[idx].dtree_index;
+	}
+
+	vec3 SDTree::sample(const vec3 & p, float & pdf) const
+	{
+		const DTree & dtree = dtrees[dtreeIndex(p)].sampling;
+		vec3 wi = dtree.sample();
+		pdf = dtree.pdf(wi);
+		return wi;
+	}
+
+	float SDTree::pdf(const vec3 & p, const vec3 & wi) const
+	{
+		return dtrees[dtreeIndex(p)].sampling.pdf(wi);
+	}
+
+	void SDTree::record(const vec3 & p, const vec3 & wi, float radiance)
+	{
+		if (!(radiance >= 0.0f) || isinf(radiance)) return;
+		dtrees[dtreeIndex(p)].building.record(wi, radiance);
+	}
+
+	void SDTree::endPass()
+	{
+		if (!isInitialized() || !isTraining()) return;
+		passes_in_iteration += 1;
+		if (passes_in_iteration < (1 << iteration)) return;
+		refine();
+		iteration += 1;
+		passes_in_iteration = 0;
+		cout << "Path guiding: iteration " << iteration << " done, "
+			<< spatialLeafCount() << " spatial leaves, "
+			<< directionalNodeCount() << " directional nodes, "
+			<< memoryUsage() / (1024 * 1024) << " MB.\n";
+	}
+
+	void SDTree::refine()
+	{
+		///////////////////////////////////////////////////////////////////////
+		// Split spatial leaves that have seen enough samples. A split leaf
+		// hands a copy of its (half-weighted) quadtrees to both children, so
+		// that they start out with what the parent had learned.
+		///////////////////////////////////////////////////////////////////////
+		const float threshold = guiding_settings.spatial_threshold * sqrt(float(1 << iteration));
+		const size_t max_memory = size_t(guiding_settings.max_memory_mb) * 1024 * 1024;
+		size_t memory = memoryUsage();
+		vector<uint32_t> stack(1, 0);
+		while (!stack.empty()) {
+			const uint32_t idx = stack.back();
+			stack.pop_back();
+			if (!nodes[idx].isLeaf()) {
+				stack.push_back(nodes[idx].children[0]);
+				stack.push_back(nodes[idx].children[1]);
+				continue;
+			}
+			const uint32_t dtree_index = nodes[idx].dtree_index;
+			if (dtrees[dtree_index].building.sampleCount() <= threshold) continue;
+			// The split adds two nodes and a copy of the quadtrees
+			const size_t split_memory = 2 * sizeof(Node) + sizeof(DTreePair) + sizeof(DTree::Node) *
+				(dtrees[dtree_index].sampling.nodeCount() + dtrees[dtree_index].building.nodeCount());
+			if (memory + split_memory > max_memory) continue;
+			dtrees[dtree_index].building.halveSampleCount();
+			dtrees.push_back(dtrees[dtree_index]);
+			memory += split_memory;
+			Node child;
+			child.axis = (nodes[idx].axis + 1) % 3;
+			const uint32_t c0 = uint32_t(nodes.size());
+			child.dtree_index = dtree_index;
+			nodes.push_back(child);
+			child.dtree_index = uint32_t(dtrees.size() - 1);
+			nodes.push_back(child);
+			nodes[idx].children[0] = c0;
+			nodes[idx].children[1] = c0 + 1;
+			stack.push_back(c0);
+			stack.push_back(c0 + 1);
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// What has been learned in this iteration is what we sample from in
+		// the next, and the quadtrees being trained adapt their structure to
+		// it. The memory left after the sampling quadtrees is shared by the
+		// new quadtrees in proportion to the size of their sampling trees
+		// (each keeps at least its root).
+		///////////////////////////////////////////////////////////////////////
+		size_t sampling_nodes = 0;
+		for (auto & d : dtrees) {
+			d.sampling = d.building;
+			sampling_nodes += d.sampling.nodeCount();
+		}
+		const size_t fixed_memory = nodes.size() * sizeof(Node) + dtrees.size() * sizeof(DTreePair) +
+			sampling_nodes * sizeof(DTree::Node);
+		const size_t node_budget = max_memory > fixed_memory ? (max_memory - fixed_memory) / sizeof(DTree::Node) : 0;
+		const size_t shared_nodes = node_budget > dtrees.size() ? node_budget - dtrees.size() : 0;
+		const float directional_threshold = guiding_settings.directional_threshold;
+#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < int(dtrees.size()); i++) {
+			const size_t share = 1 + size_t(double(shared_nodes) * double(dtrees[i].sampling.nodeCount()) / double(sampling_nodes));
+			dtrees[i].building.refine(dtrees[i].sampling, directional_threshold, std::min(share, max_dtree_nodes));
+		}
+	}
+
+	size_t SDTree::directionalNodeCount() const
+	{
+		size_t count = 0;
+		for (auto & d : dtrees) count += d.sampling.nodeCount() + d.building.nodeCount();
+		return count;
+	}
+
+	size_t SDTree::memoryUsage() const
+	{
+		return nodes.size() * sizeof(Node) + dtrees.size() * sizeof(DTreePair) +
+			directionalNodeCount() * sizeof(DTree::Node);
+	}
+}
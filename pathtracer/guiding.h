@@ -0,0 +1,121 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <stdint.h>
+#include "AtomicFloat.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Path guiding settings. The guiding distribution is learned in
+	// iterations, where iteration k consists of 2^k passes of tracePaths().
+	// After each iteration the tree is refined and the statistics gathered
+	// so far are used for sampling during the next iteration.
+	///////////////////////////////////////////////////////////////////////////
+	extern struct GuidingSettings {
+		// Probability of sampling the BRDF instead of the guiding distribution
+		float bsdf_sampling_fraction = 0.5f;
+		// A spatial leaf is split when it has received more than
+		// spatial_threshold * sqrt(2^k) samples in iteration k
+		float spatial_threshold = 12000.0f;
+		// A directional node is split when it holds more than this fraction
+		// of the total energy in its quadtree
+		float directional_threshold = 0.01f;
+		// Stop refining after this many iterations (the last learned
+		// distribution is used for sampling from then on)
+		int max_iterations = 10;
+		// Upper bound on the memory used by the SD-tree, in megabytes. Both
+		// spatial and directional refinement stop at it.
+		int max_memory_mb = 64;
+	} guiding_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// A directional quadtree over the unit square, which is mapped to the
+	// sphere of directions with an area preserving cylindrical mapping.
+	// Each node stores the energy that has arrived through each of its four
+	// quadrants.
+	///////////////////////////////////////////////////////////////////////////
+	class DTree
+	{
+	public:
+		// Energies are summed in fixed point, so that what is learned does
+		// not depend on the order in which threads record samples
+		struct Node {
+			AtomicFixed sum[4];
+			uint32_t children[4] = { 0, 0, 0, 0 }; // 0 means "leaf"
+			bool isLeaf(int i) const { return children[i] == 0; }
+			float total() const { return sum[0].get() + sum[1].get() + sum[2].get() + sum[3].get(); }
+		};
+		DTree();
+		// Add (concurrently) an energy sample arriving from direction d
+		void record(const vec3 & d, float value);
+		// Sample a direction proportionally to the stored energy
+		vec3 sample() const;
+		// The solid angle pdf of sample() choosing direction d
+		float pdf(const vec3 & d) const;
+		// Rebuild the structure so that it adapts to the energy stored in
+		// 'previous', and clear all energy. Keeps at most max_nodes nodes
+		// (but always the root).
+		void refine(const DTree & previous, float threshold, size_t max_nodes);
+		// Number of samples recorded since the last refine()
+		float sampleCount() const { return sample_count.get(); }
+		float totalEnergy() const { return nodes[0].total(); }
+		size_t nodeCount() const { return nodes.size(); }
+		void halveSampleCount() { sample_count = AtomicFloat(sample_count.get() * 0.5f); }
+	private:
+		std::vector<Node> nodes;
+		AtomicFloat sample_count;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// The SD-tree. A binary tree over the (cubic) scene bounding box, whose
+	// leaves each hold two directional quadtrees: one that is sampled from
+	// (learned in the previous iteration) and one that is being trained.
+	///////////////////////////////////////////////////////////////////////////
+	class SDTree
+	{
+	public:
+		// Create an empty tree covering the given bounds
+		void reset(const vec3 & bounds_min, const vec3 & bounds_max);
+		bool isInitialized() const { return !nodes.empty(); }
+		// True once the first iteration is done and there is a learned
+		// distribution to sample from
+		bool canSample() const { return iteration > 0; }
+		bool isTraining() const { return iteration < guiding_settings.max_iterations; }
+		// Sample a direction at position p and return its pdf
+		vec3 sample(const vec3 & p, float & pdf) const;
+		float pdf(const vec3 & p, const vec3 & wi) const;
+		// Record radiance arriving at p from direction wi (thread safe)
+		void record(const vec3 & p, const vec3 & wi, float radiance);
+		// Must be called after each pass. Refines the tree when an iteration
+		// is finished.
+		void endPass();
+		// Statistics
+		int currentIteration() const { return iteration; }
+		size_t spatialLeafCount() const { return dtrees.size(); }
+		size_t directionalNodeCount() const;
+		size_t memoryUsage() const;
+	private:
+		struct Node {
+			uint32_t children[2] = { 0, 0 };
+			uint32_t dtree_index = 0;
+			uint8_t axis = 0;
+			bool isLeaf() const { return children[0] == 0; }
+		};
+		struct DTreePair {
+			DTree sampling;
+			DTree building;
+		};
+		uint32_t dtreeIndex(const vec3 & p) const;
+		void refine();
+		std::vector<Node> nodes;
+		std::vector<DTreePair> dtrees;
+		vec3 bounds_min, bounds_size;
+		int iteration = 0;
+		int passes_in_iteration = 0;
+	};
+
+	extern SDTree sd_tree;
+}
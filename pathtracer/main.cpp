@@ -11,7 +11,23 @@
 #include <Model.h>
 #include <string>
 #include "Pathtracer.h"
+#include "camera.h"
 #include "embree.h"
+#include "guiding.h"
+#include "sppm.h"
+#include "radiance_cache.h"
+#include "gbuffer.h"
+#include "profiling.h"
+#include "threads.h"
+#include "numa.h"
+#include "render_thread.h"
+#include "sequence.h"
+#include "probes.h"
+#ifndef _WIN32
+#include "distributed.h"
+#include "checkpoint.h"
+#include "server.h"
+#endif
 
 using namespace glm;
 using namespace std; 
@@ -45,20 +61,50 @@ vec3 worldUp(0.0f, 1.0f, 0.0f);
 vector<pair<labhelper::Model *, mat4>> models; 
 
 ///////////////////////////////////////////////////////////////////////////////
-// Load shaders, environment maps, models and so on
+// The render thread owns the pathtracer state while it runs, so the UI keeps
+// copies of everything it can change (per model, for the materials), edits
+// those, and sends the changes to the render thread. It shows the newest
+// frame that the render thread has published.
 ///////////////////////////////////////////////////////////////////////////////
-void initialize()
-{
-	///////////////////////////////////////////////////////////////////////////
-	// Load shader program
-	///////////////////////////////////////////////////////////////////////////
-	shaderProgram = labhelper::loadShaderProgram("../pathtracer/simple.vert", "../pathtracer/simple.frag");
+pathtracer::RenderParameters ui_parameters;
+float ui_environment_multiplier;
+pathtracer::PointLight ui_point_light;
+vector<vector<pathtracer::MaterialParameters>> ui_materials;
+vector<vector<uint32_t>> ui_mesh_materials;
+pathtracer::RenderedFrame no_frame;
+const pathtracer::RenderedFrame * displayed_frame = &no_frame;
+
+///////////////////////////////////////////////////////////////////////////////
+// Crop region, dragged with the right mouse button. It is traced at full 
+// resolution, and the subsampling used before is restored when it is 
+// removed.
+///////////////////////////////////////////////////////////////////////////////
+bool cropDragging = false;
+vec2 cropStart, cropEnd;
+int subsamplingBeforeCrop = 1;
 
+///////////////////////////////////////////////////////////////////////////////
+// Set up the pathtracer settings, lights, environment map and models. 
+// Headless processes (distributed rendering workers) have no GL context, so 
+// they load the models without uploading them to the GPU. The models that a
+// sequence animates are added so that they can be moved.
+///////////////////////////////////////////////////////////////////////////////
+void loadScene(bool upload_to_gpu, const pathtracer::Sequence * sequence = nullptr)
+{
 	///////////////////////////////////////////////////////////////////////////
 	// Initial path-tracer settings
 	///////////////////////////////////////////////////////////////////////////
 	pathtracer::settings.max_bounces = 8;
 	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
+	pathtracer::settings.path_guiding = false;
+	pathtracer::settings.integrator = pathtracer::PATH_TRACING;
+	pathtracer::settings.use_radiance_cache = false;
+	pathtracer::settings.use_gbuffer = false;
+	pathtracer::settings.use_reprojection = false;
+	pathtracer::settings.use_crop = false;
+	pathtracer::settings.deterministic = false;
+	pathtracer::settings.seed = 0;
+	pathtracer::settings.projection = pathtracer::PINHOLE;
 	#ifdef _DEBUG
 	pathtracer::settings.subsampling = 16; 
 	#else
@@ -81,17 +127,31 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	// Load .obj models to scene
 	///////////////////////////////////////////////////////////////////////////
-	models.push_back(make_pair(labhelper::loadModelFromOBJ("../scenes/NewShip.obj"), translate(vec3(0.0f, 10.0f, 0.0f))));
-	models.push_back(make_pair(labhelper::loadModelFromOBJ("../scenes/landingpad2.obj"), mat4(1.0f)));
-	//models.push_back(make_pair(labhelper::loadModelFromOBJ("scenes/BigSphere.obj"), mat4(1.0f)));
+	models.push_back(make_pair(labhelper::loadModelFromOBJ("../scenes/NewShip.obj", upload_to_gpu), translate(vec3(0.0f, 10.0f, 0.0f))));
+	models.push_back(make_pair(labhelper::loadModelFromOBJ("../scenes/landingpad2.obj", upload_to_gpu), mat4(1.0f)));
+	//models.push_back(make_pair(labhelper::loadModelFromOBJ("scenes/BigSphere.obj", upload_to_gpu), mat4(1.0f)));
 
 	///////////////////////////////////////////////////////////////////////////
 	// Add models to pathtracer scene
 	///////////////////////////////////////////////////////////////////////////
-	for (auto m : models) {
-		pathtracer::addModel(m.first, m.second);
+	pathtracer::scene_settings.dynamic = sequence != nullptr && !sequence->transforms.empty();
+	for (size_t i = 0; i < models.size(); i++) {
+		pathtracer::addModel(models[i].first, models[i].second, sequence != nullptr && sequence->isAnimated(int(i)));
 	}	
 	pathtracer::buildBVH();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Load shaders, environment maps, models and so on
+///////////////////////////////////////////////////////////////////////////////
+void initialize()
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Load shader program
+	///////////////////////////////////////////////////////////////////////////
+	shaderProgram = labhelper::loadShaderProgram("../pathtracer/simple.vert", "../pathtracer/simple.frag");
+
+	loadScene(true);
 
 	///////////////////////////////////////////////////////////////////////////
 	// Generate result texture
@@ -111,35 +171,107 @@ void initialize()
 	//glEnable(GL_FRAMEBUFFER_SRGB);
 }
 
+vec3 cameraUpVector()
+{
+	vec3 cameraRight = normalize(cross(cameraDirection, worldUp));
+	return normalize(cross(cameraRight, cameraDirection));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Size the image, continue where the last run stopped if there is a 
+// checkpoint, and start tracing on the render thread
+///////////////////////////////////////////////////////////////////////////////
+void startRendering()
+{
+	SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
+	pathtracer::resize(windowWidth, windowHeight);
+	vec3 cameraUp = cameraUpVector();
+#ifndef _WIN32
+	// A checkpoint with a crop region has no subsampling, so removing the
+	// crop goes back to the subsampling we start with
+	const int subsampling = pathtracer::settings.subsampling;
+	pathtracer::resumeFromCheckpoint(windowWidth, windowHeight, cameraPosition, cameraDirection, cameraUp);
+	if (pathtracer::settings.use_crop) subsamplingBeforeCrop = subsampling;
+#endif
+	ui_parameters = pathtracer::currentRenderParameters();
+	ui_environment_multiplier = pathtracer::environment.multiplier;
+	ui_point_light = pathtracer::point_light;
+	ui_materials.clear();
+	ui_mesh_materials.clear();
+	for (auto & m : models) {
+		ui_materials.emplace_back();
+		for (auto & material : m.first->m_materials) {
+			ui_materials.back().push_back(pathtracer::materialParameters(material));
+		}
+		ui_mesh_materials.emplace_back();
+		for (auto & mesh : m.first->m_meshes) {
+			ui_mesh_materials.back().push_back(mesh.m_material_idx);
+		}
+	}
+	pathtracer::startRenderThread(cameraPosition, cameraDirection, cameraUp);
+}
+
+void sendParameters(bool restart)
+{
+	pathtracer::RenderCommand command = {};
+	command.type = pathtracer::RenderCommand::PARAMETERS;
+	command.restart = restart;
+	command.parameters = ui_parameters;
+	pathtracer::sendRenderCommand(command);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Window coordinates (from the upper left corner) to screen coordinates of 
+// the pathtracer (in [0,1]^2 from the lower left corner)
+///////////////////////////////////////////////////////////////////////////////
+vec2 windowToScreenCoord(int x, int y)
+{
+	return clamp(vec2(float(x) / float(windowWidth), 1.0f - float(y) / float(windowHeight)), vec2(0.0f), vec2(1.0f));
+}
+
+void setCrop(bool use_crop, const vec2 & a, const vec2 & b)
+{
+	pathtracer::Settings & settings = ui_parameters.settings;
+	if (use_crop && !settings.use_crop) {
+		subsamplingBeforeCrop = settings.subsampling;
+		settings.subsampling = 1;
+	}
+	else if (!use_crop && settings.use_crop) {
+		settings.subsampling = subsamplingBeforeCrop;
+	}
+	settings.use_crop = use_crop;
+	settings.crop_min = min(a, b);
+	settings.crop_max = max(a, b);
+	sendParameters(true);
+}
+
 void display(void)
 {
 	{	///////////////////////////////////////////////////////////////////////
-		// If first frame, or window resized, or subsampling changes, 
-		// inform the pathtracer
+		// If the window is resized, inform the pathtracer
 		///////////////////////////////////////////////////////////////////////
 		int w, h; 
 		SDL_GetWindowSize(g_window, &w, &h);
-		static int old_subsampling; 
-		if (windowWidth != w || windowHeight != h || old_subsampling != pathtracer::settings.subsampling) {
-			pathtracer::resize(w, h);
+		if (windowWidth != w || windowHeight != h) {
+			pathtracer::RenderCommand command = {};
+			command.type = pathtracer::RenderCommand::RESIZE;
+			command.width = w;
+			command.height = h;
+			pathtracer::sendRenderCommand(command);
 			windowWidth = w; 
-			windowWidth = h;
-			old_subsampling = pathtracer::settings.subsampling; 
+			windowHeight = h;
 		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
-	// Trace one path per pixel
-	///////////////////////////////////////////////////////////////////////////
-	vec3 cameraRight = normalize(cross(cameraDirection, worldUp));
-	vec3 cameraUp = normalize(cross(cameraRight, cameraDirection));
-	pathtracer::tracePaths(cameraPosition, cameraDirection, cameraUp);
-
-	///////////////////////////////////////////////////////////////////////////
-	// Copy pathtraced image to texture for display
+	// Copy the newest pathtraced image (if the render thread has finished a
+	// pass since the last frame) to texture for display
 	///////////////////////////////////////////////////////////////////////////
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pathtracer::rendered_image.width, pathtracer::rendered_image.height,
-		0, GL_RGB, GL_FLOAT, pathtracer::rendered_image.getPtr());
+	if (const pathtracer::RenderedFrame * frame = pathtracer::takeRenderedFrame()) {
+		displayed_frame = frame;
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, frame->width, frame->height,
+			0, GL_RGB, GL_FLOAT, &frame->pixels[0].x);
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Render a fullscreen quad, textured with our pathtraced image.
@@ -162,6 +294,7 @@ bool handleEvents(void)
 
 	// Allow ImGui to capture events.
 	ImGuiIO& io = ImGui::GetIO();
+	bool cameraMoved = false;
 
 	while (SDL_PollEvent(&event)) {
 		ImGui_ImplSdlGL3_ProcessEvent(&event);
@@ -181,11 +314,25 @@ bool handleEvents(void)
 					mat4 yaw = rotate(rotationSpeed * -delta_x, worldUp);
 					mat4 pitch = rotate(rotationSpeed * -delta_y, normalize(cross(cameraDirection, worldUp)));
 					cameraDirection = vec3(pitch * yaw * vec4(cameraDirection, 0.0f));
-					pathtracer::restart(); 
+					cameraMoved = true;
 				}
 				prev_xcoord = event.motion.x;
 				prev_ycoord = event.motion.y;
 			}
+			if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_RIGHT) {
+				cropDragging = true;
+				cropStart = cropEnd = windowToScreenCoord(event.button.x, event.button.y);
+			}
+		}
+		if (cropDragging && event.type == SDL_MOUSEMOTION) {
+			cropEnd = windowToScreenCoord(event.motion.x, event.motion.y);
+		}
+		if (cropDragging && event.type == SDL_MOUSEBUTTONUP && event.button.button == SDL_BUTTON_RIGHT) {
+			cropDragging = false;
+			cropEnd = windowToScreenCoord(event.button.x, event.button.y);
+			// A click without dragging removes the crop region
+			const vec2 size = abs(cropEnd - cropStart);
+			setCrop(size.x > 0.01f && size.y > 0.01f, cropStart, cropEnd);
 		}
 	}
 
@@ -197,30 +344,43 @@ bool handleEvents(void)
 		const float speed = 0.5f; 
 		if (state[SDL_SCANCODE_W]) {
 			cameraPosition += speed * cameraDirection;
-			pathtracer::restart();
+			cameraMoved = true;
 		}
 		if (state[SDL_SCANCODE_S]) {
 			cameraPosition -= speed * cameraDirection;
-			pathtracer::restart();
+			cameraMoved = true;
 		}
 		if (state[SDL_SCANCODE_A]) {
 			cameraPosition -= speed * cameraRight;
-			pathtracer::restart();
+			cameraMoved = true;
 		}
 		if (state[SDL_SCANCODE_D]) {
 			cameraPosition += speed * cameraRight;
-			pathtracer::restart();
+			cameraMoved = true;
 		}
 		if (state[SDL_SCANCODE_Q]) {
 			cameraPosition -= speed * worldUp;
-			pathtracer::restart();
+			cameraMoved = true;
 		}
 		if (state[SDL_SCANCODE_E]) {
 			cameraPosition += speed * worldUp;
-			pathtracer::restart();
+			cameraMoved = true;
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// One command for all of this frame's camera movement, which cancels the
+	// pass that is being traced (unless it is reprojected)
+	///////////////////////////////////////////////////////////////////////////
+	if (cameraMoved) {
+		pathtracer::RenderCommand command = {};
+		command.type = pathtracer::RenderCommand::CAMERA;
+		command.camera_pos = cameraPosition;
+		command.camera_dir = cameraDirection;
+		command.camera_up = cameraUpVector();
+		pathtracer::sendRenderCommand(command);
+	}
+
 	return quitEvent;
 }
 
@@ -259,13 +419,13 @@ void gui() {
 	static int model_index = 0;
 	static labhelper::Model * model = models[0].first; 
 	static int mesh_index = 0;
-	static int material_index = model->m_meshes[mesh_index].m_material_idx;
+	static int material_index = ui_mesh_materials[model_index][mesh_index];
 
 	if (ImGui::Combo("Model", &model_index, model_getter,
 		(void *)&models, models.size())) {
 		model = models[model_index].first;
 		mesh_index = 0; 
-		material_index = model->m_meshes[mesh_index].m_material_idx;
+		material_index = ui_mesh_materials[model_index][mesh_index];
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -276,17 +436,22 @@ void gui() {
 	{
 		if (ImGui::ListBox("Meshes", &mesh_index, mesh_getter,
 			(void*)&model->m_meshes, model->m_meshes.size(), 8)) {
-			material_index = model->m_meshes[mesh_index].m_material_idx;
+			material_index = ui_mesh_materials[model_index][mesh_index];
 		}
 
 		labhelper::Mesh & mesh = model->m_meshes[mesh_index];
 		char name[256];
 		strcpy(name, mesh.m_name.c_str());
 		if (ImGui::InputText("Mesh Name", name, 256)) { mesh.m_name = name; }
-		labhelper::Material & selected_material = model->m_materials[material_index];
 		if (ImGui::Combo("Material", &material_index, material_getter,
 			(void *)&model->m_materials, model->m_materials.size())) {
-			mesh.m_material_idx = material_index;
+			ui_mesh_materials[model_index][mesh_index] = material_index;
+			pathtracer::RenderCommand command = {};
+			command.type = pathtracer::RenderCommand::MESH_MATERIAL;
+			command.restart = ui_parameters.settings.use_gbuffer;
+			command.mesh = &mesh;
+			command.material_index = material_index;
+			pathtracer::sendRenderCommand(command);
 		}
 	}
 
@@ -298,16 +463,26 @@ void gui() {
 		ImGui::ListBox("Materials", &material_index, material_getter,
 			(void*)&model->m_materials, model->m_materials.size(), 8);
 		labhelper::Material & material = model->m_materials[material_index];
+		pathtracer::MaterialParameters & parameters = ui_materials[model_index][material_index];
 		char name[256];
 		strcpy(name, material.m_name.c_str());
 		if (ImGui::InputText("Material Name", name, 256)) { material.m_name = name; }
-		ImGui::ColorEdit3("Color", &material.m_color.x);
-		ImGui::SliderFloat("Reflectivity", &material.m_reflectivity, 0.0f, 1.0f);
-		ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
-		ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
-		ImGui::SliderFloat("shininess", &material.m_shininess, 0.0f, 25000.0f);
-		ImGui::SliderFloat("Emission", &material.m_emission, 0.0f, 10.0f);
-		ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+		bool changed = false;
+		changed |= ImGui::ColorEdit3("Color", &parameters.color.x);
+		changed |= ImGui::SliderFloat("Reflectivity", &parameters.reflectivity, 0.0f, 1.0f);
+		changed |= ImGui::SliderFloat("Metalness", &parameters.metalness, 0.0f, 1.0f);
+		changed |= ImGui::SliderFloat("Fresnel", &parameters.fresnel, 0.0f, 1.0f);
+		changed |= ImGui::SliderFloat("shininess", &parameters.shininess, 0.0f, 25000.0f);
+		changed |= ImGui::SliderFloat("Emission", &parameters.emission, 0.0f, 10.0f);
+		changed |= ImGui::SliderFloat("Transparency", &parameters.transparency, 0.0f, 1.0f);
+		if (changed) {
+			pathtracer::RenderCommand command = {};
+			command.type = pathtracer::RenderCommand::MATERIAL;
+			command.restart = ui_parameters.settings.use_gbuffer;
+			command.material = &material;
+			command.material_parameters = parameters;
+			pathtracer::sendRenderCommand(command);
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -315,39 +490,470 @@ void gui() {
 	///////////////////////////////////////////////////////////////////////////
 	if (ImGui::CollapsingHeader("Light sources", "lights_ch", true, true))
 	{
-		ImGui::SliderFloat("Environment multiplier", &pathtracer::environment.multiplier, 0.0f, 10.0f);
-		ImGui::ColorEdit3("Point light color", &pathtracer::point_light.color.x);
-		ImGui::SliderFloat("Point light intensity multiplier", &pathtracer::point_light.intensity_multiplier, 0.0f, 10000.0f);
+		bool changed = false;
+		changed |= ImGui::SliderFloat("Environment multiplier", &ui_environment_multiplier, 0.0f, 10.0f);
+		changed |= ImGui::ColorEdit3("Point light color", &ui_point_light.color.x);
+		changed |= ImGui::SliderFloat("Point light intensity multiplier", &ui_point_light.intensity_multiplier, 0.0f, 10000.0f);
+		if (changed) {
+			pathtracer::RenderCommand command = {};
+			command.type = pathtracer::RenderCommand::LIGHTS;
+			command.restart = ui_parameters.settings.use_gbuffer;
+			command.environment_multiplier = ui_environment_multiplier;
+			command.point_light = ui_point_light;
+			pathtracer::sendRenderCommand(command);
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Pathtracer settings
 	///////////////////////////////////////////////////////////////////////////
+	const pathtracer::RenderedFrame & frame = *displayed_frame;
 	if (ImGui::CollapsingHeader("Pathtracer", "pathtracer_ch", true, true))
 	{
-		ImGui::SliderInt("Subsampling", &pathtracer::settings.subsampling, 1, 16);
-		ImGui::SliderInt("Max Bounces", &pathtracer::settings.max_bounces, 0, 16);
-		ImGui::SliderInt("Max Paths Per Pixel", &pathtracer::settings.max_paths_per_pixel, 0, 1024);
+		pathtracer::Settings & settings = ui_parameters.settings;
+		bool changed = false, restart = false;
+		ImGui::Text("%d threads%s%s", pathtracer::threadCount(),
+			pathtracer::thread_settings.shared_pool ? ", shared with Embree" : "",
+			pathtracer::thread_settings.pin_threads ? ", pinned" : "");
+		ImGui::Text("%d samples per pixel, %d passes of %.1f ms in the last frame", frame.number_of_samples,
+			frame.passes, frame.pass_seconds * 1000.0f);
+		float frame_budget_ms = ui_parameters.frame_budget * 1000.0f;
+		if (ImGui::SliderFloat("Frame time budget (ms)", &frame_budget_ms, 0.0f, 1000.0f, "%.1f", 3.0f)) {
+			ui_parameters.frame_budget = frame_budget_ms / 1000.0f;
+			changed = true;
+		}
+		restart |= ImGui::SliderInt("Subsampling", &settings.subsampling, 1, 16);
+		changed |= ImGui::SliderInt("Max Bounces", &settings.max_bounces, 0, 16);
+		changed |= ImGui::SliderInt("Max Paths Per Pixel", &settings.max_paths_per_pixel, 0, 1024);
+		restart |= ImGui::Combo("Integrator", &settings.integrator, "Path tracing\0Bidirectional path tracing\0Stochastic progressive photon mapping\0");
+		// The panoramas are stretched to the window
+		restart |= ImGui::Combo("Camera", &settings.projection, "Pinhole\0Equirectangular\0Cube map\0");
+		restart |= ImGui::Checkbox("Path guiding", &settings.path_guiding);
+		restart |= ImGui::Checkbox("Deterministic", &settings.deterministic);
+		if (settings.deterministic) {
+			int seed = int(settings.seed);
+			if (ImGui::InputInt("Seed", &seed)) {
+				settings.seed = uint32_t(seed);
+				restart = true;
+			}
+		}
+		if (settings.path_guiding) {
+			changed |= ImGui::SliderFloat("BSDF sampling fraction", &ui_parameters.bsdf_sampling_fraction, 0.0f, 1.0f);
+			ImGui::Text("Training iteration %d, %d spatial leaves, %.1f MB",
+				frame.guiding_iteration, int(frame.guiding_leaves),
+				frame.guiding_memory / (1024.0f * 1024.0f));
+		}
+		if (settings.integrator == pathtracer::PATH_TRACING && !settings.deterministic) {
+			restart |= ImGui::Checkbox("Radiance cache", &settings.use_radiance_cache);
+			if (settings.use_radiance_cache) {
+				ImGui::Text("%d cache records", int(frame.radiance_cache_records));
+				if (ImGui::Button("Clear radiance cache")) {
+					pathtracer::RenderCommand command = {};
+					command.type = pathtracer::RenderCommand::CLEAR_RADIANCE_CACHE;
+					command.restart = true;
+					pathtracer::sendRenderCommand(command);
+				}
+			}
+		}
+		if (settings.integrator == pathtracer::PATH_TRACING) {
+			// With the G-buffer, material and light edits restart the image,
+			// since only the paths after the first hit are traced again
+			restart |= ImGui::Checkbox("Cache first hits (G-buffer)", &settings.use_gbuffer);
+			// Camera moves still restart the pass count, but not the pixels
+			changed |= ImGui::Checkbox("Reproject on camera moves", &settings.use_reprojection);
+			if (settings.use_gbuffer) {
+				ImGui::Text("%d of %d samples per pixel cached, %.1f MB", frame.gbuffer_samples,
+					pathtracer::gbuffer_settings.samples_per_pixel, frame.gbuffer_memory / (1024.0f * 1024.0f));
+			}
+		}
+		if (settings.integrator == pathtracer::PHOTON_MAPPING) {
+			changed |= ImGui::SliderInt("Photons per pass", &ui_parameters.photons_per_iteration, 10000, 2000000);
+			restart |= ImGui::SliderFloat("Initial radius", &ui_parameters.initial_radius, 0.0001f, 0.01f, "%.4f");
+			ImGui::Text("Metals are shaded as mirrors and transparent materials as glass,");
+			ImGui::Text("the other integrators shade all materials as diffuse");
+		}
+		if (settings.use_crop) {
+			ImGui::Text("Crop region (%.2f, %.2f) - (%.2f, %.2f)", settings.crop_min.x, settings.crop_min.y,
+				settings.crop_max.x, settings.crop_max.y);
+			ImGui::SameLine();
+			if (ImGui::Button("Remove crop")) setCrop(false, vec2(0.0f), vec2(1.0f));
+		}
+		else {
+			ImGui::Text("Drag with the right mouse button to trace only a region");
+		}
+		if (changed || restart) sendParameters(restart);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Where the last pass spent its time
+	///////////////////////////////////////////////////////////////////////////
+	if (ImGui::CollapsingHeader("Profiling", "profiling_ch", true, false))
+	{
+		if (!pathtracer::profilingAvailable()) {
+			ImGui::Text("Build with the PATHTRACER_PROFILING option to enable.");
+		}
+		else {
+			const pathtracer::PassProfile & p = frame.profile;
+			const vector<float> & history = frame.rays_per_second_history;
+			ImGui::Text("Pass %d: %.1f ms, %d threads", p.pass, p.seconds * 1000.0, p.threads);
+			ImGui::Text("%.2f Mrays/s, average path length %.2f", p.rays_per_second * 1e-6, p.average_path_length);
+			if (!history.empty()) {
+				ImGui::PlotLines("Rays/s", history.data(), int(history.size()), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+			}
+			// Fractions of the thread time of the pass
+			const double thread_seconds = p.seconds * std::max(1, p.threads);
+			double other = thread_seconds;
+			for (int i = 0; i < pathtracer::NOF_PROFILE_PHASES; i++) {
+				const double fraction = thread_seconds > 0.0 ? p.phase_seconds[i] / thread_seconds : 0.0;
+				ImGui::ProgressBar(float(fraction), ImVec2(120, 0));
+				ImGui::SameLine();
+				ImGui::Text("%s (%.1f ms)", pathtracer::profile_phase_names[i], p.phase_seconds[i] * 1000.0);
+				other -= p.phase_seconds[i];
+			}
+			ImGui::ProgressBar(thread_seconds > 0.0 ? float(std::max(0.0, other) / thread_seconds) : 0.0f, ImVec2(120, 0));
+			ImGui::SameLine();
+			ImGui::Text("other, including idle threads");
+			for (int i = 0; i < pathtracer::NOF_PROFILE_COUNTERS; i++) {
+				ImGui::Text("%s: %llu", pathtracer::profile_counter_names[i], (unsigned long long)p.counters[i]);
+			}
+			if (ImGui::Checkbox("Write CSV", &ui_parameters.write_profile_csv)) sendParameters(false);
+			ImGui::SameLine();
+			ImGui::Text("%s", pathtracer::profiling_settings.csv_filename.c_str());
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Memory placement on NUMA machines
+	///////////////////////////////////////////////////////////////////////////
+	if (ImGui::CollapsingHeader("NUMA", "numa_ch", true, false))
+	{
+		ImGui::Text("%d nodes%s", pathtracer::numaNodeCount(),
+			pathtracer::numa_settings.replicate_scene ? ", scene replicated per node" : "");
+		if (ImGui::Checkbox("Parallel first touch of the image", &ui_parameters.first_touch)) {
+			sendParameters(true);
+		}
+		const pathtracer::NumaStatistics statistics = pathtracer::numaStatistics();
+		if (!statistics.available) {
+			ImGui::Text("Memory placement is not reported on this system.");
+		}
+		else {
+			for (size_t node = 0; node < statistics.node_memory_mb.size(); node++) {
+				ImGui::Text("Node %d: %.1f MB", int(node), statistics.node_memory_mb[node]);
+			}
+			const uint64_t total = statistics.local_pages + statistics.remote_pages;
+			ImGui::Text("Allocations: %.1f%% local (%llu pages, system wide)",
+				total > 0 ? 100.0 * double(statistics.local_pages) / double(total) : 100.0, (unsigned long long)total);
+			if (ImGui::Button("Reset allocation counts")) pathtracer::resetNumaStatistics();
+		}
+	}
+
+#ifndef _WIN32
+	///////////////////////////////////////////////////////////////////////////
+	// Checkpoints of the accumulated image
+	///////////////////////////////////////////////////////////////////////////
+	if (ImGui::CollapsingHeader("Checkpoints", "checkpoints_ch", true, false))
+	{
+		bool changed = false;
+		changed |= ImGui::Checkbox("Write checkpoints", &ui_parameters.checkpoints_enabled);
+		changed |= ImGui::SliderFloat("Interval (s)", &ui_parameters.checkpoint_interval, 1.0f, 600.0f);
+		if (changed) sendParameters(false);
+		ImGui::Text("Last checkpoint: %d samples per pixel", frame.checkpoint_samples);
 	}
 
+#endif
 	///////////////////////////////////////////////////////////////////////////
-	// A button for saving your results
+	// A button for saving your results. The render thread is stopped while
+	// the materials are written.
 	///////////////////////////////////////////////////////////////////////////
 	if (ImGui::Button("Save Materials")) {
+		pathtracer::stopRenderThread();
 		for (auto & m : models) {
 			labhelper::saveModelToOBJ(m.first, m.first->m_filename);
 		}
+		pathtracer::startRenderThread(cameraPosition, cameraDirection, cameraUpVector());
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Outline the crop region, or the one being dragged
+	///////////////////////////////////////////////////////////////////////////
+	if (cropDragging || ui_parameters.settings.use_crop) {
+		const vec2 a = cropDragging ? min(cropStart, cropEnd) : ui_parameters.settings.crop_min;
+		const vec2 b = cropDragging ? max(cropStart, cropEnd) : ui_parameters.settings.crop_max;
+		ImGui::SetNextWindowPos(ImVec2(0, 0));
+		ImGui::SetNextWindowSize(ImVec2(float(windowWidth), float(windowHeight)));
+		ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0, 0));
+		ImGui::Begin("Crop region", nullptr, ImVec2(0, 0), 0.0f, ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoResize |
+			ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoScrollbar | ImGuiWindowFlags_NoSavedSettings | ImGuiWindowFlags_NoInputs);
+		ImGui::GetWindowDrawList()->AddRect(ImVec2(a.x * windowWidth, (1.0f - b.y) * windowHeight),
+			ImVec2(b.x * windowWidth, (1.0f - a.y) * windowHeight), IM_COL32(255, 255, 0, 255));
+		ImGui::End();
+		ImGui::PopStyleVar();
 	}
 
 	// Render the GUI.
 	ImGui::Render();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Rendering from the command line. An animation (see sequence.h) is rendered
+// to numbered files with
+//   pathtracer --sequence <file> [--samples N] [--width W] [--height H]
+//              [--output frame_%04d.hdr] [--integrator 0|1]
+//              [--concurrent-frames N]
+// which renders several frames at once (in as many processes, sharing the
+// threads) if the frames are too small to keep all threads busy, unless
+// told how many. Light probes (see probes.h) are rendered to numbered
+// panoramas, all in one process with one BVH, with
+//   pathtracer --probes <file> [--projection equirectangular|cubemap]
+//              [--probe-size S] [--samples N] [--output probe_%03d.hdr]
+//              [--integrator 0|1|2]
+// where the images are S pixels high. On POSIX systems, there is also
+// distributed rendering:
+//   pathtracer --coordinator <address> [--samples N] [--width W] [--height H]
+//              [--output file.hdr] [--chunk N] [--seed S] [--integrator 0|1]
+//              [--guiding] [--crop x0,y0,x1,y1]
+//   pathtracer --worker <address>
+// where <address> is host:port or unix:/path/to/socket. The coordinator
+// renders from the default camera, and only the pixels in the crop region
+// (in [0,1]^2 from the lower left corner) if one is given. A render server
+// keeps the scene loaded and renders the jobs that clients submit (see
+// server.h):
+//   pathtracer --server <address>
+//   pathtracer --submit <address> [--samples N] [--width W] [--height H]
+//              [--output file.hdr] [--seed S] [--integrator 0|1|2]
+//              [--priority P] [--aovs normal,depth,albedo] [--progress s]
+// where the client renders from the default camera. The threads of a worker,
+// a sequence, a server (or of the interactive pathtracer) are set with
+//   [--threads N] [--pin] [--pin-to-nodes] [--no-hyperthreads]
+//   [--separate-pools] [--replicate-scene] [--no-first-touch]
+// and large scenes can be shaded from quantized data (see shading_data.h)
+// with [--compact-shading].
+// Returns -1 if the arguments do not ask for rendering from the command
+// line.
+///////////////////////////////////////////////////////////////////////////////
+int runCommandLine(int argc, char *argv[])
+{
+	string output, sequence_file, probes_file;
+	pathtracer::ProbeJob probe_job;
+	probe_job.projection = pathtracer::EQUIRECTANGULAR;
+	probe_job.size = 256;
+	// With concurrent frames, each process renders every parts:th frame
+	// from part on
+	int concurrent_frames = 0, part = 0, parts = 1;
+	int width = 1280, height = 720, samples = 1024;
+	int integrator = pathtracer::PATH_TRACING;
+#ifndef _WIN32
+	string coordinator_address, worker_address, server_address, submit_address;
+	pathtracer::SubmitMessage submit = {};
+	submit.progress_interval = 1.0f;
+	pathtracer::RenderJob job;
+	bool path_guiding = false;
+#endif
+	for (int i = 1; i < argc; i++) {
+		const string arg = argv[i];
+		const bool has_value = i + 1 < argc;
+		if (arg == "--samples" && has_value) samples = atoi(argv[++i]);
+		else if (arg == "--width" && has_value) width = atoi(argv[++i]);
+		else if (arg == "--height" && has_value) height = atoi(argv[++i]);
+		else if (arg == "--output" && has_value) output = argv[++i];
+		else if (arg == "--integrator" && has_value) integrator = atoi(argv[++i]);
+		else if (arg == "--sequence" && has_value) sequence_file = argv[++i];
+		else if (arg == "--probes" && has_value) probes_file = argv[++i];
+		else if (arg == "--probe-size" && has_value) probe_job.size = atoi(argv[++i]);
+		else if (arg == "--projection" && has_value) {
+			const string projection = argv[++i];
+			if (projection == "equirectangular") probe_job.projection = pathtracer::EQUIRECTANGULAR;
+			else if (projection == "cubemap") probe_job.projection = pathtracer::CUBEMAP;
+			else {
+				cout << "--projection takes equirectangular or cubemap\n";
+				return 1;
+			}
+		}
+		else if (arg == "--concurrent-frames" && has_value) concurrent_frames = atoi(argv[++i]);
+		else if (arg == "--sequence-part" && has_value) {
+			if (sscanf(argv[++i], "%d,%d", &part, &parts) != 2 || parts < 1 || part < 0 || part >= parts) {
+				cout << "--sequence-part takes part,parts\n";
+				return 1;
+			}
+		}
+		else if (arg == "--threads" && has_value) pathtracer::thread_settings.threads = atoi(argv[++i]);
+		else if (arg == "--pin") pathtracer::thread_settings.pin_threads = true;
+		else if (arg == "--pin-to-nodes") pathtracer::thread_settings.pin_threads = pathtracer::thread_settings.pin_to_nodes = true;
+		else if (arg == "--no-hyperthreads") pathtracer::thread_settings.use_hyperthreads = false;
+		else if (arg == "--replicate-scene") pathtracer::numa_settings.replicate_scene = true;
+		else if (arg == "--no-first-touch") pathtracer::numa_settings.first_touch = false;
+		else if (arg == "--separate-pools") pathtracer::thread_settings.shared_pool = false;
+		else if (arg == "--compact-shading") pathtracer::scene_settings.compact_shading = true;
+#ifndef _WIN32
+		else if (arg == "--coordinator" && has_value) coordinator_address = argv[++i];
+		else if (arg == "--worker" && has_value) worker_address = argv[++i];
+		else if (arg == "--chunk" && has_value) pathtracer::distributed_settings.samples_per_chunk = atoi(argv[++i]);
+		else if (arg == "--seed" && has_value) pathtracer::distributed_settings.seed = uint32_t(strtoul(argv[++i], nullptr, 10));
+		else if (arg == "--guiding") path_guiding = true;
+		else if (arg == "--server" && has_value) server_address = argv[++i];
+		else if (arg == "--submit" && has_value) submit_address = argv[++i];
+		else if (arg == "--priority" && has_value) submit.priority = atoi(argv[++i]);
+		else if (arg == "--progress" && has_value) submit.progress_interval = float(atof(argv[++i]));
+		else if (arg == "--aovs" && has_value) {
+			const string aovs = string(",") + argv[++i] + ",";
+			if (aovs.find(",normal,") != string::npos) submit.aovs |= 1u << pathtracer::AOV_NORMAL;
+			if (aovs.find(",depth,") != string::npos) submit.aovs |= 1u << pathtracer::AOV_DEPTH;
+			if (aovs.find(",albedo,") != string::npos) submit.aovs |= 1u << pathtracer::AOV_ALBEDO;
+		}
+		else if (arg == "--crop" && has_value) {
+			vec4 crop;
+			if (sscanf(argv[++i], "%f,%f,%f,%f", &crop.x, &crop.y, &crop.z, &crop.w) != 4) {
+				cout << "--crop takes x0,y0,x1,y1\n";
+				return 1;
+			}
+			job.use_crop = true;
+			job.crop_min = min(vec2(crop.x, crop.y), vec2(crop.z, crop.w));
+			job.crop_max = max(vec2(crop.x, crop.y), vec2(crop.z, crop.w));
+		}
+#endif
+		else {
+			cout << "Unknown argument: " << arg << "\n";
+			return 1;
+		}
+	}
+	if (!sequence_file.empty()) {
+		pathtracer::Sequence sequence;
+		if (!pathtracer::loadSequence(sequence_file, sequence)) return 1;
+		if (width <= 0 || height <= 0 || samples <= 0) {
+			cout << "Width, height and samples must be positive\n";
+			return 1;
+		}
+		pathtracer::SequenceJob sequence_job;
+		sequence_job.width = width;
+		sequence_job.height = height;
+		sequence_job.samples = samples;
+		sequence_job.output = output.empty() ? "frame_%04d.hdr" : output;
+		if (!pathtracer::isNumberedPattern(sequence_job.output)) {
+			cout << "--output takes a pattern with one %d for the frame number\n";
+			return 1;
+		}
+		if (parts == 1) {
+			const int threads = pathtracer::thread_settings.threads > 0 ? pathtracer::thread_settings.threads :
+				int(pathtracer::logicalProcessors(pathtracer::thread_settings.use_hyperthreads).size());
+			if (concurrent_frames <= 0) concurrent_frames = pathtracer::concurrentFrames(sequence_job, threads);
+			concurrent_frames = std::min(concurrent_frames, sequence.frames);
+			if (concurrent_frames > 1) {
+				// Each process loads the scene and renders a share of the 
+				// frames with a share of the threads. They are not pinned, 
+				// as they would be pinned to the same processors.
+				cout << "Rendering " << concurrent_frames << " frames at a time\n";
+				vector<string> commands;
+				for (int p = 0; p < concurrent_frames; p++) {
+					commands.push_back("\"" + string(argv[0]) + "\" --sequence \"" + sequence_file + "\"" +
+						" --width " + to_string(width) + " --height " + to_string(height) +
+						" --samples " + to_string(samples) + " --output \"" + sequence_job.output + "\"" +
+						" --integrator " + to_string(integrator) +
+						" --threads " + to_string(std::max(1, threads / concurrent_frames)) +
+						(pathtracer::thread_settings.use_hyperthreads ? "" : " --no-hyperthreads") +
+						(pathtracer::scene_settings.compact_shading ? " --compact-shading" : "") +
+						" --sequence-part " + to_string(p) + "," + to_string(concurrent_frames));
+				}
+				return pathtracer::runSequenceProcesses(commands, sequence.frames) ? 0 : 1;
+			}
+		}
+		if (sequence.camera.empty()) {
+			sequence.camera.push_back({ 0.0f, cameraPosition, cameraPosition + cameraDirection });
+		}
+		loadScene(false, &sequence);
+		pathtracer::settings.max_bounces = 8;
+		pathtracer::settings.integrator = integrator;
+		vector<const labhelper::Model *> sequence_models;
+		for (auto & m : models) sequence_models.push_back(m.first);
+		const bool ok = pathtracer::renderSequence(sequence, sequence_models, sequence_job, part, parts);
+		for (auto & m : models) {
+			labhelper::freeModel(m.first);
+		}
+		return ok ? 0 : 1;
+	}
+	if (!probes_file.empty()) {
+		vector<vec3> probes;
+		if (!pathtracer::loadProbes(probes_file, probes)) return 1;
+		if (probe_job.size <= 0 || samples <= 0) {
+			cout << "Probe size and samples must be positive\n";
+			return 1;
+		}
+		probe_job.samples = samples;
+		probe_job.output = output.empty() ? "probe_%03d.hdr" : output;
+		if (!pathtracer::isNumberedPattern(probe_job.output)) {
+			cout << "--output takes a pattern with one %d for the probe number\n";
+			return 1;
+		}
+		// The scene and its BVH are built once, for all probes
+		loadScene(false);
+		pathtracer::settings.max_bounces = 8;
+		pathtracer::settings.integrator = integrator;
+		const bool ok = pathtracer::renderProbes(probes, probe_job);
+		for (auto & m : models) {
+			labhelper::freeModel(m.first);
+		}
+		return ok ? 0 : 1;
+	}
+#ifndef _WIN32
+	if (!server_address.empty()) {
+		// The scene and its BVH are built once, for all jobs
+		loadScene(false);
+		const bool ok = pathtracer::runServer(server_address);
+		for (auto & m : models) {
+			labhelper::freeModel(m.first);
+		}
+		return ok ? 0 : 1;
+	}
+	if (!submit_address.empty()) {
+		submit.width = width;
+		submit.height = height;
+		submit.samples = samples;
+		submit.camera_pos = cameraPosition;
+		submit.camera_dir = cameraDirection;
+		submit.camera_up = normalize(cross(normalize(cross(cameraDirection, worldUp)), cameraDirection));
+		submit.integrator = integrator;
+		submit.max_bounces = 8;
+		submit.seed = pathtracer::distributed_settings.seed;
+		return pathtracer::submitJob(submit_address, submit, output.empty() ? "server.hdr" : output) ? 0 : 1;
+	}
+	if (!worker_address.empty()) {
+		loadScene(false);
+		const bool ok = pathtracer::runWorker(worker_address);
+		for (auto & m : models) {
+			labhelper::freeModel(m.first);
+		}
+		return ok ? 0 : 1;
+	}
+	if (!coordinator_address.empty()) {
+		if (width <= 0 || height <= 0 || samples <= 0) {
+			cout << "Width, height and samples must be positive\n";
+			return 1;
+		}
+		pathtracer::settings.max_bounces = 8;
+		pathtracer::settings.integrator = integrator;
+		pathtracer::settings.path_guiding = path_guiding;
+		job.width = width;
+		job.height = height;
+		job.samples = samples;
+		job.camera_pos = cameraPosition;
+		job.camera_dir = cameraDirection;
+		job.camera_up = normalize(cross(normalize(cross(cameraDirection, worldUp)), cameraDirection));
+		return pathtracer::runCoordinator(coordinator_address, job, output.empty() ? "distributed.hdr" : output) ? 0 : 1;
+	}
+#endif
+	return -1;
+}
+
 int main(int argc, char *argv[])
 {
+	if (argc > 1) {
+		const int result = runCommandLine(argc, argv);
+		if (result >= 0) return result;
+	}
+
 	g_window = labhelper::init_window_SDL("Pathtracer", 1280, 720);
 
 	initialize();
+	startRendering();
 
 	bool stopRendering = false;
 	auto startTime = std::chrono::system_clock::now();
@@ -366,6 +972,10 @@ int main(int argc, char *argv[])
 		stopRendering = handleEvents();
 	}
 
+	pathtracer::stopRenderThread();
+#ifndef _WIN32
+	pathtracer::finishCheckpoints(cameraPosition, cameraDirection, cameraUpVector());
+#endif
 	// Delete Models
 	for (auto & m : models) {
 		labhelper::freeModel(m.first);
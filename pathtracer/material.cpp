@@ -22,6 +22,10 @@ namespace pathtracer
 		return f(wi, wo, n);
 	}
 
+	float Diffuse::pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) {
+		return max(0.0f, dot(n, wi)) / M_PI;
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// A Blinn Phong Dielectric Microfacet BRFD
 	///////////////////////////////////////////////////////////////////////////
@@ -46,6 +50,10 @@ namespace pathtracer
 		return f(wi, wo, n); 
 	}
 
+	float BlinnPhong::pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) {
+		return max(0.0f, dot(n, wi)) / M_PI;
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// A Blinn Phong Metal Microfacet BRFD (extends the BlinnPhong class)
 	///////////////////////////////////////////////////////////////////////////
@@ -68,7 +76,62 @@ namespace pathtracer
 		return vec3(0.0f);
 	}
 
+	float LinearBlend::pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) {
+		return 0.0f;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// A perfect mirror
+	///////////////////////////////////////////////////////////////////////////
+	vec3 SpecularReflection::f(const vec3 & wi, const vec3 & wo, const vec3 & n) {
+		return vec3(0.0f);
+	}
+
+	vec3 SpecularReflection::sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) {
+		wi = reflect(-wo, n);
+		p = 1.0f;
+		return color / std::max(EPSILON, abs(dot(wi, n)));
+	}
+
+	float SpecularReflection::pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) {
+		return 0.0f;
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// A perfect specular refraction.
 	///////////////////////////////////////////////////////////////////////////
+	vec3 SpecularRefraction::f(const vec3 & wi, const vec3 & wo, const vec3 & n) {
+		return vec3(0.0f);
+	}
+
+	vec3 SpecularRefraction::sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) {
+		// Orient the normal towards wo, and find the relative index of 
+		// refraction depending on whether we are entering or leaving.
+		const bool entering = dot(wo, n) > 0.0f;
+		const vec3 nf = entering ? n : -n;
+		const float eta = entering ? 1.0f / ior : ior;
+		const float cos_i = abs(dot(wo, nf));
+		const float sin2_t = eta * eta * std::max(0.0f, 1.0f - cos_i * cos_i);
+		// Fresnel reflectance of unpolarized light (1.0 at total internal
+		// reflection)
+		float F = 1.0f;
+		if (sin2_t < 1.0f) {
+			const float cos_t = sqrt(1.0f - sin2_t);
+			const float r_parallel = (cos_i - eta * cos_t) / (cos_i + eta * cos_t);
+			const float r_perpendicular = (eta * cos_i - cos_t) / (eta * cos_i + cos_t);
+			F = 0.5f * (r_parallel * r_parallel + r_perpendicular * r_perpendicular);
+		}
+		if (randf() < F) {
+			wi = reflect(-wo, nf);
+			p = F;
+			return vec3(F) / std::max(EPSILON, abs(dot(wi, n)));
+		}
+		wi = refract(-wo, nf, eta);
+		p = 1.0f - F;
+		return vec3(1.0f - F) / std::max(EPSILON, abs(dot(wi, n)));
+	}
+
+	float SpecularRefraction::pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) {
+		return 0.0f;
+	}
 }
\ No newline at end of file
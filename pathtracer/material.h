@@ -18,6 +18,10 @@ namespace pathtracer
 		// Sample a suitable direction and return the brdf in that direction as
 		// well as the pdf (~probability) that the direction was chosen. 
 		virtual vec3 sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) = 0;
+		// Return the pdf with which sample_wi() would have chosen wi. Needed 
+		// whenever a direction is generated by some other strategy (e.g., 
+		// path guiding) and the two strategies are combined with MIS.
+		virtual float pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) = 0;
 	};
 
 	///////////////////////////////////////////////////////////////////////////
@@ -30,6 +34,7 @@ namespace pathtracer
 		Diffuse(vec3 c) : color(c) {}
 		virtual vec3 f(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
 		virtual vec3 sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) override;
+		virtual float pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
 	};
 
 	///////////////////////////////////////////////////////////////////////////
@@ -47,6 +52,7 @@ namespace pathtracer
 		virtual vec3 reflection_brdf(const vec3 & wi, const vec3 & wo, const vec3 & n);
 		virtual vec3 f(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
 		virtual vec3 sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) override;
+		virtual float pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
 	};
 
 	///////////////////////////////////////////////////////////////////////////
@@ -73,6 +79,36 @@ namespace pathtracer
 		LinearBlend(float _w, BRDF * a, BRDF * b) : w(_w), bsdf0(a), bsdf1(b) {};
 		virtual vec3 f(const vec3 & wi, const vec3 & wo, const vec3 & n) override; 
 		virtual vec3 sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) override; 
+		virtual float pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
 	};
 
+	///////////////////////////////////////////////////////////////////////////
+	// A perfect mirror. This is a delta distribution, so f() and pdf() are 
+	// zero for all directions, and sample_wi() returns the brdf divided by 
+	// the cosine term, with p = 1.
+	///////////////////////////////////////////////////////////////////////////
+	class SpecularReflection : public BRDF
+	{
+	public: 
+		vec3 color;
+		SpecularReflection(vec3 c) : color(c) {}
+		virtual vec3 f(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
+		virtual vec3 sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) override;
+		virtual float pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// A perfectly smooth dielectric (glass). sample_wi() reflects or refracts
+	// with the probabilities given by the Fresnel equations, so, like for the
+	// mirror, f * cos / p is one.
+	///////////////////////////////////////////////////////////////////////////
+	class SpecularRefraction : public BRDF
+	{
+	public: 
+		float ior;
+		SpecularRefraction(float _ior = 1.5f) : ior(_ior) {}
+		virtual vec3 f(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
+		virtual vec3 sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) override;
+		virtual float pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
+	};
 }
\ No newline at end of file
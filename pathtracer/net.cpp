@@ -0,0 +1,192 @@
+#include "net.h"
+#include <iostream>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+using namespace std;
+
+namespace pathtracer
+{
+	// Refuse (corrupt) messages larger than this rather than allocating
+	// whatever the header says
+	const uint32_t max_message_size = 1u << 30;
+
+	struct MessageHeader {
+		uint32_t type;
+		uint32_t size;
+	};
+
+	static bool isUnixAddress(const string & address)
+	{
+		return address.compare(0, 5, "unix:") == 0;
+	}
+
+	static void configureSocket(int s, bool tcp)
+	{
+		int one = 1;
+#ifdef SO_NOSIGPIPE
+		setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+		if (tcp) setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Open a socket bound to, or connected to, an address
+	///////////////////////////////////////////////////////////////////////////
+	static int openSocket(const string & address, bool listen_on_it)
+	{
+		if (isUnixAddress(address)) {
+			const string path = address.substr(5);
+			sockaddr_un addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+				cout << "ERROR: Invalid socket path: " << path << "\n";
+				return -1;
+			}
+			strcpy(addr.sun_path, path.c_str());
+			int s = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (s < 0) return -1;
+			configureSocket(s, false);
+			if (listen_on_it) {
+				// A stale socket file from an earlier run would make bind fail
+				unlink(path.c_str());
+				if (bind(s, (sockaddr *)&addr, sizeof(addr)) == 0 && listen(s, 64) == 0) return s;
+			}
+			else if (connect(s, (sockaddr *)&addr, sizeof(addr)) == 0) {
+				return s;
+			}
+			close(s);
+			return -1;
+		}
+
+		const size_t colon = address.find_last_of(':');
+		if (colon == string::npos) {
+			cout << "ERROR: Expected an address of the form host:port or unix:path, got " << address << "\n";
+			return -1;
+		}
+		const string host = address.substr(0, colon), port = address.substr(colon + 1);
+		addrinfo hints, * addresses;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (listen_on_it) hints.ai_flags = AI_PASSIVE;
+		if (getaddrinfo(host.empty() || host == "*" ? nullptr : host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+			cout << "ERROR: Could not resolve " << address << "\n";
+			return -1;
+		}
+		int s = -1;
+		for (addrinfo * a = addresses; a != nullptr && s < 0; a = a->ai_next) {
+			s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+			if (s < 0) continue;
+			configureSocket(s, true);
+			bool ok;
+			if (listen_on_it) {
+				int one = 1;
+				setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+				ok = bind(s, a->ai_addr, a->ai_addrlen) == 0 && listen(s, 64) == 0;
+			}
+			else {
+				ok = connect(s, a->ai_addr, a->ai_addrlen) == 0;
+			}
+			if (!ok) {
+				close(s);
+				s = -1;
+			}
+		}
+		freeaddrinfo(addresses);
+		return s;
+	}
+
+	int listenOn(const string & address)
+	{
+		return openSocket(address, true);
+	}
+
+	int connectTo(const string & address)
+	{
+		return openSocket(address, false);
+	}
+
+	int acceptConnection(int listen_socket)
+	{
+		int s;
+		do { s = accept(listen_socket, nullptr, nullptr); } while (s < 0 && errno == EINTR);
+		if (s < 0) return -1;
+		sockaddr_storage addr;
+		socklen_t length = sizeof(addr);
+		getsockname(s, (sockaddr *)&addr, &length);
+		configureSocket(s, addr.ss_family != AF_UNIX);
+		return s;
+	}
+
+	void closeConnection(int s)
+	{
+		if (s >= 0) close(s);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Send and receive exactly size bytes
+	///////////////////////////////////////////////////////////////////////////
+	static bool sendAll(int s, const void * data, size_t size)
+	{
+		const uint8_t * p = (const uint8_t *)data;
+		while (size > 0) {
+			const ssize_t sent = send(s, p, size, MSG_NOSIGNAL);
+			if (sent < 0 && errno == EINTR) continue;
+			if (sent <= 0) return false;
+			p += sent;
+			size -= size_t(sent);
+		}
+		return true;
+	}
+
+	static bool receiveAll(int s, void * data, size_t size)
+	{
+		uint8_t * p = (uint8_t *)data;
+		while (size > 0) {
+			const ssize_t received = recv(s, p, size, 0);
+			if (received < 0 && errno == EINTR) continue;
+			if (received <= 0) return false;
+			p += received;
+			size -= size_t(received);
+		}
+		return true;
+	}
+
+	bool sendMessage(int s, uint32_t type, const void * data, size_t size)
+	{
+		return sendMessage(s, type, data, size, nullptr, 0);
+	}
+
+	bool sendMessage(int s, uint32_t type, const void * header, size_t header_size,
+		const void * body, size_t body_size)
+	{
+		if (header_size + body_size > max_message_size) return false;
+		const MessageHeader message = { type, uint32_t(header_size + body_size) };
+		return sendAll(s, &message, sizeof(message)) &&
+			sendAll(s, header, header_size) &&
+			sendAll(s, body, body_size);
+	}
+
+	bool receiveMessage(int s, uint32_t & type, vector<uint8_t> & payload)
+	{
+		MessageHeader message;
+		if (!receiveAll(s, &message, sizeof(message))) return false;
+		if (message.size > max_message_size) return false;
+		type = message.type;
+		payload.resize(message.size);
+		return message.size == 0 || receiveAll(s, payload.data(), message.size);
+	}
+}
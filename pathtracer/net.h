@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Minimal blocking message passing over stream sockets (POSIX only).
+	// Addresses are either "host:port" for TCP or "unix:/path/to/socket" for
+	// a Unix domain socket. Every message is a type and a payload size (both
+	// 32 bit, in host byte order, so all processes must run on the same kind
+	// of machine) followed by the payload. All functions return -1 or false
+	// on failure, and never raise SIGPIPE when the other side has gone away.
+	///////////////////////////////////////////////////////////////////////////
+	int listenOn(const std::string & address);
+	int connectTo(const std::string & address);
+	int acceptConnection(int listen_socket);
+	void closeConnection(int socket);
+
+	bool sendMessage(int socket, uint32_t type, const void * data, size_t size);
+	// Send a small header and a large body as one message, without copying
+	// them into one buffer first
+	bool sendMessage(int socket, uint32_t type, const void * header, size_t header_size,
+		const void * body, size_t body_size);
+	// Block until a whole message has arrived. Fails if the connection is
+	// closed, also in the middle of a message.
+	bool receiveMessage(int socket, uint32_t & type, std::vector<uint8_t> & payload);
+}
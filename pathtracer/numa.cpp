@@ -0,0 +1,149 @@
+#include "numa.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+using namespace std;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	NumaSettings numa_settings = { true, false };
+
+	///////////////////////////////////////////////////////////////////////////
+	// The node of each logical processor, read once
+	///////////////////////////////////////////////////////////////////////////
+	static once_flag topology_once;
+	static vector<int> processor_nodes;
+	static int nof_nodes = 1;
+
+#ifdef __linux__
+	// Parse a sysfs cpu list, e.g. "0-3,8-11"
+	static vector<int> parseCpuList(const string & list)
+	{
+		vector<int> cpus;
+		stringstream ss(list);
+		string range;
+		while (getline(ss, range, ',')) {
+			const size_t dash = range.find('-');
+			const int first = atoi(range.c_str());
+			const int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+			for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+		}
+		return cpus;
+	}
+#endif
+
+	static void readTopology()
+	{
+#ifdef __linux__
+		for (int node = 0; ; node++) {
+			ifstream file("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+			if (!file) break;
+			string list;
+			getline(file, list);
+			for (int cpu : parseCpuList(list)) {
+				if (cpu >= int(processor_nodes.size())) processor_nodes.resize(cpu + 1, 0);
+				processor_nodes[cpu] = node;
+			}
+			nof_nodes = node + 1;
+		}
+#elif defined(_WIN32)
+		ULONG highest_node = 0;
+		if (GetNumaHighestNodeNumber(&highest_node)) nof_nodes = int(highest_node) + 1;
+		for (int p = 0; p < int(sizeof(ULONG_PTR) * 8); p++) {
+			UCHAR node = 0;
+			processor_nodes.push_back(GetNumaProcessorNode(UCHAR(p), &node) && node != 0xFF ? int(node) : 0);
+		}
+#endif
+		nof_nodes = std::max(1, nof_nodes);
+	}
+
+	int numaNodeCount()
+	{
+		call_once(topology_once, readTopology);
+		return nof_nodes;
+	}
+
+	int numaNodeOfProcessor(int processor)
+	{
+		call_once(topology_once, readTopology);
+		return processor >= 0 && processor < int(processor_nodes.size()) ? processor_nodes[processor] : 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Statistics
+	///////////////////////////////////////////////////////////////////////////
+#ifdef __linux__
+	static uint64_t local_pages_at_reset = 0, remote_pages_at_reset = 0;
+
+	// Pages allocated on their intended node (local_node) and for threads
+	// running on other nodes (other_node), summed over all nodes
+	static void readNodeAllocations(uint64_t & local_pages, uint64_t & remote_pages)
+	{
+		local_pages = remote_pages = 0;
+		for (int node = 0; node < numaNodeCount(); node++) {
+			ifstream file("/sys/devices/system/node/node" + to_string(node) + "/numastat");
+			string name;
+			uint64_t value;
+			while (file >> name >> value) {
+				if (name == "local_node") local_pages += value;
+				else if (name == "other_node") remote_pages += value;
+			}
+		}
+	}
+#endif
+
+	NumaStatistics numaStatistics()
+	{
+		NumaStatistics statistics;
+#ifdef __linux__
+		ifstream maps("/proc/self/numa_maps");
+		if (!maps) return statistics;
+		statistics.available = true;
+		statistics.node_memory_mb.assign(numaNodeCount(), 0.0);
+		string line;
+		while (getline(maps, line)) {
+			// Fields like "N1=1234" (pages on node 1) and "kernelpagesize_kB=4"
+			stringstream ss(line);
+			string field;
+			map<int, double> pages;
+			double page_kb = 4.0;
+			while (ss >> field) {
+				if (field.size() > 2 && field[0] == 'N' && isdigit(field[1])) {
+					const size_t equals = field.find('=');
+					if (equals != string::npos) pages[atoi(field.c_str() + 1)] += atof(field.c_str() + equals + 1);
+				}
+				else if (field.compare(0, 18, "kernelpagesize_kB=") == 0) {
+					page_kb = atof(field.c_str() + 18);
+				}
+			}
+			for (auto & p : pages) {
+				if (p.first >= int(statistics.node_memory_mb.size())) statistics.node_memory_mb.resize(p.first + 1, 0.0);
+				statistics.node_memory_mb[p.first] += p.second * page_kb / 1024.0;
+			}
+		}
+		uint64_t local_pages, remote_pages;
+		readNodeAllocations(local_pages, remote_pages);
+		statistics.local_pages = local_pages - std::min(local_pages, local_pages_at_reset);
+		statistics.remote_pages = remote_pages - std::min(remote_pages, remote_pages_at_reset);
+#endif
+		return statistics;
+	}
+
+	void resetNumaStatistics()
+	{
+#ifdef __linux__
+		readNodeAllocations(local_pages_at_reset, remote_pages_at_reset);
+#endif
+	}
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <memory>
+#include <stdint.h>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// NUMA settings. Memory is placed on the node of the thread that first
+	// writes to it, so buffers that threads use for themselves are first
+	// touched by those threads (in parallel, with the same static schedule
+	// that later uses them).
+	///////////////////////////////////////////////////////////////////////////
+	extern struct NumaSettings {
+		// Clear the image in parallel, so each thread's rows are local
+		bool first_touch;
+		// Keep a copy of the Embree scene (vertices and BVH) per node,
+		// built by the threads of that node. The shading data of the
+		// models is not copied. Only used when threads are pinned (see
+		// threads.h) to more than one node. Must be set before the first
+		// model is added.
+		bool replicate_scene;
+	} numa_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// An allocator that default-initializes elements instead of
+	// value-initializing them, so that resizing a vector of (trivially
+	// constructible) pixels does not write to the memory
+	///////////////////////////////////////////////////////////////////////////
+	template <typename T>
+	struct UninitializedAllocator : std::allocator<T>
+	{
+		template <typename U> struct rebind { typedef UninitializedAllocator<U> other; };
+		UninitializedAllocator() {}
+		template <typename U> UninitializedAllocator(const UninitializedAllocator<U> &) {}
+		template <typename U> void construct(U * p) { ::new ((void *)p) U; }
+		template <typename U, typename... Args> void construct(U * p, Args &&... args) {
+			::new ((void *)p) U(std::forward<Args>(args)...);
+		}
+	};
+
+	typedef std::vector<glm::vec3, UninitializedAllocator<glm::vec3>> PixelBuffer;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Number of NUMA nodes, and the node of a logical processor (0 if the OS
+	// does not say)
+	///////////////////////////////////////////////////////////////////////////
+	int numaNodeCount();
+	int numaNodeOfProcessor(int processor);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Where the memory of the process is, and how many allocations were
+	// served from the local node, where the OS exposes it (Linux). The
+	// local/remote counts are system wide and counted since the last call
+	// to resetNumaStatistics().
+	///////////////////////////////////////////////////////////////////////////
+	struct NumaStatistics {
+		bool available = false;
+		// Resident memory of this process per node, in MB
+		std::vector<double> node_memory_mb;
+		// Pages allocated on the intended node, and on another one
+		uint64_t local_pages = 0, remote_pages = 0;
+	};
+	NumaStatistics numaStatistics();
+	void resetNumaStatistics();
+}
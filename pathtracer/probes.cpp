@@ -0,0 +1,114 @@
+#include "probes.h"
+#include "Pathtracer.h"
+#include "camera.h"
+#include "sequence.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	bool loadProbes(const string & filename, vector<vec3> & probes)
+	{
+		ifstream file(filename);
+		if (!file) {
+			cout << "ERROR: Could not open " << filename << "\n";
+			return false;
+		}
+		probes.clear();
+		string line;
+		int line_number = 0;
+		while (getline(file, line)) {
+			line_number++;
+			istringstream in(line);
+			string keyword;
+			if (!(in >> keyword) || keyword[0] == '#') continue;
+			bool ok;
+			if (keyword == "probe") {
+				vec3 p;
+				ok = bool(in >> p.x >> p.y >> p.z);
+				if (ok) probes.push_back(p);
+			}
+			else if (keyword == "grid") {
+				vec3 a, b;
+				ivec3 n;
+				ok = bool(in >> a.x >> a.y >> a.z >> b.x >> b.y >> b.z >> n.x >> n.y >> n.z) &&
+					n.x > 0 && n.y > 0 && n.z > 0;
+				for (int z = 0; ok && z < n.z; z++) {
+					for (int y = 0; y < n.y; y++) {
+						for (int x = 0; x < n.x; x++) {
+							// A single probe along an axis is in the middle
+							const vec3 t = (vec3(x, y, z) + vec3(equal(n, ivec3(1))) * 0.5f) / vec3(max(n - 1, ivec3(1)));
+							probes.push_back(mix(a, b, t));
+						}
+					}
+				}
+			}
+			else {
+				ok = false;
+			}
+			if (!ok) {
+				cout << "ERROR: " << filename << ":" << line_number << ": Could not parse \"" << line << "\"\n";
+				return false;
+			}
+		}
+		if (probes.empty()) {
+			cout << "ERROR: " << filename << " has no probes\n";
+			return false;
+		}
+		return true;
+	}
+
+	bool renderProbes(const vector<vec3> & probes, const ProbeJob & job)
+	{
+		if (job.projection != EQUIRECTANGULAR && job.projection != CUBEMAP) {
+			cout << "ERROR: Probes are rendered as equirectangular or cube map panoramas\n";
+			return false;
+		}
+		if (!isNumberedPattern(job.output)) {
+			cout << "ERROR: The output pattern " << job.output << " must have one %d for the probe number\n";
+			return false;
+		}
+		settings.subsampling = 1;
+		settings.max_paths_per_pixel = 0;
+		settings.path_guiding = false;
+		settings.use_radiance_cache = false;
+		settings.use_gbuffer = false;
+		settings.use_reprojection = false;
+		settings.use_crop = false;
+		settings.deterministic = true;
+		settings.projection = job.projection;
+		resize((job.projection == CUBEMAP ? 6 : 2) * job.size, job.size);
+
+		// Looking down -z with y up, the camera frame is the world frame
+		const vec3 camera_dir(0.0f, 0.0f, -1.0f), camera_up(0.0f, 1.0f, 0.0f);
+		typedef chrono::steady_clock Clock;
+		const auto start = Clock::now();
+		for (size_t i = 0; i < probes.size(); i++) {
+			const auto probe_start = Clock::now();
+			settings.seed = uint32_t(i);
+			restart();
+			for (int s = 0; s < job.samples; s++) {
+				tracePaths(probes[i], camera_dir, camera_up);
+			}
+			char filename[1024];
+			snprintf(filename, sizeof(filename), job.output.c_str(), int(i));
+			if (!saveImage(filename)) {
+				cout << "ERROR: Could not write " << filename << "\n";
+				return false;
+			}
+			printf("Probe %d at (%g, %g, %g): %.2f s\n", int(i), probes[i].x, probes[i].y, probes[i].z,
+				chrono::duration<double>(Clock::now() - probe_start).count());
+			fflush(stdout);
+		}
+		const double seconds = chrono::duration<double>(Clock::now() - start).count();
+		printf("Rendered %d probes in %.1f s\n", int(probes.size()), seconds);
+		fflush(stdout);
+		return true;
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Light probes: panoramas of the scene seen from a list of points, to
+	// bake reflection and irradiance maps like those in scenes/envmaps. A
+	// probe file has one probe, or a grid of probes, per line:
+	//   probe <px> <py> <pz>
+	//   grid <x0> <y0> <z0> <x1> <y1> <z1> <nx> <ny> <nz>
+	// A grid has nx * ny * nz probes evenly spaced from (x0, y0, z0) to
+	// (x1, y1, z1), x fastest. Lines starting with # are comments. Probes
+	// are numbered in the order of the file.
+	///////////////////////////////////////////////////////////////////////////
+	bool loadProbes(const std::string & filename, std::vector<vec3> & probes);
+
+	///////////////////////////////////////////////////////////////////////////
+	// How the probes are rendered. They look along the world axes (see
+	// Projection in camera.h), so equirectangular probes are laid out like
+	// the environment maps, and the faces of cube map probes are OpenGL
+	// cube map faces.
+	///////////////////////////////////////////////////////////////////////////
+	struct ProbeJob {
+		// EQUIRECTANGULAR or CUBEMAP
+		int projection;
+		// The height of the images, which are 2 (equirectangular) or 6 (cube
+		// map) times as wide
+		int size;
+		int samples;
+		// printf pattern of the .hdr files, given the probe number
+		std::string output;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Render the probes one after the other in this process, with the scene
+	// and its BVH as they are loaded and all threads on each probe. Probes
+	// are rendered deterministically, seeded by their number. Integrator and
+	// max_bounces are taken from settings. Fails if job.output is not a
+	// numbered pattern (see isNumberedPattern() in sequence.h).
+	///////////////////////////////////////////////////////////////////////////
+	bool renderProbes(const std::vector<vec3> & probes, const ProbeJob & job);
+}
@@ -0,0 +1,154 @@
+#include "profiling.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <iostream>
+#include <omp.h>
+
+using namespace std;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	ProfilingSettings profiling_settings = { false, "pathtracer_profile.csv" };
+
+	const char * profile_phase_names[NOF_PROFILE_PHASES] = {
+		"ray_generation", "intersect", "get_intersection", "brdf", "environment", "accumulation"
+	};
+	const char * profile_counter_names[NOF_PROFILE_COUNTERS] = {
+		"camera_samples", "rays", "shadow_rays", "path_vertices", "environment_lookups"
+	};
+
+	static PassProfile last_pass;
+	static vector<float> rays_per_second_history;
+	const size_t history_length = 120;
+
+	// The CSV file is opened on the first pass written to it, and again if
+	// the file name changes
+	static FILE * csv_file = nullptr;
+	static string csv_file_name;
+
+	bool profilingAvailable()
+	{
+#ifdef PATHTRACER_PROFILING
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	const PassProfile & lastPassProfile()
+	{
+		return last_pass;
+	}
+
+	const vector<float> & raysPerSecondHistory()
+	{
+		return rays_per_second_history;
+	}
+
+#ifdef PATHTRACER_PROFILING
+	///////////////////////////////////////////////////////////////////////////
+	// The storage of all threads that have recorded something. Threads are
+	// few and live as long as the program, so their storage is never freed.
+	///////////////////////////////////////////////////////////////////////////
+	static mutex thread_profiles_mutex;
+	static vector<ThreadProfile *> thread_profiles;
+	static chrono::steady_clock::time_point pass_start_time;
+	static uint64_t pass_start_ticks;
+
+	ThreadProfile * registerProfilingThread()
+	{
+		// Operator new does not have to respect the alignment in C++11
+		uint8_t * memory = new uint8_t[sizeof(ThreadProfile) + alignof(ThreadProfile)];
+		const size_t misalignment = size_t(memory) % alignof(ThreadProfile);
+		ThreadProfile * profile = (ThreadProfile *)(memory + (misalignment == 0 ? 0 : alignof(ThreadProfile) - misalignment));
+		memset(profile, 0, sizeof(ThreadProfile));
+		lock_guard<mutex> lock(thread_profiles_mutex);
+		thread_profiles.push_back(profile);
+		return profile;
+	}
+
+	static void writeCSV(const PassProfile & p)
+	{
+		if (csv_file != nullptr && csv_file_name != profiling_settings.csv_filename) {
+			fclose(csv_file);
+			csv_file = nullptr;
+		}
+		if (csv_file == nullptr) {
+			csv_file_name = profiling_settings.csv_filename;
+			csv_file = fopen(csv_file_name.c_str(), "w");
+			if (csv_file == nullptr) {
+				cout << "ERROR: Could not write " << csv_file_name << "\n";
+				profiling_settings.write_csv = false;
+				return;
+			}
+			fprintf(csv_file, "pass,threads,seconds,rays_per_second,average_path_length");
+			for (int i = 0; i < NOF_PROFILE_COUNTERS; i++) fprintf(csv_file, ",%s", profile_counter_names[i]);
+			for (int i = 0; i < NOF_PROFILE_PHASES; i++) fprintf(csv_file, ",%s_s", profile_phase_names[i]);
+			fprintf(csv_file, "\n");
+		}
+		fprintf(csv_file, "%d,%d,%g,%g,%g", p.pass, p.threads, p.seconds, p.rays_per_second, p.average_path_length);
+		for (int i = 0; i < NOF_PROFILE_COUNTERS; i++) fprintf(csv_file, ",%llu", (unsigned long long)p.counters[i]);
+		for (int i = 0; i < NOF_PROFILE_PHASES; i++) fprintf(csv_file, ",%g", p.phase_seconds[i]);
+		fprintf(csv_file, "\n");
+		fflush(csv_file);
+	}
+#endif
+
+	///////////////////////////////////////////////////////////////////////////
+	// Start a pass with cleared timers and counters
+	///////////////////////////////////////////////////////////////////////////
+	void beginProfiledPass()
+	{
+#ifdef PATHTRACER_PROFILING
+		{
+			lock_guard<mutex> lock(thread_profiles_mutex);
+			for (ThreadProfile * profile : thread_profiles) memset(profile, 0, sizeof(ThreadProfile));
+		}
+		pass_start_time = chrono::steady_clock::now();
+		pass_start_ticks = profileTicks();
+#endif
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Sum the threads' timers and counters. The tick rate is measured
+	// against the wall clock over the pass.
+	///////////////////////////////////////////////////////////////////////////
+	void endProfiledPass(int pass)
+	{
+#ifdef PATHTRACER_PROFILING
+		const double seconds = chrono::duration<double>(chrono::steady_clock::now() - pass_start_time).count();
+		const uint64_t ticks = profileTicks() - pass_start_ticks;
+		const double seconds_per_tick = ticks > 0 ? seconds / double(ticks) : 0.0;
+
+		PassProfile p;
+		p.pass = pass;
+		p.threads = omp_get_max_threads();
+		p.seconds = seconds;
+		{
+			lock_guard<mutex> lock(thread_profiles_mutex);
+			for (ThreadProfile * profile : thread_profiles) {
+				for (int i = 0; i < NOF_PROFILE_PHASES; i++) p.phase_seconds[i] += double(profile->ticks[i]) * seconds_per_tick;
+				for (int i = 0; i < NOF_PROFILE_COUNTERS; i++) p.counters[i] += profile->counters[i];
+			}
+		}
+		const uint64_t nof_rays = p.counters[PROFILE_RAYS] + p.counters[PROFILE_SHADOW_RAYS];
+		p.rays_per_second = seconds > 0.0 ? double(nof_rays) / seconds : 0.0;
+		p.average_path_length = p.counters[PROFILE_CAMERA_SAMPLES] > 0 ?
+			double(p.counters[PROFILE_PATH_VERTICES]) / double(p.counters[PROFILE_CAMERA_SAMPLES]) : 0.0;
+		last_pass = p;
+
+		if (rays_per_second_history.size() == history_length) {
+			rays_per_second_history.erase(rays_per_second_history.begin());
+		}
+		rays_per_second_history.push_back(float(p.rays_per_second));
+		if (profiling_settings.write_csv) writeCSV(p);
+#else
+		(void)pass;
+#endif
+	}
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+#ifdef PATHTRACER_PROFILING
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+#endif
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Per pass timers and counters of the hot paths. The timers read the
+	// time stamp counter and the counters are per thread, so taking them
+	// costs a few cycles and no synchronization. They are only compiled in
+	// when PATHTRACER_PROFILING is defined (the PATHTRACER_PROFILING cmake
+	// option); otherwise PROFILE_SCOPE and PROFILE_COUNT are empty.
+	///////////////////////////////////////////////////////////////////////////
+	enum ProfilePhase {
+		PROFILE_RAY_GENERATION,
+		// intersect() and occluded()
+		PROFILE_INTERSECT,
+		PROFILE_GET_INTERSECTION,
+		// Evaluating and sampling BRDFs (in the path tracing integrator)
+		PROFILE_BRDF,
+		PROFILE_ENVIRONMENT,
+		PROFILE_ACCUMULATION,
+		NOF_PROFILE_PHASES
+	};
+
+	enum ProfileCounter {
+		PROFILE_CAMERA_SAMPLES,
+		PROFILE_RAYS,
+		PROFILE_SHADOW_RAYS,
+		// Surface hits along camera paths (in the path tracing integrator)
+		PROFILE_PATH_VERTICES,
+		PROFILE_ENVIRONMENT_LOOKUPS,
+		NOF_PROFILE_COUNTERS
+	};
+
+	extern const char * profile_phase_names[NOF_PROFILE_PHASES];
+	extern const char * profile_counter_names[NOF_PROFILE_COUNTERS];
+
+	///////////////////////////////////////////////////////////////////////////
+	// The timers and counters of one pass (call to tracePaths), summed over
+	// all threads. Phase times are in thread seconds, so with n threads they
+	// add up to at most n times the length of the pass.
+	///////////////////////////////////////////////////////////////////////////
+	struct PassProfile {
+		int pass = 0;
+		int threads = 0;
+		double seconds = 0.0;
+		double phase_seconds[NOF_PROFILE_PHASES] = {};
+		uint64_t counters[NOF_PROFILE_COUNTERS] = {};
+		// Rays and shadow rays
+		double rays_per_second = 0.0;
+		// Path vertices per camera sample
+		double average_path_length = 0.0;
+	};
+
+	extern struct ProfilingSettings {
+		// Append one line per pass to csv_filename
+		bool write_csv;
+		std::string csv_filename;
+	} profiling_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// True if the timers and counters are compiled in
+	///////////////////////////////////////////////////////////////////////////
+	bool profilingAvailable();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Called by tracePaths() around each pass, outside of parallel regions
+	///////////////////////////////////////////////////////////////////////////
+	void beginProfiledPass();
+	void endProfiledPass(int pass);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The last pass, and the rays per second of the last passes (oldest
+	// first) for plotting
+	///////////////////////////////////////////////////////////////////////////
+	const PassProfile & lastPassProfile();
+	const std::vector<float> & raysPerSecondHistory();
+
+#ifdef PATHTRACER_PROFILING
+	///////////////////////////////////////////////////////////////////////////
+	// Per thread storage. Each thread gets its own cache line(s), allocated
+	// the first time it records something.
+	///////////////////////////////////////////////////////////////////////////
+	struct alignas(64) ThreadProfile {
+		uint64_t ticks[NOF_PROFILE_PHASES];
+		uint64_t counters[NOF_PROFILE_COUNTERS];
+	};
+
+	ThreadProfile * registerProfilingThread();
+
+	inline ThreadProfile & threadProfile() {
+		static thread_local ThreadProfile * profile = nullptr;
+		if (profile == nullptr) profile = registerProfilingThread();
+		return *profile;
+	}
+
+	inline uint64_t profileTicks() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+	}
+
+	struct ProfileScope {
+		ProfilePhase phase;
+		uint64_t start;
+		ProfileScope(ProfilePhase p) : phase(p), start(profileTicks()) {}
+		~ProfileScope() { threadProfile().ticks[phase] += profileTicks() - start; }
+	};
+
+#define PROFILE_SCOPE(phase) pathtracer::ProfileScope profile_scope_##phase(pathtracer::phase)
+#define PROFILE_COUNT(counter, n) (pathtracer::threadProfile().counters[pathtracer::counter] += (n))
+#else
+#define PROFILE_SCOPE(phase)
+#define PROFILE_COUNT(counter, n)
+#endif
+}
@@ -0,0 +1,274 @@
+#include "radiance_cache.h"
+#include "Pathtracer.h"
+#include "material.h"
+#include "sampling.h"
+#include "texture.h"
+#include <omp.h>
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	RadianceCacheSettings radiance_cache_settings;
+	RadianceCache radiance_cache;
+
+	const uint32_t nof_buckets = 1 << 16;
+
+	static float luminance(const vec3 & c) { return dot(c, vec3(0.2126f, 0.7152f, 0.0722f)); }
+
+	///////////////////////////////////////////////////////////////////////////
+	// Setup and hash grid
+	///////////////////////////////////////////////////////////////////////////
+	void RadianceCache::reset(const vec3 & bounds_min, const vec3 & bounds_max)
+	{
+		const float diagonal = length(bounds_max - bounds_min);
+		min_radius = radiance_cache_settings.min_radius * diagonal;
+		max_radius = radiance_cache_settings.max_radius * diagonal;
+		// A record is valid within error_threshold * radius of its position,
+		// so with this cell size it overlaps at most 2x2x2 cells.
+		cell_size = std::max(radiance_cache_settings.error_threshold * max_radius, EPSILON);
+		records.clear();
+		buckets.clear();
+		buckets.resize(nof_buckets);
+		pending.clear();
+		next_refinement = 0;
+	}
+
+	uint32_t RadianceCache::bucketIndex(const ivec3 & c) const
+	{
+		return ((uint32_t(c.x) * 73856093u) ^ (uint32_t(c.y) * 19349663u) ^ (uint32_t(c.z) * 83492791u)) & (nof_buckets - 1);
+	}
+
+	void RadianceCache::insert(uint32_t record_index)
+	{
+		const Record & record = records[record_index];
+		const float r = radiance_cache_settings.error_threshold * record.radius;
+		const ivec3 c0 = ivec3(floor((record.position - vec3(r)) / cell_size));
+		const ivec3 c1 = ivec3(floor((record.position + vec3(r)) / cell_size));
+		for (int z = c0.z; z <= c1.z; z++) for (int y = c0.y; y <= c1.y; y++) for (int x = c0.x; x <= c1.x; x++) {
+			vector<uint32_t> & bucket = buckets[bucketIndex(ivec3(x, y, z))];
+			// Neighbouring cells may share a bucket
+			if (std::find(bucket.begin(), bucket.end(), record_index) == bucket.end()) {
+				bucket.push_back(record_index);
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Interpolation (Ward et al. weights with gradients)
+	///////////////////////////////////////////////////////////////////////////
+	bool RadianceCache::lookup(const vec3 & p, const vec3 & n, vec3 & E) const
+	{
+		const vector<uint32_t> & bucket = buckets[bucketIndex(ivec3(floor(p / cell_size)))];
+		const float min_weight = 1.0f / radiance_cache_settings.error_threshold;
+		vec3 weighted_sum(0.0f);
+		float weight_sum = 0.0f;
+		for (uint32_t i : bucket) {
+			const Record & record = records[i];
+			const vec3 d = p - record.position;
+			// Records in front of p would see other surfaces than p does
+			if (dot(d, 0.5f * (n + record.normal)) < -0.05f * record.radius) continue;
+			const float error = length(d) / record.radius + sqrt(std::max(0.0f, 1.0f - dot(n, record.normal)));
+			if (error * min_weight >= 1.0f) continue;
+			const float w = 1.0f / std::max(error, 1e-4f);
+			const vec3 axis = cross(record.normal, n);
+			vec3 Ei;
+			for (int c = 0; c < 3; c++) {
+				Ei[c] = record.E[c] + dot(axis, record.rotational_gradient[c]) + dot(d, record.translational_gradient[c]);
+			}
+			weighted_sum += w * max(Ei, vec3(0.0f));
+			weight_sum += w;
+		}
+		if (weight_sum == 0.0f) return false;
+		E = weighted_sum / weight_sum;
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Sample the hemisphere above a record with stratified cosine weighted
+	// directions, and merge the result into the record. The gradients are
+	// estimated from the same samples (Ward and Heckbert 1992).
+	///////////////////////////////////////////////////////////////////////////
+	void RadianceCache::sampleHemisphere(Record & record) const
+	{
+		const int M = radiance_cache_settings.theta_strata;
+		const int N = radiance_cache_settings.phi_strata;
+		const vec3 & n = record.normal;
+		const vec3 tangent = normalize(perpendicular(n));
+		const vec3 bitangent = normalize(cross(tangent, n));
+		auto direction = [&](float phi) { return cos(phi) * tangent + sin(phi) * bitangent; };
+		const float infinity = numeric_limits<float>::infinity();
+
+		vector<vec3> L(M * N);
+		vector<float> r(M * N);
+		vec3 E(0.0f);
+		float inverse_distance_sum = 0.0f;
+		for (int j = 0; j < M; j++) {
+			for (int k = 0; k < N; k++) {
+				const float sin_theta = sqrt((float(j) + randf()) / float(M));
+				const float cos_theta = sqrt(std::max(0.0f, 1.0f - sin_theta * sin_theta));
+				const float phi = 2.0f * M_PI * (float(k) + randf()) / float(N);
+				const vec3 wi = normalize(sin_theta * direction(phi) + cos_theta * n);
+				Ray ray(record.position + EPSILON * n, wi);
+				if (intersect(ray)) {
+					L[j * N + k] = Li(ray);
+					r[j * N + k] = std::max(ray.tfar, EPSILON);
+					inverse_distance_sum += 1.0f / r[j * N + k];
+				}
+				else {
+					L[j * N + k] = Lenvironment(wi);
+					r[j * N + k] = infinity;
+				}
+				E += L[j * N + k];
+			}
+		}
+		E *= M_PI / float(M * N);
+
+		vec3 rotational[3] = { vec3(0.0f), vec3(0.0f), vec3(0.0f) };
+		vec3 translational[3] = { vec3(0.0f), vec3(0.0f), vec3(0.0f) };
+		for (int k = 0; k < N; k++) {
+			const float phi_minus = 2.0f * M_PI * float(k) / float(N);
+			const vec3 u_k = direction(phi_minus + M_PI / float(N));
+			const vec3 v_k = direction(phi_minus + M_PI / float(N) + 0.5f * M_PI);
+			const vec3 v_k_minus = direction(phi_minus + 0.5f * M_PI);
+			const int k_prev = (k + N - 1) % N;
+			for (int j = 0; j < M; j++) {
+				const float sin_minus = sqrt(float(j) / float(M));
+				const float cos_minus = sqrt(1.0f - sin_minus * sin_minus);
+				const float sin_plus = sqrt(float(j + 1) / float(M));
+				const float cos_plus = sqrt(std::max(0.0f, 1.0f - sin_plus * sin_plus));
+				const float sin_center = sqrt((float(j) + 0.5f) / float(M));
+				const float tan_center = sin_center / sqrt(1.0f - sin_center * sin_center);
+				const vec3 & Ljk = L[j * N + k];
+				// Change across the stratum boundary in theta
+				const vec3 dtheta = j > 0 ? (Ljk - L[(j - 1) * N + k]) *
+					(2.0f * M_PI / float(N)) * sin_minus * cos_minus * cos_minus /
+					std::min(r[j * N + k], r[(j - 1) * N + k]) : vec3(0.0f);
+				// Change across the stratum boundary in phi
+				const vec3 dphi = (Ljk - L[j * N + k_prev]) * (cos_minus - cos_plus) /
+					(sin_center * std::min(r[j * N + k], r[j * N + k_prev]));
+				for (int c = 0; c < 3; c++) {
+					translational[c] += u_k * dtheta[c] + v_k_minus * dphi[c];
+					rotational[c] += v_k * (-tan_center * Ljk[c] * M_PI / float(M * N));
+				}
+			}
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Merge with the sample sets the record already has
+		///////////////////////////////////////////////////////////////////////
+		const float n_old = float(record.sample_sets);
+		const float w_new = 1.0f / (n_old + 1.0f);
+		record.E = record.E * (1.0f - w_new) + E * w_new;
+		for (int c = 0; c < 3; c++) {
+			record.rotational_gradient[c] = record.rotational_gradient[c] * (1.0f - w_new) + rotational[c] * w_new;
+			record.translational_gradient[c] = record.translational_gradient[c] * (1.0f - w_new) + translational[c] * w_new;
+		}
+		const float inverse_harmonic = inverse_distance_sum / float(M * N);
+		const float old_inverse_harmonic = record.sample_sets > 0 ? 1.0f / record.harmonic_distance : 0.0f;
+		const float merged = old_inverse_harmonic * (1.0f - w_new) + inverse_harmonic * w_new;
+		record.harmonic_distance = merged > 0.0f ? 1.0f / merged : infinity;
+		record.sample_sets += 1;
+
+		///////////////////////////////////////////////////////////////////////
+		// The radius is the harmonic mean distance, but no larger than what
+		// the gradient allows (so that extrapolation can not go negative),
+		// and within the user limits.
+		///////////////////////////////////////////////////////////////////////
+		float radius = record.harmonic_distance;
+		const float gradient = length(vec3(0.2126f) * record.translational_gradient[0] +
+			vec3(0.7152f) * record.translational_gradient[1] + vec3(0.0722f) * record.translational_gradient[2]);
+		if (gradient > 0.0f) radius = std::min(radius, luminance(record.E) / gradient);
+		record.radius = std::min(std::max(radius, min_radius), max_radius);
+	}
+
+	void RadianceCache::beginPass()
+	{
+		// A parallel region started by this thread has at most this many
+		// threads. (The team size is per thread in OpenMP, so it can not be
+		// taken when the cache is reset.)
+		const size_t threads = size_t(omp_get_max_threads());
+		if (pending.size() < threads) pending.resize(threads);
+	}
+
+	vec3 RadianceCache::addRecord(const vec3 & p, const vec3 & n)
+	{
+		Record record;
+		record.position = p;
+		record.normal = n;
+		record.E = vec3(0.0f);
+		for (int c = 0; c < 3; c++) {
+			record.rotational_gradient[c] = vec3(0.0f);
+			record.translational_gradient[c] = vec3(0.0f);
+		}
+		record.harmonic_distance = 0.0f;
+		record.sample_sets = 0;
+		sampleHemisphere(record);
+		assert(size_t(omp_get_thread_num()) < pending.size());
+		pending[omp_get_thread_num()].push_back(record);
+		return record.E;
+	}
+
+	void RadianceCache::endPass()
+	{
+		if (!isInitialized()) return;
+		for (auto & p : pending) {
+			records.insert(records.end(), p.begin(), p.end());
+			p.clear();
+		}
+		if (records.empty()) return;
+
+		///////////////////////////////////////////////////////////////////////
+		// Refine records (round robin) with another set of samples. The grid
+		// is rebuilt afterwards since their radii may have changed.
+		///////////////////////////////////////////////////////////////////////
+		const int nof_refinements = int(std::min(size_t(radiance_cache_settings.refinements_per_pass), records.size()));
+		const size_t first = next_refinement % records.size();
+#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < nof_refinements; i++) {
+			Record & record = records[(first + i) % records.size()];
+			if (record.sample_sets < radiance_cache_settings.max_sample_sets) sampleHemisphere(record);
+		}
+		next_refinement = first + nof_refinements;
+		for (auto & b : buckets) b.clear();
+		for (uint32_t i = 0; i < uint32_t(records.size()); i++) insert(i);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Shading a primary hit with the cache
+	///////////////////////////////////////////////////////////////////////////
+	vec3 LiRadianceCache(Ray & primary_ray, const RayDifferential & differential, bool may_add_record)
+	{
+		Intersection hit = getIntersection(primary_ray);
+		RayDifferential hit_differential = differential;
+		transferDifferential(hit_differential, primary_ray, hit);
+		const vec3 n = dot(hit.shading_normal, hit.wo) < 0.0f ? -hit.shading_normal : hit.shading_normal;
+		vec3 E;
+		if (!radiance_cache.lookup(hit.position, n, E)) {
+			if (!may_add_record) return Li(primary_ray, &differential);
+			E = radiance_cache.addRecord(hit.position, n);
+		}
+		const vec3 color = baseColor(hit);
+		Diffuse diffuse(color);
+		vec3 L = hit.material->m_emission * color;
+		// Direct light is sampled every pass, so that shadows stay sharp
+		const float distance_to_light = length(point_light.position - hit.position);
+		const vec3 wi = normalize(point_light.position - hit.position);
+		Ray shadow_ray(hit.position + EPSILON * (dot(wi, hit.geometry_normal) > 0.0f ? 1.0f : -1.0f) * hit.geometry_normal,
+			wi, 0.0f, distance_to_light);
+		if (!occluded(shadow_ray)) {
+			const vec3 Li = point_light.intensity_multiplier * point_light.color / (distance_to_light * distance_to_light);
+			L += diffuse.f(wi, hit.wo, n) * Li * std::max(0.0f, dot(wi, n));
+		}
+		// Indirect diffuse light from the cached irradiance
+		L += color * (1.0f / M_PI) * E;
+		return L;
+	}
+}
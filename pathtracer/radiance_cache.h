@@ -0,0 +1,96 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <stdint.h>
+#include "embree.h"
+#include "raydifferential.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Radiance cache settings. The cache stores indirect irradiance records
+	// (with gradients) in world space, and is used to shade the diffuse part
+	// of primary hits while navigating interactively.
+	///////////////////////////////////////////////////////////////////////////
+	extern struct RadianceCacheSettings {
+		// Allowed interpolation error ('a' in Ward et al.). Larger values mean
+		// fewer records and blurrier indirect light.
+		float error_threshold = 0.3f;
+		// Hemisphere strata used for each set of samples of a record
+		int theta_strata = 4;
+		int phi_strata = 16;
+		// Records are refined with more sample sets until they have this many
+		int max_sample_sets = 16;
+		// Number of records that are refined after each pass
+		int refinements_per_pass = 2000;
+		// Record radius limits, relative to the scene bounding box diagonal
+		float min_radius = 0.002f;
+		float max_radius = 0.05f;
+		// New records are only created at every record_stride:th pixel (in
+		// both directions) of a pass, other pixels that are not covered by
+		// the cache are path traced.
+		int record_stride = 4;
+	} radiance_cache_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The cache. Records are kept in a hash grid over world space, so they
+	// stay valid when the camera moves. They are only discarded by clear(),
+	// which must be called when geometry, materials or lights change (the
+	// cache is then set up again on the next pass).
+	///////////////////////////////////////////////////////////////////////////
+	class RadianceCache
+	{
+	public:
+		struct Record {
+			vec3 position;
+			vec3 normal;
+			// Indirect irradiance
+			vec3 E;
+			// Rotational and translational gradients of E, per color channel
+			vec3 rotational_gradient[3];
+			vec3 translational_gradient[3];
+			// Harmonic mean distance to the surfaces seen from the record
+			float harmonic_distance;
+			// Radius of validity
+			float radius;
+			int sample_sets;
+		};
+		bool isInitialized() const { return !buckets.empty(); }
+		void clear() { records.clear(); buckets.clear(); pending.clear(); }
+		// Remove all records and set up the grid for the given scene bounds
+		void reset(const vec3 & bounds_min, const vec3 & bounds_max);
+		// Interpolate the irradiance at p with normal n (facing the viewer).
+		// Returns false if no record is valid at p.
+		bool lookup(const vec3 & p, const vec3 & n, vec3 & E) const;
+		// Make room for the new records of each thread of the team that
+		// will trace the pass. Called by the thread that starts the pass.
+		void beginPass();
+		// Compute a new record at p. It is not visible to lookup() until
+		// endPass() has been called. Thread safe within the pass.
+		vec3 addRecord(const vec3 & p, const vec3 & n);
+		// Insert the records created during the pass and refine old ones
+		void endPass();
+		size_t recordCount() const { return records.size(); }
+	private:
+		void insert(uint32_t record_index);
+		void sampleHemisphere(Record & record) const;
+		uint32_t bucketIndex(const ivec3 & cell) const;
+		std::vector<Record> records;
+		std::vector<std::vector<uint32_t>> buckets;
+		std::vector<std::vector<Record>> pending;
+		float cell_size = 1.0f;
+		float min_radius = 0.0f, max_radius = 1.0f;
+		size_t next_refinement = 0;
+	};
+
+	extern RadianceCache radiance_cache;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Shade a primary hit using the radiance cache for indirect diffuse
+	// light. If the cache does not cover the hit, a new record is created if
+	// may_add_record is true, and otherwise the pixel is path traced.
+	///////////////////////////////////////////////////////////////////////////
+	vec3 LiRadianceCache(Ray & primary_ray, const RayDifferential & differential, bool may_add_record);
+}
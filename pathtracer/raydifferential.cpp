@@ -0,0 +1,83 @@
+#include "raydifferential.h"
+#include "sampling.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	// Angular spread (in radians per pixel) of the differential after a
+	// diffuse bounce
+	const float diffuse_spread = 0.1f;
+
+	void transferDifferential(RayDifferential & rd, const Ray & ray, Intersection & hit)
+	{
+		///////////////////////////////////////////////////////////////////////
+		// Intersect the offset rays with the tangent plane at the hit point
+		///////////////////////////////////////////////////////////////////////
+		const vec3 & n = hit.geometry_normal;
+		const float d_dot_n = dot(ray.d, n);
+		if (abs(d_dot_n) < 1e-6f) {
+			rd = RayDifferential();
+			hit.duvdx = hit.duvdy = vec2(0.0f);
+			return;
+		}
+		const vec3 ox = rd.dodx + ray.tfar * rd.dddx;
+		const vec3 oy = rd.dody + ray.tfar * rd.dddy;
+		const vec3 dpdx = ox - (dot(ox, n) / d_dot_n) * ray.d;
+		const vec3 dpdy = oy - (dot(oy, n) / d_dot_n) * ray.d;
+		rd.dodx = dpdx;
+		rd.dody = dpdy;
+
+		///////////////////////////////////////////////////////////////////////
+		// Express dpdx and dpdy in the (u,v) parameterization of the
+		// triangle, in a least squares sense
+		///////////////////////////////////////////////////////////////////////
+		const float a = dot(hit.dpdu, hit.dpdu), b = dot(hit.dpdu, hit.dpdv), c = dot(hit.dpdv, hit.dpdv);
+		const float det = a * c - b * b;
+		if (abs(det) < 1e-12f) {
+			hit.duvdx = hit.duvdy = vec2(0.0f);
+			return;
+		}
+		const float inv_det = 1.0f / det;
+		const vec2 rx(dot(hit.dpdu, dpdx), dot(hit.dpdv, dpdx));
+		const vec2 ry(dot(hit.dpdu, dpdy), dot(hit.dpdv, dpdy));
+		hit.duvdx = inv_det * vec2(c * rx.x - b * rx.y, a * rx.y - b * rx.x);
+		hit.duvdy = inv_det * vec2(c * ry.x - b * ry.y, a * ry.y - b * ry.x);
+	}
+
+	void reflectDifferential(RayDifferential & rd, const Intersection & hit, const vec3 & wi)
+	{
+		const vec3 & n = hit.shading_normal;
+		rd.dddx = rd.dddx - 2.0f * dot(rd.dddx, n) * n;
+		rd.dddy = rd.dddy - 2.0f * dot(rd.dddy, n) * n;
+	}
+
+	void refractDifferential(RayDifferential & rd, const Intersection & hit, const vec3 & wi, float ior)
+	{
+		///////////////////////////////////////////////////////////////////////
+		// Differentiate t = eta * w + (eta * c1 - c2) * n, where w is the
+		// incident direction, n faces w, c1 = -dot(w, n), c2 = |dot(t, n)|
+		// and eta is the ratio of the indices of refraction.
+		///////////////////////////////////////////////////////////////////////
+		vec3 n = hit.shading_normal;
+		float eta = 1.0f / ior;
+		if (dot(hit.wo, n) < 0.0f) {
+			eta = ior;
+			n = -n;
+		}
+		const float c1 = dot(hit.wo, n);
+		const float c2 = abs(dot(wi, n));
+		if (c2 < 1e-6f) return;
+		const float k = eta - eta * eta * c1 / c2;
+		rd.dddx = eta * rd.dddx - (k * dot(rd.dddx, n)) * n;
+		rd.dddy = eta * rd.dddy - (k * dot(rd.dddy, n)) * n;
+	}
+
+	void diffuseDifferential(RayDifferential & rd, const Intersection & hit, const vec3 & wi)
+	{
+		const vec3 tangent = normalize(perpendicular(wi));
+		const vec3 bitangent = normalize(cross(wi, tangent));
+		rd.dddx = diffuse_spread * tangent;
+		rd.dddy = diffuse_spread * bitangent;
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <glm/glm.hpp>
+#include "embree.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// The change in origin and direction of a ray when moving one pixel in
+	// x or y on the screen (Igehy 1999). Kept next to the Ray rather than in
+	// it, since Ray must have the memory layout Embree expects.
+	///////////////////////////////////////////////////////////////////////////
+	struct RayDifferential
+	{
+		vec3 dodx = vec3(0.0f), dody = vec3(0.0f);
+		vec3 dddx = vec3(0.0f), dddy = vec3(0.0f);
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Move the differential to the surface that ray hit, and store the
+	// resulting texture coordinate footprint in hit.duvdx and hit.duvdy.
+	///////////////////////////////////////////////////////////////////////////
+	void transferDifferential(RayDifferential & differential, const Ray & ray, Intersection & hit);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Update the directions of a (transferred) differential for a bounce in
+	// direction wi. The surfaces are assumed to be locally flat (no normal
+	// derivatives).
+	///////////////////////////////////////////////////////////////////////////
+	void reflectDifferential(RayDifferential & differential, const Intersection & hit, const vec3 & wi);
+	void refractDifferential(RayDifferential & differential, const Intersection & hit, const vec3 & wi, float ior);
+	// Diffuse bounces have no well defined differential, so the footprint is
+	// simply widened by a fixed angle (as in Christensen et al. 2003)
+	void diffuseDifferential(RayDifferential & differential, const Intersection & hit, const vec3 & wi);
+}
@@ -0,0 +1,272 @@
+#include "render_thread.h"
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "gbuffer.h"
+#include "guiding.h"
+#include "radiance_cache.h"
+#include "reprojection.h"
+#include "sppm.h"
+#include "spsc_queue.h"
+#include "threads.h"
+#ifndef _WIN32
+#include "checkpoint.h"
+#endif
+
+using namespace std;
+
+namespace pathtracer
+{
+	InteractiveSettings interactive_settings = { 1.0f / 60.0f };
+
+	///////////////////////////////////////////////////////////////////////////
+	// Render thread state
+	///////////////////////////////////////////////////////////////////////////
+	static thread render_thread;
+	static atomic<bool> render_thread_running(false);
+	static SpscQueue<RenderCommand, 256> commands;
+	static vec3 camera_position, camera_direction, camera_up_vector;
+	static int window_width = 0, window_height = 0;
+	// Whether the last pass was reprojected. Camera moves then let the pass
+	// finish, since only complete passes become the history that the next
+	// view is warped from.
+	static atomic<bool> reprojecting(false);
+	// Exponential moving average of the pass time, negative until a pass
+	// has been timed with the current settings
+	static float pass_seconds = -1.0f;
+	const float pass_seconds_weight = 0.2f;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Published frames. The render thread fills frames[back], then swaps it
+	// with the middle frame, marking that as fresh. The UI thread swaps its
+	// front frame with the middle one when that is fresh. Neither side ever
+	// waits for the other.
+	///////////////////////////////////////////////////////////////////////////
+	static RenderedFrame frames[3];
+	const int fresh_frame = 4;
+	static atomic<int> middle_frame(1);
+	static int back_frame = 0, front_frame = 2;
+
+	RenderParameters currentRenderParameters()
+	{
+		RenderParameters p;
+		p.settings = settings;
+		p.bsdf_sampling_fraction = guiding_settings.bsdf_sampling_fraction;
+		p.photons_per_iteration = photon_mapping_settings.photons_per_iteration;
+		p.initial_radius = photon_mapping_settings.initial_radius;
+		p.first_touch = numa_settings.first_touch;
+#ifndef _WIN32
+		p.checkpoints_enabled = checkpoint_settings.enabled;
+		p.checkpoint_interval = checkpoint_settings.interval;
+#else
+		p.checkpoints_enabled = false;
+		p.checkpoint_interval = 0.0f;
+#endif
+		p.write_profile_csv = profiling_settings.write_csv;
+		p.frame_budget = interactive_settings.frame_budget;
+		return p;
+	}
+
+	MaterialParameters materialParameters(const labhelper::Material & material)
+	{
+		return { material.m_color, material.m_reflectivity, material.m_shininess, material.m_metalness,
+			material.m_fresnel, material.m_emission, material.m_transparency };
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Apply a command on the render thread
+	///////////////////////////////////////////////////////////////////////////
+	static void applyCommand(const RenderCommand & c)
+	{
+		switch (c.type) {
+		case RenderCommand::CAMERA:
+			camera_position = c.camera_pos;
+			camera_direction = c.camera_dir;
+			camera_up_vector = c.camera_up;
+			restart();
+			break;
+		case RenderCommand::RESIZE:
+			window_width = c.width;
+			window_height = c.height;
+			resize(window_width, window_height);
+			pass_seconds = -1.0f;
+			break;
+		case RenderCommand::PARAMETERS: {
+			const RenderParameters & p = c.parameters;
+			const bool new_size = p.settings.subsampling != settings.subsampling || p.first_touch != numa_settings.first_touch;
+			settings = p.settings;
+			guiding_settings.bsdf_sampling_fraction = p.bsdf_sampling_fraction;
+			photon_mapping_settings.photons_per_iteration = p.photons_per_iteration;
+			photon_mapping_settings.initial_radius = p.initial_radius;
+			numa_settings.first_touch = p.first_touch;
+#ifndef _WIN32
+			checkpoint_settings.enabled = p.checkpoints_enabled;
+			checkpoint_settings.interval = p.checkpoint_interval;
+#endif
+			profiling_settings.write_csv = p.write_profile_csv;
+			interactive_settings.frame_budget = p.frame_budget;
+			if (new_size) resize(window_width, window_height);
+			if (c.restart) {
+				restart();
+				pass_seconds = -1.0f;
+			}
+			break;
+		}
+		case RenderCommand::LIGHTS:
+			environment.multiplier = c.environment_multiplier;
+			point_light = c.point_light;
+			radiance_cache.clear();
+			if (c.restart) restart();
+			break;
+		case RenderCommand::MATERIAL: {
+			const MaterialParameters & m = c.material_parameters;
+			c.material->m_color = m.color;
+			c.material->m_reflectivity = m.reflectivity;
+			c.material->m_shininess = m.shininess;
+			c.material->m_metalness = m.metalness;
+			c.material->m_fresnel = m.fresnel;
+			c.material->m_emission = m.emission;
+			c.material->m_transparency = m.transparency;
+			// Cached indirect light is only valid for the materials it was
+			// computed with
+			radiance_cache.clear();
+			if (c.restart) restart();
+			break;
+		}
+		case RenderCommand::MESH_MATERIAL:
+			c.mesh->m_material_idx = c.material_index;
+			radiance_cache.clear();
+			if (c.restart) restart();
+			break;
+		case RenderCommand::CLEAR_RADIANCE_CACHE:
+			radiance_cache.clear();
+			if (c.restart) restart();
+			break;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Copy the image to the back frame and publish it
+	///////////////////////////////////////////////////////////////////////////
+	static void publishFrame(int passes)
+	{
+		RenderedFrame & f = frames[back_frame];
+		f.width = rendered_image.width;
+		f.height = rendered_image.height;
+		f.number_of_samples = rendered_image.number_of_samples;
+		f.pixels.assign(rendered_image.data.begin(), rendered_image.data.end());
+		f.guiding_iteration = sd_tree.currentIteration();
+		f.guiding_leaves = sd_tree.spatialLeafCount();
+		f.guiding_memory = sd_tree.memoryUsage();
+		f.radiance_cache_records = radiance_cache.recordCount();
+		f.gbuffer_samples = gbuffer.cachedSampleCount();
+		f.gbuffer_memory = gbuffer.memoryUsage();
+#ifndef _WIN32
+		f.checkpoint_samples = lastCheckpointSamples();
+#endif
+		f.profile = lastPassProfile();
+		f.rays_per_second_history = raysPerSecondHistory();
+		f.passes = passes;
+		f.pass_seconds = std::max(0.0f, pass_seconds);
+		back_frame = middle_frame.exchange(back_frame | fresh_frame) & ~fresh_frame;
+	}
+
+	const RenderedFrame * takeRenderedFrame()
+	{
+		if ((middle_frame.load(memory_order_relaxed) & fresh_frame) == 0) return nullptr;
+		front_frame = middle_frame.exchange(front_frame) & ~fresh_frame;
+		return &frames[front_frame];
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The render loop
+	///////////////////////////////////////////////////////////////////////////
+	static void renderLoop()
+	{
+		// The OpenMP team of this thread is not the one initializeThreads()
+		// set up
+		applyThreadSettings();
+		typedef chrono::steady_clock clock;
+		bool published = false;
+		int passes = 0;
+		clock::time_point frame_start = clock::now();
+		while (true) {
+			// Cleared before the commands are read, so that a command sent
+			// after this cancels the pass below
+			cancel_tracing.store(false);
+			RenderCommand command;
+			while (commands.pop(command)) {
+				applyCommand(command);
+				published = false;
+			}
+			if (!render_thread_running.load()) break;
+			const bool done = settings.max_paths_per_pixel != 0 &&
+				rendered_image.number_of_samples > settings.max_paths_per_pixel;
+			if (done) {
+				if (!published) publishFrame(passes);
+				published = true;
+				passes = 0;
+				this_thread::sleep_for(chrono::milliseconds(5));
+				continue;
+			}
+			if (passes == 0) frame_start = clock::now();
+			const clock::time_point pass_start = clock::now();
+			tracePaths(camera_position, camera_direction, camera_up_vector);
+			reprojecting.store(reprojection.isActive());
+			if (cancel_tracing.load()) {
+				// The image holds a partial pass
+				restart();
+				passes = 0;
+				continue;
+			}
+			const float seconds = chrono::duration<float>(clock::now() - pass_start).count();
+			pass_seconds = pass_seconds < 0.0f ? seconds : mix(pass_seconds, seconds, pass_seconds_weight);
+			passes += 1;
+			published = false;
+#ifndef _WIN32
+			updateCheckpoint(camera_position, camera_direction, camera_up_vector);
+#endif
+			// Publish unless another pass is expected to fit in the budget.
+			// The first pass after a restart is always shown at once.
+			const float elapsed = chrono::duration<float>(clock::now() - frame_start).count();
+			if (rendered_image.number_of_samples == 1 || elapsed + pass_seconds > interactive_settings.frame_budget) {
+				publishFrame(passes);
+				published = true;
+				passes = 0;
+			}
+		}
+	}
+
+	void startRenderThread(const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up)
+	{
+		camera_position = camera_pos;
+		camera_direction = camera_dir;
+		camera_up_vector = camera_up;
+		// The window size is only known from RESIZE commands, which are kept
+		// over restarts of the thread
+		if (window_width == 0) {
+			window_width = rendered_image.width * settings.subsampling;
+			window_height = rendered_image.height * settings.subsampling;
+		}
+		render_thread_running.store(true);
+		render_thread = thread(renderLoop);
+	}
+
+	void stopRenderThread()
+	{
+		if (!render_thread.joinable()) return;
+		// The pass is finished rather than cancelled, since a cancelled pass
+		// restarts the image
+		render_thread_running.store(false);
+		render_thread.join();
+	}
+
+	void sendRenderCommand(const RenderCommand & command)
+	{
+		while (!commands.push(command)) this_thread::yield();
+		const bool cancel = command.type == RenderCommand::CAMERA ? !reprojecting.load() :
+			command.type == RenderCommand::RESIZE || command.restart;
+		if (cancel) cancel_tracing.store(true);
+	}
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <Model.h>
+#include "Pathtracer.h"
+#include "profiling.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Interactive rendering on a thread of its own. The render thread owns
+	// all pathtracer state while it runs: the UI thread changes it only by
+	// sending commands (through a lock-free single producer, single consumer
+	// queue), which are applied between passes, and it reads the results
+	// only from the frames the render thread publishes. Commands that
+	// change the view or restart the image cancel the pass being traced.
+	///////////////////////////////////////////////////////////////////////////
+
+	///////////////////////////////////////////////////////////////////////////
+	// Interactive rendering settings
+	///////////////////////////////////////////////////////////////////////////
+	extern struct InteractiveSettings {
+		// Seconds of tracing per published frame. As many passes as fit are
+		// traced (predicted from the time of the recent passes), and only
+		// the last is published. 0 publishes every pass.
+		float frame_budget;
+	} interactive_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The parameters the UI can change
+	///////////////////////////////////////////////////////////////////////////
+	struct RenderParameters {
+		Settings settings;
+		float bsdf_sampling_fraction;
+		int photons_per_iteration;
+		float initial_radius;
+		bool first_touch;
+		bool checkpoints_enabled;
+		float checkpoint_interval;
+		bool write_profile_csv;
+		float frame_budget;
+	};
+
+	struct MaterialParameters {
+		vec3 color;
+		float reflectivity, shininess, metalness, fresnel, emission, transparency;
+	};
+
+	struct RenderCommand {
+		enum Type {
+			// Move the camera (cancels the pass, unless it is reprojected,
+			// and restarts)
+			CAMERA,
+			// The window was resized (cancels the pass and restarts)
+			RESIZE,
+			// New parameters, restarting if restart is set
+			PARAMETERS,
+			// New light and environment multiplier, restarting if restart
+			// is set
+			LIGHTS,
+			// New parameters for *material, restarting if restart is set
+			MATERIAL,
+			// Use material index for *mesh, restarting if restart is set
+			MESH_MATERIAL,
+			CLEAR_RADIANCE_CACHE
+		} type;
+		bool restart;
+		vec3 camera_pos, camera_dir, camera_up;
+		int width, height;
+		RenderParameters parameters;
+		float environment_multiplier;
+		PointLight point_light;
+		labhelper::Material * material;
+		MaterialParameters material_parameters;
+		labhelper::Mesh * mesh;
+		uint32_t material_index;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// A published image, with the statistics the UI shows
+	///////////////////////////////////////////////////////////////////////////
+	struct RenderedFrame {
+		int width = 0, height = 0, number_of_samples = 0;
+		std::vector<vec3> pixels;
+		int guiding_iteration = 0;
+		size_t guiding_leaves = 0, guiding_memory = 0;
+		size_t radiance_cache_records = 0;
+		int gbuffer_samples = 0;
+		size_t gbuffer_memory = 0;
+		int checkpoint_samples = 0;
+		PassProfile profile;
+		std::vector<float> rays_per_second_history;
+		// Passes traced for this frame, and the average time of a pass
+		int passes = 0;
+		float pass_seconds = 0.0f;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// The current parameters and material parameters (only call when the
+	// render thread is not running)
+	///////////////////////////////////////////////////////////////////////////
+	RenderParameters currentRenderParameters();
+	MaterialParameters materialParameters(const labhelper::Material & material);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Start tracing from the given camera. The scene must be loaded and the
+	// image sized.
+	///////////////////////////////////////////////////////////////////////////
+	void startRenderThread(const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Stop the render thread once the current pass is finished. All
+	// commands sent before are applied.
+	///////////////////////////////////////////////////////////////////////////
+	void stopRenderThread();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Send a command to the render thread (from the UI thread only)
+	///////////////////////////////////////////////////////////////////////////
+	void sendRenderCommand(const RenderCommand & command);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The newest frame, if one has been published since the last call
+	// (else nullptr). It stays valid until the next call.
+	///////////////////////////////////////////////////////////////////////////
+	const RenderedFrame * takeRenderedFrame();
+}
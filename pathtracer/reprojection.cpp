@@ -0,0 +1,136 @@
+#include "reprojection.h"
+#include "Pathtracer.h"
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	ReprojectionSettings reprojection_settings;
+	Reprojection reprojection;
+
+	bool Reprojection::beginPass(const Camera & camera)
+	{
+		const int w = rendered_image.width, h = rendered_image.height;
+		if (!active || w != width || h != height) {
+			// Start from the image as it is
+			const size_t n = size_t(w) * h;
+			width = w;
+			height = h;
+			weights.assign(n, float(rendered_image.number_of_samples));
+			positions.assign(n, vec3(0.0f));
+			normals.assign(n, vec3(0.0f));
+			history_weights.assign(n, 0.0f);
+			history_positions.assign(n, vec3(0.0f));
+			history_normals.assign(n, vec3(0.0f));
+			PixelBuffer(n, vec3(0.0f)).swap(history_image);
+			current_camera = camera;
+			current_complete = false;
+			history_valid = false;
+			active = true;
+			return false;
+		}
+		const bool moved = camera.position != current_camera.position ||
+			camera.direction != current_camera.direction || camera.up != current_camera.up ||
+			camera.projection != current_camera.projection;
+		if (moved) {
+			// The history is the last complete pass. If the pass in the last
+			// view was cancelled, the history is still from the view before.
+			if (current_complete) {
+				rendered_image.data.swap(history_image);
+				weights.swap(history_weights);
+				positions.swap(history_positions);
+				normals.swap(history_normals);
+				history_camera = current_camera;
+				history_valid = true;
+			}
+			current_camera = camera;
+			current_complete = false;
+			if (history_valid) return true;
+			std::fill(weights.begin(), weights.end(), 0.0f);
+			return false;
+		}
+		if (rendered_image.number_of_samples == 0) {
+			// Restarted in the same view, so the scene has changed and the
+			// history is stale too
+			std::fill(weights.begin(), weights.end(), 0.0f);
+			history_valid = false;
+		}
+		current_complete = false;
+		return false;
+	}
+
+	float Reprojection::history(const vec3 & position, bool hit, const vec3 & normal, vec3 & color) const
+	{
+		color = vec3(0.0f);
+		vec2 screen_coord;
+		const vec3 p = hit ? position : history_camera.position + position;
+		if (!history_camera.project(p, screen_coord)) return 0.0f;
+		// Bilinear interpolation of the history pixels that saw the same
+		// surface
+		const float fx = screen_coord.x * width - 0.5f, fy = screen_coord.y * height - 0.5f;
+		const int x0 = int(floor(fx)), y0 = int(floor(fy));
+		const float tx = fx - float(x0), ty = fy - float(y0);
+		const float tolerance = reprojection_settings.depth_tolerance * length(position - history_camera.position);
+		float footprint = 0.0f, samples = 0.0f;
+		for (int j = 0; j < 2; j++) {
+			for (int i = 0; i < 2; i++) {
+				const int x = x0 + i, y = y0 + j;
+				if (x < 0 || x >= width || y < 0 || y >= height) continue;
+				const int q = y * width + x;
+				if (history_weights[q] <= 0.0f) continue;
+				if (hit) {
+					// Misses have a zero normal, and fail this test too
+					if (dot(history_normals[q], normal) < reprojection_settings.normal_tolerance) continue;
+					if (length(history_positions[q] - position) > tolerance) continue;
+				}
+				else if (history_normals[q] != vec3(0.0f)) {
+					continue;
+				}
+				const float b = (i == 1 ? tx : 1.0f - tx) * (j == 1 ? ty : 1.0f - ty);
+				color += b * history_image[q];
+				samples += b * history_weights[q];
+				footprint += b;
+			}
+		}
+		if (footprint <= 0.0f) return 0.0f;
+		color /= footprint;
+		// The confidence in the history is the clamped number of samples,
+		// scaled by how much of the footprint was valid
+		return std::min(samples / footprint, reprojection_settings.max_history_samples) * footprint;
+	}
+
+	void Reprojection::accumulate(int pixel, const vec3 & color, bool hit, const vec3 & position, const vec3 & normal, bool reproject)
+	{
+		vec3 & c = rendered_image.data[pixel];
+		float n = weights[pixel];
+		if (reproject) n = history(position, hit, normal, c);
+		c = c * (n / (n + 1.0f)) + (1.0f / (n + 1.0f)) * color;
+		weights[pixel] = n + 1.0f;
+		positions[pixel] = position;
+		normals[pixel] = hit ? normal : vec3(0.0f);
+	}
+
+	void Reprojection::clear()
+	{
+		vector<float>().swap(weights);
+		vector<float>().swap(history_weights);
+		vector<vec3>().swap(positions);
+		vector<vec3>().swap(normals);
+		vector<vec3>().swap(history_positions);
+		vector<vec3>().swap(history_normals);
+		PixelBuffer().swap(history_image);
+		width = height = 0;
+		active = false;
+	}
+
+	size_t Reprojection::memoryUsage() const
+	{
+		return (weights.size() + history_weights.size()) * sizeof(float) +
+			(positions.size() + normals.size() + history_positions.size() + history_normals.size() + history_image.size()) * sizeof(vec3);
+	}
+}
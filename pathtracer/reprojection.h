@@ -0,0 +1,67 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "camera.h"
+#include "numa.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Reprojection settings. When the camera moves, the accumulated image is
+	// warped into the new view instead of being discarded: the first hit of
+	// each new camera ray is projected into the previous view, and the
+	// previous pixels there are reused if they saw the same surface.
+	///////////////////////////////////////////////////////////////////////////
+	extern struct ReprojectionSettings {
+		// A previous pixel is rejected (as disoccluded) if its first hit is
+		// further than this from the new one, relative to the distance to
+		// the camera...
+		float depth_tolerance = 0.02f;
+		// ...or if the cosine between their geometry normals is below this
+		float normal_tolerance = 0.9f;
+		// Reprojected history counts as at most this many samples, so that
+		// new samples soon replace what the warp has blurred
+		float max_history_samples = 16.0f;
+	} reprojection_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// With reprojection, the image keeps a number of samples per pixel, and
+	// the first hit (position and geometry normal) of the last sample of
+	// each pixel. The image, samples and first hits of the last complete
+	// pass in the previous view are kept as history.
+	///////////////////////////////////////////////////////////////////////////
+	class Reprojection
+	{
+	public:
+		// Call at the start of each pass, after the image is sized. The
+		// samples start from rendered_image.number_of_samples if the image
+		// was not accumulated with reprojection, and from zero after a
+		// restart that did not move the camera. Returns true if the camera
+		// has moved since the last complete pass, so that this pass warps
+		// the history into the new view.
+		bool beginPass(const Camera & camera);
+		// Add a sample to a pixel. For misses, hit is false and position is
+		// the direction of the camera ray.
+		void accumulate(int pixel, const vec3 & color, bool hit, const vec3 & position, const vec3 & normal, bool reproject);
+		// Call after a pass that was not cancelled
+		void endPass() { current_complete = true; }
+		void clear();
+		bool isActive() const { return active; }
+		size_t memoryUsage() const;
+	private:
+		// Look up the history at the first hit of a new camera ray
+		float history(const vec3 & position, bool hit, const vec3 & normal, vec3 & color) const;
+		bool active = false;
+		int width = 0, height = 0;
+		Camera current_camera, history_camera;
+		bool current_complete = false, history_valid = false;
+		std::vector<float> weights, history_weights;
+		// First hits. Normals are zero for misses.
+		std::vector<vec3> positions, normals, history_positions, history_normals;
+		PixelBuffer history_image;
+	};
+
+	extern Reprojection reprojection;
+}
@@ -1,5 +1,7 @@
 #include "sampling.h"
 #include <random>
+#include <atomic>
+#include <new>
 #include "labhelper.h"
 #include <omp.h>
 #include <iostream>
@@ -11,12 +13,59 @@ namespace pathtracer
 {
 	///////////////////////////////////////////////////////////////////////////////
 	// Get a random float. Note that we need one "generator" per thread, or we 
-	// would need to lock everytime someone called randf(). 
+	// would need to lock everytime someone called randf(). Between 
+	// beginSampleStream() and endSampleStream() a thread instead draws from a
+	// stream (SplitMix64) whose state only depends on the sample being taken.
 	///////////////////////////////////////////////////////////////////////////////
-	std::mt19937 generators[24]; // Assuming no more than 24 cores
+	// Kept trivially constructible (the generator is created in place the
+	// first time it is used), which makes thread_local access cheaper
+	struct ThreadRandom {
+		alignas(std::mt19937) unsigned char generator_storage[sizeof(std::mt19937)];
+		// The generator is (re)seeded when this lags behind seed_generation.
+		// 0 means that it has not been created yet.
+		uint32_t generation;
+		bool in_sample_stream;
+		uint64_t stream_state;
+		std::mt19937 & generator() { return *reinterpret_cast<std::mt19937 *>(generator_storage); }
+	};
+	static thread_local ThreadRandom thread_random;
+	static std::atomic<uint32_t> seed_generation(1);
+	static uint32_t current_seed = 0;
+
+	static uint64_t mix64(uint64_t z) {
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
 	float randf() {
-		return float(generators[omp_get_thread_num()]() /
-			double(generators[omp_get_thread_num()].max()));
+		ThreadRandom & r = thread_random;
+		if (r.in_sample_stream) {
+			r.stream_state += 0x9E3779B97F4A7C15ull;
+			return float(uint32_t(mix64(r.stream_state) >> 32) / double(0xFFFFFFFFu));
+		}
+		const uint32_t generation = seed_generation.load(std::memory_order_acquire);
+		if (r.generation != generation) {
+			if (r.generation == 0) new (r.generator_storage) std::mt19937();
+			std::seed_seq sequence{ current_seed, uint32_t(omp_get_thread_num()) };
+			r.generator().seed(sequence);
+			r.generation = generation;
+		}
+		return float(r.generator()() / double(std::mt19937::max()));
+	}
+
+	void seedRandom(uint32_t seed) {
+		current_seed = seed;
+		seed_generation.fetch_add(1, std::memory_order_release);
+	}
+
+	void beginSampleStream(uint32_t seed, uint32_t stream, uint32_t index) {
+		thread_random.in_sample_stream = true;
+		thread_random.stream_state = mix64((uint64_t(seed) << 32 | stream) ^ mix64(uint64_t(index) + 0x632BE59BD9B4E019ull));
+	}
+
+	void endSampleStream() {
+		thread_random.in_sample_stream = false;
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -72,6 +121,16 @@ namespace pathtracer
 		return ret;
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Generate uniformly distributed directions
+	///////////////////////////////////////////////////////////////////////////
+	glm::vec3 uniformSampleSphere() {
+		float z = 1.0f - 2.0f * randf();
+		float r = sqrt(max(0.0f, 1.0f - z * z));
+		float phi = 2.0f * M_PI * randf();
+		return glm::vec3(r * cosf(phi), r * sinf(phi), z);
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Generate a vector that is perpendicular to another
 	///////////////////////////////////////////////////////////////////////////
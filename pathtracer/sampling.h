@@ -1,5 +1,6 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <stdint.h>
 
 namespace pathtracer
 {
@@ -7,6 +8,14 @@ namespace pathtracer
 	// Random number generation
 	///////////////////////////////////////////////////////////////////////////
 	float randf();
+	// Reseed the generators of all threads. The same seed (and number of
+	// threads) gives the same sequence of numbers on every thread.
+	void seedRandom(uint32_t seed);
+	// Make randf() on the calling thread return numbers that only depend on
+	// (seed, stream, index), e.g. (seed, pixel, sample), no matter which
+	// thread takes the sample, until endSampleStream() is called.
+	void beginSampleStream(uint32_t seed, uint32_t stream, uint32_t index);
+	void endSampleStream();
 	///////////////////////////////////////////////////////////////////////////
 	// Generate uniform points on a disc
 	///////////////////////////////////////////////////////////////////////////
@@ -16,6 +25,10 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	glm::vec3 cosineSampleHemisphere();
 	///////////////////////////////////////////////////////////////////////////
+	// Generate uniformly distributed directions
+	///////////////////////////////////////////////////////////////////////////
+	glm::vec3 uniformSampleSphere();
+	///////////////////////////////////////////////////////////////////////////
 	// Generate a vector that is perpendicular to another
 	///////////////////////////////////////////////////////////////////////////
 	glm::vec3 perpendicular(const glm::vec3 &v);
@@ -0,0 +1,217 @@
+#include "sequence.h"
+#include "Pathtracer.h"
+#include "embree.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <glm/gtx/transform.hpp>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// The two keys around a frame and the interpolation weight between them
+	///////////////////////////////////////////////////////////////////////////
+	template <typename Key>
+	static void findKeys(const vector<Key> & keys, float frame, const Key *& a, const Key *& b, float & t)
+	{
+		size_t i = 0;
+		while (i + 1 < keys.size() && keys[i + 1].frame <= frame) i++;
+		a = &keys[i];
+		b = &keys[std::min(i + 1, keys.size() - 1)];
+		t = b->frame > a->frame ? clamp((frame - a->frame) / (b->frame - a->frame), 0.0f, 1.0f) : 0.0f;
+	}
+
+	void Sequence::cameraAt(int frame, vec3 & position, vec3 & direction) const
+	{
+		const CameraKey * a, * b;
+		float t;
+		findKeys(camera, float(frame), a, b, t);
+		position = mix(a->position, b->position, t);
+		direction = normalize(mix(a->target, b->target, t) - position);
+	}
+
+	mat4 Sequence::modelMatrixAt(int model, int frame) const
+	{
+		const TransformKey * a, * b;
+		float t;
+		findKeys(transforms.at(model), float(frame), a, b, t);
+		const vec3 r = radians(mix(a->rotation, b->rotation, t));
+		return translate(mix(a->translation, b->translation, t)) *
+			rotate(r.y, vec3(0.0f, 1.0f, 0.0f)) * rotate(r.x, vec3(1.0f, 0.0f, 0.0f)) * rotate(r.z, vec3(0.0f, 0.0f, 1.0f));
+	}
+
+	bool loadSequence(const string & filename, Sequence & sequence)
+	{
+		ifstream file(filename);
+		if (!file) {
+			cout << "ERROR: Could not open " << filename << "\n";
+			return false;
+		}
+		sequence = Sequence();
+		string line;
+		int line_number = 0;
+		while (getline(file, line)) {
+			line_number++;
+			istringstream in(line);
+			string keyword;
+			if (!(in >> keyword) || keyword[0] == '#') continue;
+			bool ok;
+			if (keyword == "frames") {
+				ok = bool(in >> sequence.frames) && sequence.frames > 0;
+			}
+			else if (keyword == "camera") {
+				CameraKey key;
+				ok = bool(in >> key.frame >> key.position.x >> key.position.y >> key.position.z
+					>> key.target.x >> key.target.y >> key.target.z);
+				if (ok) sequence.camera.push_back(key);
+			}
+			else if (keyword == "model") {
+				int model;
+				TransformKey key;
+				ok = bool(in >> model >> key.frame >> key.translation.x >> key.translation.y >> key.translation.z
+					>> key.rotation.x >> key.rotation.y >> key.rotation.z) && model >= 0;
+				if (ok) sequence.transforms[model].push_back(key);
+			}
+			else {
+				ok = false;
+			}
+			if (!ok) {
+				cout << "ERROR: " << filename << ":" << line_number << ": Could not parse \"" << line << "\"\n";
+				return false;
+			}
+		}
+		if (sequence.frames <= 0) {
+			cout << "ERROR: " << filename << " does not give the number of frames\n";
+			return false;
+		}
+		auto by_frame = [](const CameraKey & a, const CameraKey & b) { return a.frame < b.frame; };
+		stable_sort(sequence.camera.begin(), sequence.camera.end(), by_frame);
+		for (auto & t : sequence.transforms) {
+			stable_sort(t.second.begin(), t.second.end(),
+				[](const TransformKey & a, const TransformKey & b) { return a.frame < b.frame; });
+		}
+		return true;
+	}
+
+	bool isNumberedPattern(const string & pattern)
+	{
+		int conversions = 0;
+		for (size_t i = 0; i < pattern.size(); i++) {
+			if (pattern[i] != '%') continue;
+			if (++i < pattern.size() && pattern[i] == '%') continue;
+			while (i < pattern.size() && strchr("-+ #0", pattern[i]) != nullptr) i++;
+			while (i < pattern.size() && isdigit((unsigned char)pattern[i])) i++;
+			if (i < pattern.size() && pattern[i] == '.') {
+				i++;
+				while (i < pattern.size() && isdigit((unsigned char)pattern[i])) i++;
+			}
+			if (i == pattern.size() || (pattern[i] != 'd' && pattern[i] != 'i')) return false;
+			conversions++;
+		}
+		return conversions == 1;
+	}
+
+	bool renderSequence(const Sequence & sequence, const vector<const labhelper::Model *> & models,
+		const SequenceJob & job, int first_frame, int frame_step)
+	{
+		if (!isNumberedPattern(job.output)) {
+			cout << "ERROR: The output pattern " << job.output << " must have one %d for the frame number\n";
+			return false;
+		}
+		for (auto & t : sequence.transforms) {
+			if (t.first >= int(models.size())) {
+				cout << "ERROR: The sequence animates model " << t.first << ", but there are only " << models.size() << "\n";
+				return false;
+			}
+		}
+		settings.subsampling = 1;
+		settings.max_paths_per_pixel = 0;
+		settings.path_guiding = false;
+		settings.use_radiance_cache = false;
+		settings.use_gbuffer = false;
+		settings.use_reprojection = false;
+		settings.use_crop = false;
+		settings.deterministic = true;
+		resize(job.width, job.height);
+
+		typedef chrono::steady_clock Clock;
+		const auto start = Clock::now();
+		int rendered = 0;
+		for (int frame = first_frame; frame < sequence.frames; frame += frame_step) {
+			const auto frame_start = Clock::now();
+			// Only the animated models are moved, the BVHs of the others are
+			// reused as they are
+			if (!sequence.transforms.empty()) {
+				for (auto & t : sequence.transforms) {
+					setModelTransform(models[t.first], sequence.modelMatrixAt(t.first, frame));
+				}
+				buildBVH();
+			}
+			const auto bvh_end = Clock::now();
+			vec3 camera_pos, camera_dir;
+			sequence.cameraAt(frame, camera_pos, camera_dir);
+			const vec3 camera_up = normalize(cross(normalize(cross(camera_dir, vec3(0.0f, 1.0f, 0.0f))), camera_dir));
+			settings.seed = uint32_t(frame);
+			restart();
+			for (int s = 0; s < job.samples; s++) {
+				tracePaths(camera_pos, camera_dir, camera_up);
+			}
+			char filename[1024];
+			snprintf(filename, sizeof(filename), job.output.c_str(), frame);
+			if (!saveImage(filename)) {
+				cout << "ERROR: Could not write " << filename << "\n";
+				return false;
+			}
+			rendered++;
+			const auto frame_end = Clock::now();
+			printf("Frame %d: %.2f s (BVH update %.1f ms)\n", frame,
+				chrono::duration<double>(frame_end - frame_start).count(),
+				chrono::duration<double, milli>(bvh_end - frame_start).count());
+			fflush(stdout);
+		}
+		const double seconds = chrono::duration<double>(Clock::now() - start).count();
+		printf("Rendered %d frames in %.1f s (%.0f frames per hour)\n", rendered, seconds,
+			seconds > 0.0 ? rendered * 3600.0 / seconds : 0.0);
+		fflush(stdout);
+		return true;
+	}
+
+	int concurrentFrames(const SequenceJob & job, int threads)
+	{
+		// Rows are split statically between the threads, so with fewer rows
+		// per thread than this, the threads that get the cheap rows idle
+		const int min_rows_per_thread = 16;
+		return clamp(threads * min_rows_per_thread / std::max(job.height, 1), 1, std::max(threads, 1));
+	}
+
+	bool runSequenceProcesses(const vector<string> & commands, int frames)
+	{
+		const auto start = chrono::steady_clock::now();
+		// The processes write their progress to our output
+		vector<int> results(commands.size(), -1);
+		vector<thread> processes;
+		for (size_t i = 0; i < commands.size(); i++) {
+			processes.emplace_back([&commands, &results, i]() { results[i] = system(commands[i].c_str()); });
+		}
+		for (auto & p : processes) p.join();
+		const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		bool ok = true;
+		for (int result : results) ok = ok && result == 0;
+		if (!ok) {
+			cout << "ERROR: Some frames were not rendered\n";
+			return false;
+		}
+		printf("Rendered %d frames in %.1f s with %d concurrent frames (%.0f frames per hour)\n", frames, seconds,
+			int(commands.size()), seconds > 0.0 ? frames * 3600.0 / seconds : 0.0);
+		return true;
+	}
+}
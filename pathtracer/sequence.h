@@ -0,0 +1,90 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <map>
+#include <string>
+#include <vector>
+#include <Model.h>
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// An animation: a keyframed camera and keyframed model transforms. Values
+	// are interpolated linearly between keys, and held before the first and
+	// after the last key. A sequence file has one key per line:
+	//   frames <N>
+	//   camera <frame> <px> <py> <pz> <tx> <ty> <tz>
+	//   model <index> <frame> <tx> <ty> <tz> <rx> <ry> <rz>
+	// The camera is at p looking at t. A model is rotated by the Euler
+	// angles r (in degrees, applied z, x then y) and translated by t, which
+	// replaces the transform it was loaded with. Lines starting with # are
+	// comments. A turntable of the first model over 120 frames is
+	//   frames 120
+	//   model 0 0   0 10 0  0 0 0
+	//   model 0 120 0 10 0  0 360 0
+	///////////////////////////////////////////////////////////////////////////
+	struct CameraKey {
+		float frame;
+		vec3 position, target;
+	};
+	struct TransformKey {
+		float frame;
+		vec3 translation, rotation;
+	};
+	struct Sequence {
+		int frames = 0;
+		// Sorted by frame
+		std::vector<CameraKey> camera;
+		// By model index
+		std::map<int, std::vector<TransformKey>> transforms;
+
+		bool isAnimated(int model) const { return transforms.count(model) != 0; }
+		void cameraAt(int frame, vec3 & position, vec3 & direction) const;
+		mat4 modelMatrixAt(int model, int frame) const;
+	};
+	bool loadSequence(const std::string & filename, Sequence & sequence);
+
+	///////////////////////////////////////////////////////////////////////////
+	// How the frames of a sequence are rendered
+	///////////////////////////////////////////////////////////////////////////
+	struct SequenceJob {
+		int width, height;
+		int samples;
+		// printf pattern of the .hdr files, given the frame number
+		std::string output;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Whether a printf pattern of numbered files takes exactly one int: it
+	// must have one %d or %i conversion (with flags, width and precision,
+	// like %04d) and no others besides %%
+	///////////////////////////////////////////////////////////////////////////
+	bool isNumberedPattern(const std::string & pattern);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Render the frames first_frame, first_frame + frame_step, ... of a
+	// sequence in this process. The scene must be loaded with the animated
+	// models of the sequence added as animated, in a dynamic scene; models[i]
+	// is model i of the sequence. Frames are rendered deterministically,
+	// seeded by their number, so they do not depend on how the sequence is
+	// split. Integrator and max_bounces are taken from settings. Fails if
+	// job.output is not a numbered pattern.
+	///////////////////////////////////////////////////////////////////////////
+	bool renderSequence(const Sequence & sequence, const std::vector<const labhelper::Model *> & models,
+		const SequenceJob & job, int first_frame, int frame_step);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Number of frames to render at once with this many threads. A frame
+	// only keeps all threads busy if it has enough rows for each of them,
+	// so small frames are rendered several at a time.
+	///////////////////////////////////////////////////////////////////////////
+	int concurrentFrames(const SequenceJob & job, int threads);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Run the commands concurrently, each rendering a share of the frames
+	// (see renderSequence()), and report the frames per hour of the whole
+	// sequence when they are all done
+	///////////////////////////////////////////////////////////////////////////
+	bool runSequenceProcesses(const std::vector<std::string> & commands, int frames);
+}
@@ -0,0 +1,343 @@
+#include "server.h"
+#include <iostream>
+#include <cstring>
+#include <map>
+#include <queue>
+#include <set>
+#include <chrono>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "camera.h"
+#include "texture.h"
+#include "net.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	const uint32_t server_magic = 0x50545331; // "PTS1"
+	const uint32_t server_version = 1;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The seed of one sample of the image (as for distributed rendering)
+	///////////////////////////////////////////////////////////////////////////
+	static uint32_t sampleSeed(uint32_t seed, uint32_t sample)
+	{
+		return seed ^ (sample * 0x9E3779B9u);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Trace the camera rays through the pixel centers, and write the AOVs of
+	// their first hits
+	///////////////////////////////////////////////////////////////////////////
+	static void traceAOVs(const SubmitMessage & job, vector<vec3> & normal, vector<vec3> & depth, vector<vec3> & albedo)
+	{
+		// The camera of tracePaths()
+		const Camera camera(job.camera_pos, job.camera_dir, job.camera_up, 45.0f, float(job.width) / float(job.height));
+		const size_t nof_pixels = size_t(job.width) * size_t(job.height);
+		normal.assign(nof_pixels, vec3(0.0f));
+		depth.assign(nof_pixels, vec3(0.0f));
+		albedo.assign(nof_pixels, vec3(0.0f));
+#pragma omp parallel for schedule(static)
+		for (int y = 0; y < job.height; y++) {
+			for (int x = 0; x < job.width; x++) {
+				const vec2 screen_coord((float(x) + 0.5f) / float(job.width), (float(y) + 0.5f) / float(job.height));
+				Ray ray(job.camera_pos, camera.rayDirection(screen_coord));
+				if (!intersect(ray)) continue;
+				Intersection hit = getIntersection(ray);
+				const size_t pixel = size_t(y) * job.width + x;
+				normal[pixel] = hit.shading_normal;
+				depth[pixel] = vec3(ray.tfar);
+				albedo[pixel] = baseColor(hit);
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Server
+	///////////////////////////////////////////////////////////////////////////
+	struct QueuedJob {
+		uint32_t id;
+		// Clients are numbered, as sockets are reused
+		uint64_t client;
+		SubmitMessage job;
+	};
+
+	struct ClientConnection {
+		uint64_t id;
+		bool said_hello = false;
+	};
+
+	bool runServer(const string & address)
+	{
+		const int listen_socket = listenOn(address);
+		if (listen_socket < 0) {
+			cout << "ERROR: Could not listen on " << address << "\n";
+			return false;
+		}
+		cout << "Server: waiting for jobs on " << address << "\n";
+
+		map<int, ClientConnection> clients;
+		uint64_t next_client = 1;
+		uint32_t next_job = 1;
+		// Highest priority first, then the oldest (lowest id) first
+		auto runs_later = [](const QueuedJob & a, const QueuedJob & b) {
+			return a.job.priority != b.job.priority ? a.job.priority < b.job.priority : a.id > b.id;
+		};
+		priority_queue<QueuedJob, vector<QueuedJob>, decltype(runs_later)> queue(runs_later);
+		// Queued jobs that were cancelled (by client and job id) are skipped
+		// when they come up
+		set<pair<uint64_t, uint32_t>> cancelled;
+
+		// The running job
+		bool running = false;
+		QueuedJob current;
+		int current_socket = -1;
+		auto last_progress = chrono::steady_clock::now();
+
+		auto clientSocket = [&](uint64_t client) -> int {
+			for (auto & c : clients) {
+				if (c.second.id == client) return c.first;
+			}
+			return -1;
+		};
+		auto sendStatus = [&](int s, uint32_t job_id, JobStatus status) {
+			const StatusMessage message = { job_id, status };
+			return s >= 0 && sendMessage(s, SERVER_STATUS, &message, sizeof(message));
+		};
+		auto sendImage = [&](int s, uint32_t aov, int samples, bool final, const vec3 * pixels) {
+			const ImageMessage header = { current.id, aov, current.job.width, current.job.height, samples, final ? 1 : 0 };
+			return s >= 0 && sendMessage(s, SERVER_IMAGE, &header, sizeof(header), pixels,
+				size_t(current.job.width) * current.job.height * sizeof(vec3));
+		};
+		auto dropClient = [&](int s, const char * reason) {
+			cout << "Server: lost client " << s << " (" << reason << ")\n";
+			// Its queued jobs are skipped, as the client is gone
+			if (running && current_socket == s) {
+				running = false;
+				cout << "Server: job " << current.id << " cancelled\n";
+			}
+			closeConnection(s);
+			clients.erase(s);
+		};
+
+		vector<uint8_t> payload;
+		vector<vec3> normal, depth, albedo;
+		bool shutdown = false;
+		while (!shutdown) {
+			///////////////////////////////////////////////////////////////////
+			// Messages are handled between passes, so a running job only
+			// polls
+			///////////////////////////////////////////////////////////////////
+			vector<pollfd> fds;
+			fds.push_back({ listen_socket, POLLIN, 0 });
+			for (auto & client : clients) fds.push_back({ client.first, POLLIN, 0 });
+			const bool busy = running || !queue.empty();
+			if (poll(fds.data(), fds.size(), busy ? 0 : 1000) < 0 && errno != EINTR) {
+				cout << "ERROR: poll() failed\n";
+				break;
+			}
+			if (fds[0].revents & POLLIN) {
+				const int s = acceptConnection(listen_socket);
+				if (s >= 0) {
+					clients[s].id = next_client++;
+					cout << "Server: client " << s << " connected\n";
+				}
+			}
+			for (size_t i = 1; i < fds.size(); i++) {
+				if (fds[i].revents == 0) continue;
+				const int s = fds[i].fd;
+				uint32_t type;
+				if (!receiveMessage(s, type, payload)) {
+					dropClient(s, "connection closed");
+					continue;
+				}
+				ClientConnection & client = clients[s];
+				if (type == SERVER_HELLO) {
+					ServerHelloMessage hello = { 0, 0 };
+					if (payload.size() == sizeof(hello)) memcpy(&hello, payload.data(), sizeof(hello));
+					if (hello.magic != server_magic || hello.version != server_version) {
+						dropClient(s, "incompatible client");
+						continue;
+					}
+					hello = { server_magic, server_version };
+					if (!sendMessage(s, SERVER_HELLO, &hello, sizeof(hello))) {
+						dropClient(s, "send failed");
+						continue;
+					}
+					client.said_hello = true;
+				}
+				else if (type == SERVER_SUBMIT && client.said_hello && payload.size() == sizeof(SubmitMessage)) {
+					QueuedJob queued;
+					memcpy(&queued.job, payload.data(), sizeof(SubmitMessage));
+					const SubmitMessage & job = queued.job;
+					const bool valid = job.width > 0 && job.height > 0 && job.samples > 0 &&
+						job.integrator >= PATH_TRACING && job.integrator <= PHOTON_MAPPING && job.max_bounces >= 0;
+					queued.id = valid ? next_job++ : 0;
+					queued.client = client.id;
+					if (valid) {
+						queue.push(queued);
+						cout << "Server: job " << queued.id << " queued (" << job.width << "x" << job.height << ", " <<
+							job.samples << " samples, priority " << job.priority << ")\n";
+					}
+					if (!sendStatus(s, queued.id, valid ? JOB_QUEUED : JOB_REJECTED)) dropClient(s, "send failed");
+				}
+				else if (type == SERVER_CANCEL && client.said_hello && payload.size() == sizeof(CancelMessage)) {
+					CancelMessage cancel;
+					memcpy(&cancel, payload.data(), sizeof(cancel));
+					if (running && current.id == cancel.job_id && current.client == client.id) {
+						running = false;
+						cout << "Server: job " << current.id << " cancelled\n";
+						if (!sendStatus(s, current.id, JOB_CANCELLED)) dropClient(s, "send failed");
+					}
+					else {
+						// Reported when the job comes up
+						cancelled.insert(make_pair(client.id, cancel.job_id));
+					}
+				}
+				else if (type == SERVER_SHUTDOWN && client.said_hello) {
+					shutdown = true;
+				}
+				else {
+					dropClient(s, "unexpected message");
+				}
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Start the next job, on the scene that is already loaded
+			///////////////////////////////////////////////////////////////////
+			while (!running && !shutdown && !queue.empty()) {
+				current = queue.top();
+				queue.pop();
+				current_socket = clientSocket(current.client);
+				if (current_socket < 0) continue;
+				if (cancelled.erase(make_pair(current.client, current.id)) != 0) {
+					if (!sendStatus(current_socket, current.id, JOB_CANCELLED)) dropClient(current_socket, "send failed");
+					continue;
+				}
+				const SubmitMessage & job = current.job;
+				settings.subsampling = 1;
+				settings.max_bounces = job.max_bounces;
+				settings.max_paths_per_pixel = 0;
+				settings.integrator = job.integrator;
+				settings.path_guiding = false;
+				settings.deterministic = true;
+				settings.use_radiance_cache = false;
+				settings.use_gbuffer = false;
+				settings.use_reprojection = false;
+				settings.use_crop = false;
+				resize(job.width, job.height);
+				restart();
+				cout << "Server: job " << current.id << " started\n";
+				running = true;
+				last_progress = chrono::steady_clock::now();
+				if (job.aovs != 0) {
+					traceAOVs(job, normal, depth, albedo);
+					const pair<uint32_t, const vector<vec3> *> aovs[] = {
+						{ AOV_NORMAL, &normal }, { AOV_DEPTH, &depth }, { AOV_ALBEDO, &albedo } };
+					for (auto & aov : aovs) {
+						if ((job.aovs & (1u << aov.first)) == 0) continue;
+						if (!sendImage(current_socket, aov.first, 1, false, aov.second->data())) {
+							dropClient(current_socket, "send failed");
+							break;
+						}
+					}
+				}
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// One pass of the running job
+			///////////////////////////////////////////////////////////////////
+			if (!running || shutdown) continue;
+			settings.seed = sampleSeed(current.job.seed, uint32_t(rendered_image.number_of_samples));
+			tracePaths(current.job.camera_pos, current.job.camera_dir, current.job.camera_up);
+			const bool finished = rendered_image.number_of_samples >= current.job.samples;
+			const auto now = chrono::steady_clock::now();
+			const bool progress = current.job.progress_interval > 0.0f &&
+				chrono::duration<float>(now - last_progress).count() >= current.job.progress_interval;
+			if (finished || progress) {
+				last_progress = now;
+				if (!sendImage(current_socket, AOV_COLOR, rendered_image.number_of_samples, finished, rendered_image.data.data()) ||
+					(finished && !sendStatus(current_socket, current.id, JOB_FINISHED))) {
+					dropClient(current_socket, "send failed");
+					continue;
+				}
+			}
+			if (finished) {
+				cout << "Server: job " << current.id << " finished\n";
+				running = false;
+			}
+		}
+
+		cout << "Server: shutting down\n";
+		if (running) sendStatus(current_socket, current.id, JOB_CANCELLED);
+		for (auto & client : clients) closeConnection(client.first);
+		closeConnection(listen_socket);
+		if (address.compare(0, 5, "unix:") == 0) unlink(address.substr(5).c_str());
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Client
+	///////////////////////////////////////////////////////////////////////////
+	bool submitJob(const string & address, const SubmitMessage & job, const string & output_filename)
+	{
+		const int s = connectTo(address);
+		if (s < 0) {
+			cout << "ERROR: Could not connect to " << address << "\n";
+			return false;
+		}
+		ServerHelloMessage hello = { server_magic, server_version };
+		vector<uint8_t> payload;
+		uint32_t type;
+		if (!sendMessage(s, SERVER_HELLO, &hello, sizeof(hello)) || !receiveMessage(s, type, payload) ||
+			type != SERVER_HELLO || payload.size() != sizeof(hello)) {
+			cout << "ERROR: " << address << " is not a compatible render server\n";
+			closeConnection(s);
+			return false;
+		}
+		if (!sendMessage(s, SERVER_SUBMIT, &job, sizeof(job))) {
+			closeConnection(s);
+			return false;
+		}
+		const char * aov_names[] = { "", ".normal", ".depth", ".albedo" };
+		string base = output_filename;
+		if (base.size() > 4 && base.compare(base.size() - 4, 4, ".hdr") == 0) base.resize(base.size() - 4);
+		bool ok = false;
+		while (receiveMessage(s, type, payload)) {
+			if (type == SERVER_STATUS && payload.size() == sizeof(StatusMessage)) {
+				StatusMessage status;
+				memcpy(&status, payload.data(), sizeof(status));
+				if (status.status == JOB_QUEUED) {
+					cout << "Job " << status.job_id << " queued\n";
+					continue;
+				}
+				ok = status.status == JOB_FINISHED;
+				cout << "Job " << (ok ? "finished" : (status.status == JOB_REJECTED ? "rejected" : "cancelled")) << "\n";
+				break;
+			}
+			ImageMessage image;
+			if (type != SERVER_IMAGE || payload.size() < sizeof(image)) break;
+			memcpy(&image, payload.data(), sizeof(image));
+			const size_t nof_pixels = size_t(image.width) * size_t(image.height);
+			if (image.aov > AOV_ALBEDO || payload.size() != sizeof(image) + nof_pixels * sizeof(vec3)) break;
+			rendered_image.width = image.width;
+			rendered_image.height = image.height;
+			rendered_image.data.resize(nof_pixels);
+			memcpy(rendered_image.data.data(), payload.data() + sizeof(image), nof_pixels * sizeof(vec3));
+			rendered_image.number_of_samples = image.samples;
+			const string filename = base + aov_names[image.aov] + ".hdr";
+			if (!saveImage(filename)) {
+				cout << "ERROR: Could not write " << filename << "\n";
+				break;
+			}
+			if (image.aov == AOV_COLOR) cout << image.samples << "/" << job.samples << " samples\n";
+		}
+		closeConnection(s);
+		return ok;
+	}
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <stdint.h>
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Render server protocol, over the framed messages of net.h. A client
+	// says HELLO (the server answers with its own), then SUBMITs jobs, each
+	// answered right away with a STATUS that gives the job its id (or
+	// rejects it). Jobs are queued by priority, and jobs of the same
+	// priority in the order they were submitted. The running job sends an
+	// IMAGE of its color every progress_interval seconds and when it is
+	// done, followed by a STATUS. The requested AOVs are sent once, when the
+	// job starts. A client may CANCEL its jobs, and its jobs are cancelled if
+	// it disconnects. SHUTDOWN stops the server.
+	///////////////////////////////////////////////////////////////////////////
+	enum ServerMessageType : uint32_t {
+		SERVER_HELLO = 1,
+		SERVER_SUBMIT = 2,
+		SERVER_CANCEL = 3,
+		SERVER_SHUTDOWN = 4,
+		SERVER_STATUS = 5,
+		SERVER_IMAGE = 6
+	};
+
+	struct ServerHelloMessage {
+		uint32_t magic, version;
+	};
+
+	struct SubmitMessage {
+		// Higher runs first
+		int32_t priority;
+		int32_t width, height;
+		int32_t samples;
+		vec3 camera_pos, camera_dir, camera_up;
+		int32_t integrator;
+		int32_t max_bounces;
+		// Samples are seeded as in distributed rendering, so the result
+		// does not depend on the server
+		uint32_t seed;
+		// Bit mask of (1 << AOV) for the AOVs to send besides the color
+		uint32_t aovs;
+		// Seconds between progressive results (0 for only the final one)
+		float progress_interval;
+	};
+
+	struct CancelMessage {
+		uint32_t job_id;
+	};
+
+	enum JobStatus : int32_t {
+		JOB_QUEUED = 0,
+		JOB_REJECTED = 1,
+		JOB_FINISHED = 2,
+		JOB_CANCELLED = 3
+	};
+
+	struct StatusMessage {
+		// 0 for a rejected job
+		uint32_t job_id;
+		int32_t status;
+	};
+
+	// Images hold the pixels of the job, as RGB floats, row by row from the
+	// bottom
+	enum AOV : uint32_t {
+		AOV_COLOR = 0,
+		// Shading normal of the first hit in world space, zero for misses
+		AOV_NORMAL = 1,
+		// Distance to the first hit in all channels, zero for misses
+		AOV_DEPTH = 2,
+		// Base color of the first hit, zero for misses
+		AOV_ALBEDO = 3
+	};
+
+	struct ImageMessage {
+		uint32_t job_id;
+		uint32_t aov;
+		int32_t width, height;
+		// Samples per pixel so far (1 for the AOVs, which are traced through
+		// pixel centers)
+		int32_t samples;
+		// Whether this is the last image of the job
+		int32_t final;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Serve jobs on address (host:port or unix:/path/to/socket) until a
+	// client asks for a SHUTDOWN. The scene must already be loaded, and
+	// stays loaded (and its BVH built) for all jobs.
+	///////////////////////////////////////////////////////////////////////////
+	bool runServer(const std::string & address);
+
+	///////////////////////////////////////////////////////////////////////////
+	// A client: submit a job to a server and write its color to
+	// output_filename (as .hdr) every time an image arrives. The AOVs are
+	// written next to it, as <output>.normal.hdr and so on.
+	///////////////////////////////////////////////////////////////////////////
+	bool submitJob(const std::string & address, const SubmitMessage & job, const std::string & output_filename);
+}
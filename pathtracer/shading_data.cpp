@@ -0,0 +1,53 @@
+#include "shading_data.h"
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	CompactShadingData::CompactShadingData(const labhelper::Model * model)
+	{
+		const size_t nof_vertices = model->m_normals.size();
+		packed_normals.resize(nof_vertices);
+		for (size_t i = 0; i < nof_vertices; i++) {
+			packed_normals[i] = encodeNormal(model->m_normals[i]);
+		}
+		packed_texture_coordinates.assign(nof_vertices, packHalf2x16(vec2(0.0f)));
+		for (size_t i = 0; i < model->m_texture_coordinates.size() && i < nof_vertices; i++) {
+			packed_texture_coordinates[i] = packHalf2x16(model->m_texture_coordinates[i]);
+		}
+	}
+
+	size_t CompactShadingData::memoryUsage() const
+	{
+		return packed_normals.size() * sizeof(uint32_t) + packed_texture_coordinates.size() * sizeof(uint32_t);
+	}
+
+	size_t CompactShadingData::modelMemoryUsage(const labhelper::Model * model)
+	{
+		return model->m_normals.size() * sizeof(vec3) + model->m_texture_coordinates.size() * sizeof(vec2);
+	}
+
+	void CompactShadingData::precision(const labhelper::Model * model, float & max_normal_error_degrees, float & max_uv_error) const
+	{
+		float max_distance = 0.0f;
+		max_normal_error_degrees = 0.0f;
+		max_uv_error = 0.0f;
+		for (size_t i = 0; i < packed_normals.size(); i++) {
+			const vec3 n = model->m_normals[i];
+			if (n == vec3(0.0f)) continue;
+			// acos() loses the small angles we are after, so measure the
+			// distance between the unit vectors (twice the sine of half the
+			// angle)
+			const float d = length(normalize(n) - decodeNormal(packed_normals[i]));
+			max_distance = std::max(max_distance, d);
+			if (i < model->m_texture_coordinates.size()) {
+				const vec2 uv = model->m_texture_coordinates[i];
+				const vec2 error = abs(unpackHalf2x16(packed_texture_coordinates[i]) - uv) / max(abs(uv), vec2(1.0f));
+				max_uv_error = std::max(max_uv_error, std::max(error.x, error.y));
+			}
+		}
+		max_normal_error_degrees = degrees(2.0f * asin(std::min(max_distance * 0.5f, 1.0f)));
+	}
+}
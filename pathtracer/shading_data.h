@@ -0,0 +1,86 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+#include <vector>
+#include <stdint.h>
+#include <Model.h>
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Octahedral encoding of unit vectors in 32 bits: the vector is projected
+	// onto the octahedron |x| + |y| + |z| = 1, whose lower half is folded
+	// over the upper half, and the resulting square is stored as two 16 bit
+	// snorms. The error is below 0.01 degrees.
+	///////////////////////////////////////////////////////////////////////////
+	inline vec2 octahedralWrap(const vec2 & v)
+	{
+		return (1.0f - abs(vec2(v.y, v.x))) * vec2(v.x >= 0.0f ? 1.0f : -1.0f, v.y >= 0.0f ? 1.0f : -1.0f);
+	}
+
+	inline uint32_t encodeNormal(const vec3 & n)
+	{
+		const float l1 = abs(n.x) + abs(n.y) + abs(n.z);
+		if (l1 == 0.0f) return packSnorm2x16(vec2(0.0f));
+		vec2 p = vec2(n.x, n.y) / l1;
+		if (n.z < 0.0f) p = octahedralWrap(p);
+		return packSnorm2x16(p);
+	}
+
+	inline vec3 decodeNormal(uint32_t e)
+	{
+		const vec2 p = unpackSnorm2x16(e);
+		const float z = 1.0f - abs(p.x) - abs(p.y);
+		const vec2 xy = z < 0.0f ? octahedralWrap(p) : p;
+		return normalize(vec3(xy, z));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The shading data of the triangles of a model, quantized, in arrays by
+	// triangle (indexed like the unindexed vertices of the model, divided by
+	// three):
+	//   normals: octahedral (see encodeNormal()), three per triangle
+	//   texture coordinates: half floats, three per triangle
+	// That is 24 bytes per triangle, instead of the 60 of the normals and
+	// texture coordinates of the model. Materials are still taken from the
+	// meshes, where the UI can change them. Half floats have a relative precision of 1/2048, so texture
+	// coordinates in [0, 1] stay within half a texel of a 2048 texel
+	// texture, and tiled ones lose one bit per doubling.
+	///////////////////////////////////////////////////////////////////////////
+	class CompactShadingData
+	{
+	public:
+		CompactShadingData(const labhelper::Model * model);
+
+		void normals(uint32_t triangle, vec3 & n0, vec3 & n1, vec3 & n2) const
+		{
+			n0 = decodeNormal(packed_normals[triangle * 3 + 0]);
+			n1 = decodeNormal(packed_normals[triangle * 3 + 1]);
+			n2 = decodeNormal(packed_normals[triangle * 3 + 2]);
+		}
+		// Zero if the model has none
+		void textureCoordinates(uint32_t triangle, vec2 & uv0, vec2 & uv1, vec2 & uv2) const
+		{
+			uv0 = unpackHalf2x16(packed_texture_coordinates[triangle * 3 + 0]);
+			uv1 = unpackHalf2x16(packed_texture_coordinates[triangle * 3 + 1]);
+			uv2 = unpackHalf2x16(packed_texture_coordinates[triangle * 3 + 2]);
+		}
+
+		size_t memoryUsage() const;
+		// The memory the same data takes in the model
+		static size_t modelMemoryUsage(const labhelper::Model * model);
+
+		///////////////////////////////////////////////////////////////////////
+		// Compare with the float data of the model: the largest angle (in
+		// degrees) between a normal and its decoded one, and the largest
+		// difference of a texture coordinate, relative to its magnitude
+		// where that is above 1.0.
+		///////////////////////////////////////////////////////////////////////
+		void precision(const labhelper::Model * model, float & max_normal_error_degrees, float & max_uv_error) const;
+	private:
+		std::vector<uint32_t> packed_normals;
+		std::vector<uint32_t> packed_texture_coordinates;
+	};
+}
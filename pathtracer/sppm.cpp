@@ -0,0 +1,531 @@
+#include "sppm.h"
+#include "Pathtracer.h"
+#include "material.h"
+#include "sampling.h"
+#include "texture.h"
+#include <omp.h>
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	PhotonMappingSettings photon_mapping_settings;
+
+	struct Photon {
+		vec3 position;
+		// Direction the photon came from
+		vec3 wi;
+		vec3 power;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// The photons of the current pass, sorted by hash grid cell so that the
+	// photons of a cell are contiguous in memory.
+	///////////////////////////////////////////////////////////////////////////
+	struct PhotonGrid {
+		vector<Photon> photons;
+		vector<uint32_t> cell_begin, cell_end;
+		uint32_t table_mask = 0;
+		float cell_size = 1.0f;
+	} photon_grid;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The statistics kept for each pixel over all passes
+	///////////////////////////////////////////////////////////////////////////
+	struct PixelStatistics {
+		// Sum of direct (and emitted) radiance over all passes
+		vec3 Ld = vec3(0.0f);
+		// Accumulated photon flux
+		vec3 tau = vec3(0.0f);
+		// Accumulated (fractional) photon count
+		float N = 0.0f;
+		float radius = 0.0f;
+	};
+	vector<PixelStatistics> pixel_statistics;
+	int number_of_passes = 0;
+	// Keeps the random numbers of photon i from being those of pixel i in
+	// deterministic mode
+	const uint32_t photon_stream_salt = 0x5bd1e995u;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The light sources: the point light, the environment and the emitting
+	// triangles (with a cdf for picking one proportional to power). Photons
+	// from the environment enter the scene through a disk the size of its
+	// bounding sphere, facing their direction.
+	///////////////////////////////////////////////////////////////////////////
+	struct EmissiveTriangle {
+		vec3 p0, p1, p2;
+		vec3 normal;
+		float area;
+		vec3 Le;
+	};
+	struct Emitters {
+		vector<EmissiveTriangle> triangles;
+		vector<float> cdf;
+		float point_light_power = 0.0f;
+		float environment_power = 0.0f;
+		vec3 scene_center = vec3(0.0f);
+		float scene_radius = 0.0f;
+		float total_power = 0.0f;
+	} emitters;
+
+	static float luminance(const vec3 & c) { return dot(c, vec3(0.2126f, 0.7152f, 0.0722f)); }
+
+	static void collectEmitters()
+	{
+		emitters.triangles.clear();
+		emitters.cdf.clear();
+		float sum = 0.0f;
+		for (auto & m : getSceneMeshes()) {
+			const labhelper::Material & material = m.model->m_materials[m.mesh->m_material_idx];
+			if (material.m_emission <= 0.0f) continue;
+			for (uint32_t i = 0; i < m.mesh->m_number_of_vertices; i += 3) {
+				EmissiveTriangle t;
+				t.p0 = vec3(m.model_matrix * vec4(m.model->m_positions[m.mesh->m_start_index + i + 0], 1.0f));
+				t.p1 = vec3(m.model_matrix * vec4(m.model->m_positions[m.mesh->m_start_index + i + 1], 1.0f));
+				t.p2 = vec3(m.model_matrix * vec4(m.model->m_positions[m.mesh->m_start_index + i + 2], 1.0f));
+				vec3 c = cross(t.p1 - t.p0, t.p2 - t.p0);
+				t.area = 0.5f * length(c);
+				if (t.area <= 0.0f) continue;
+				t.normal = normalize(c);
+				// Textured emitters use the average texture color
+				const MipTexture * texture = getTexture(material.m_color_texture);
+				t.Le = material.m_emission * (texture ? vec3(texture->average()) : material.m_color);
+				// Surfaces emit on both sides, with power pi * area * Le per side
+				sum += 2.0f * M_PI * t.area * luminance(t.Le);
+				emitters.triangles.push_back(t);
+				emitters.cdf.push_back(sum);
+			}
+		}
+		emitters.point_light_power = 4.0f * M_PI * luminance(point_light.intensity_multiplier * point_light.color);
+
+		// The power of the environment through the disk, from its average
+		// radiance over the sphere (each row of the map is a band of
+		// latitude, weighted by its area)
+		vec3 bounds_min, bounds_max;
+		getSceneBounds(bounds_min, bounds_max);
+		emitters.scene_center = 0.5f * (bounds_min + bounds_max);
+		emitters.scene_radius = 0.5f * length(bounds_max - bounds_min);
+		emitters.environment_power = 0.0f;
+		const HDRImage & map = environment.map;
+		if (map.data != nullptr && environment.multiplier > 0.0f) {
+			double weighted = 0.0, weights = 0.0;
+			for (int y = 0; y < map.height; y++) {
+				const double w = sin(M_PI * (y + 0.5) / map.height);
+				for (int x = 0; x < map.width; x++) {
+					const float * c = &map.data[(size_t(y) * map.width + x) * 3];
+					weighted += w * luminance(vec3(c[0], c[1], c[2]));
+				}
+				weights += w * map.width;
+			}
+			const float radius = emitters.scene_radius;
+			emitters.environment_power = environment.multiplier * float(weighted / weights) * (4.0f * M_PI) * (M_PI * radius * radius);
+		}
+		emitters.total_power = emitters.point_light_power + emitters.environment_power + sum;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Pick the lobe of the material to scatter with. Transparent materials
+	// are glass, metals are mirrors and everything else is diffuse (unlike the
+	// other integrators, which shade everything as diffuse). Picking with
+	// probabilities equal to the weights means that the weights do not
+	// show up in the throughput.
+	///////////////////////////////////////////////////////////////////////////
+	enum Lobe { DIFFUSE_LOBE, MIRROR_LOBE, GLASS_LOBE };
+	static Lobe pickLobe(const labhelper::Material * material)
+	{
+		const float u = randf();
+		if (u < material->m_transparency) return GLASS_LOBE;
+		if (u < material->m_transparency + (1.0f - material->m_transparency) * material->m_metalness) return MIRROR_LOBE;
+		return DIFFUSE_LOBE;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Sample a specular lobe. Returns the throughput weight.
+	///////////////////////////////////////////////////////////////////////////
+	static vec3 sampleSpecular(Lobe lobe, const Intersection & hit, vec3 & wi)
+	{
+		float p;
+		vec3 f;
+		if (lobe == MIRROR_LOBE) {
+			SpecularReflection mirror(baseColor(hit));
+			f = mirror.sample_wi(wi, hit.wo, hit.shading_normal, p);
+		}
+		else {
+			SpecularRefraction glass;
+			f = glass.sample_wi(wi, hit.wo, hit.shading_normal, p);
+		}
+		if (p == 0.0f) return vec3(0.0f);
+		return f * abs(dot(wi, hit.shading_normal)) / p;
+	}
+
+	static vec3 offsetFrom(const Intersection & hit, const vec3 & w)
+	{
+		return hit.position + EPSILON * (dot(w, hit.geometry_normal) > 0.0f ? 1.0f : -1.0f) * hit.geometry_normal;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Hash grid helpers
+	///////////////////////////////////////////////////////////////////////////
+	static ivec3 cellOf(const vec3 & p)
+	{
+		return ivec3(floor(p / photon_grid.cell_size));
+	}
+
+	static uint32_t hashCell(const ivec3 & c)
+	{
+		return ((uint32_t(c.x) * 73856093u) ^ (uint32_t(c.y) * 19349663u) ^ (uint32_t(c.z) * 83492791u)) & photon_grid.table_mask;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Stable parallel LSD radix sort of (key, value) pairs, eight bits at a
+	// time. Each thread counts the digits of its own chunk, the counts are
+	// turned into per thread output offsets, and then each thread scatters
+	// its chunk.
+	///////////////////////////////////////////////////////////////////////////
+	static void parallelRadixSort(vector<uint32_t> & keys, vector<uint32_t> & values, int key_bits)
+	{
+		const int n = int(keys.size());
+		vector<uint32_t> keys_tmp(n), values_tmp(n);
+		vector<uint32_t> offsets(256 * omp_get_max_threads());
+		for (int shift = 0; shift < key_bits; shift += 8) {
+#pragma omp parallel
+			{
+				const int thread = omp_get_thread_num();
+				const int nof_threads = omp_get_num_threads();
+				const int begin = int(int64_t(n) * thread / nof_threads);
+				const int end = int(int64_t(n) * (thread + 1) / nof_threads);
+				uint32_t * count = &offsets[256 * thread];
+				std::fill(count, count + 256, 0);
+				for (int i = begin; i < end; i++) count[(keys[i] >> shift) & 0xFF]++;
+#pragma omp barrier
+#pragma omp single
+				{
+					uint32_t sum = 0;
+					for (int digit = 0; digit < 256; digit++) {
+						for (int t = 0; t < nof_threads; t++) {
+							const uint32_t c = offsets[256 * t + digit];
+							offsets[256 * t + digit] = sum;
+							sum += c;
+						}
+					}
+				}
+				for (int i = begin; i < end; i++) {
+					const uint32_t dst = count[(keys[i] >> shift) & 0xFF]++;
+					keys_tmp[dst] = keys[i];
+					values_tmp[dst] = values[i];
+				}
+			}
+			keys.swap(keys_tmp);
+			values.swap(values_tmp);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Emit one photon and trace it through the scene, storing it at every
+	// diffuse surface it hits after the first (direct light is computed at
+	// the visible points instead).
+	///////////////////////////////////////////////////////////////////////////
+	static void tracePhoton(vector<Photon> & storage, size_t capacity)
+	{
+		if (!(emitters.total_power > 0.0f)) return;
+		Ray ray;
+		vec3 power;
+		const float N = float(photon_mapping_settings.photons_per_iteration);
+		const float u = randf() * emitters.total_power;
+		if (u < emitters.point_light_power) {
+			const float p_select = emitters.point_light_power / emitters.total_power;
+			ray = Ray(point_light.position, uniformSampleSphere());
+			power = point_light.intensity_multiplier * point_light.color * (4.0f * M_PI) / (p_select * N);
+		}
+		else if (u < emitters.point_light_power + emitters.environment_power || emitters.triangles.empty()) {
+			// From a uniformly distributed direction d of the environment,
+			// through a uniformly distributed point of the disk facing it
+			const float p_select = emitters.environment_power / emitters.total_power;
+			const vec3 d = uniformSampleSphere();
+			const vec3 tangent = normalize(perpendicular(d));
+			const vec3 bitangent = cross(d, tangent);
+			float dx, dy;
+			concentricSampleDisk(&dx, &dy);
+			const float R = emitters.scene_radius;
+			ray = Ray(emitters.scene_center + R * (d + dx * tangent + dy * bitangent), -d);
+			power = Lenvironment(d) * (4.0f * M_PI) * (M_PI * R * R) / (p_select * N);
+		}
+		else {
+			const float v = u - emitters.point_light_power - emitters.environment_power;
+			const size_t i = std::min(size_t(std::lower_bound(emitters.cdf.begin(), emitters.cdf.end(), v) - emitters.cdf.begin()),
+				emitters.triangles.size() - 1);
+			const EmissiveTriangle & t = emitters.triangles[i];
+			const float p_select = (emitters.cdf[i] - (i > 0 ? emitters.cdf[i - 1] : 0.0f)) / emitters.total_power;
+			// Uniform point on the triangle, cosine distributed direction on
+			// a random side
+			float s = sqrt(randf()), r = randf();
+			vec3 p = (1.0f - s) * t.p0 + s * (1.0f - r) * t.p1 + s * r * t.p2;
+			vec3 n = randf() < 0.5f ? t.normal : -t.normal;
+			vec3 tangent = normalize(perpendicular(n));
+			vec3 bitangent = normalize(cross(tangent, n));
+			vec3 d = cosineSampleHemisphere();
+			vec3 w = normalize(d.x * tangent + d.y * bitangent + d.z * n);
+			ray = Ray(p + EPSILON * n, w);
+			power = t.Le * t.area * 2.0f * M_PI / (p_select * N);
+		}
+
+		for (int depth = 0; depth < settings.max_bounces; depth++) {
+			if (!intersect(ray)) return;
+			Intersection hit = getIntersection(ray);
+			const Lobe lobe = pickLobe(hit.material);
+			vec3 wi;
+			if (lobe == DIFFUSE_LOBE) {
+				if (depth > 0 && storage.size() < capacity) {
+					storage.push_back({ hit.position, hit.wo, power });
+				}
+				Diffuse diffuse(baseColor(hit));
+				float p;
+				vec3 f = diffuse.sample_wi(wi, hit.wo, hit.shading_normal, p);
+				if (p < EPSILON) return;
+				vec3 new_power = power * f * abs(dot(wi, hit.shading_normal)) / p;
+				// Russian roulette, keeping the photon power roughly constant
+				const float q = std::max(0.0f, 1.0f - luminance(new_power) / luminance(power));
+				if (randf() < q) return;
+				power = new_power / (1.0f - q);
+			}
+			else {
+				power *= sampleSpecular(lobe, hit, wi);
+			}
+			if (power == vec3(0.0f)) return;
+			ray = Ray(offsetFrom(hit, wi), wi);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Photon pass
+	///////////////////////////////////////////////////////////////////////////
+	void beginPhotonMappingPass(int width, int height, bool restart)
+	{
+		///////////////////////////////////////////////////////////////////////
+		// (Re)initialize pixel statistics
+		///////////////////////////////////////////////////////////////////////
+		if (restart || int(pixel_statistics.size()) != width * height) {
+			vec3 bounds_min, bounds_max;
+			getSceneBounds(bounds_min, bounds_max);
+			PixelStatistics initial;
+			initial.radius = photon_mapping_settings.initial_radius * length(bounds_max - bounds_min);
+			pixel_statistics.assign(width * height, initial);
+			number_of_passes = 0;
+			collectEmitters();
+		}
+		number_of_passes += 1;
+
+		///////////////////////////////////////////////////////////////////////
+		// Trace photons. Each thread stores into its own buffer, which are
+		// concatenated afterwards. In deterministic mode each thread traces a
+		// contiguous range of photons (with random numbers that depend on the
+		// photon index), so the concatenation is in emission order, and the
+		// limit on the number of stored photons is applied to it. So that
+		// the buffers do not grow to the limit on each thread, the photons
+		// are traced in chunks that store at most max_stored photons, until
+		// the limit is reached.
+		///////////////////////////////////////////////////////////////////////
+		const bool deterministic = settings.deterministic;
+		const int nof_threads = omp_get_max_threads();
+		vector<vector<Photon>> thread_photons(nof_threads);
+		const size_t max_stored = size_t(photon_mapping_settings.max_stored_photons);
+		const int nof_emitted = photon_mapping_settings.photons_per_iteration;
+		vector<Photon> photons;
+		auto concatenate = [&]() {
+			const size_t begin = photons.size();
+			vector<size_t> thread_offsets(nof_threads + 1, begin);
+			for (int t = 0; t < nof_threads; t++) thread_offsets[t + 1] = thread_offsets[t] + thread_photons[t].size();
+			const size_t end = std::min(thread_offsets[nof_threads], max_stored);
+			photons.resize(end);
+#pragma omp parallel for
+			for (int t = 0; t < nof_threads; t++) {
+				if (thread_offsets[t] < end) {
+					const size_t count = std::min(thread_photons[t].size(), end - thread_offsets[t]);
+					std::copy(thread_photons[t].begin(), thread_photons[t].begin() + count, photons.begin() + thread_offsets[t]);
+				}
+				thread_photons[t].clear();
+			}
+		};
+		if (deterministic) {
+			// A photon is stored at most once per bounce
+			const int chunk_size = int(std::max(max_stored / size_t(std::max(settings.max_bounces, 1)), size_t(1)));
+			photons.reserve(std::min(max_stored, size_t(nof_emitted) * size_t(std::max(settings.max_bounces, 1))));
+			for (int first = 0; first < nof_emitted && photons.size() < max_stored; first += chunk_size) {
+				const int last = std::min(first + chunk_size, nof_emitted);
+#pragma omp parallel
+				{
+					vector<Photon> & storage = thread_photons[omp_get_thread_num()];
+#pragma omp for schedule(static)
+					for (int i = first; i < last; i++) {
+						beginSampleStream(settings.seed ^ photon_stream_salt, uint32_t(i), uint32_t(number_of_passes));
+						tracePhoton(storage, max_stored);
+						endSampleStream();
+					}
+				}
+				concatenate();
+			}
+		}
+		else {
+			const size_t capacity_per_thread = max_stored / nof_threads + 1;
+#pragma omp parallel
+			{
+				vector<Photon> & storage = thread_photons[omp_get_thread_num()];
+				storage.reserve(capacity_per_thread);
+#pragma omp for schedule(dynamic, 1024)
+				for (int i = 0; i < nof_emitted; i++) {
+					tracePhoton(storage, capacity_per_thread);
+				}
+			}
+			concatenate();
+		}
+		const size_t nof_photons = photons.size();
+
+		///////////////////////////////////////////////////////////////////////
+		// Build the hash grid. Cells are as large as the largest gather
+		// radius, so a lookup touches at most 2x2x2 cells.
+		///////////////////////////////////////////////////////////////////////
+		float max_radius = 0.0f;
+		for (auto & s : pixel_statistics) max_radius = std::max(max_radius, s.radius);
+		photon_grid.cell_size = std::max(2.0f * max_radius, EPSILON);
+		uint32_t table_size = 1;
+		int table_bits = 0;
+		while (table_size < std::max(nof_photons, size_t(1))) { table_size *= 2; table_bits++; }
+		photon_grid.table_mask = table_size - 1;
+		vector<uint32_t> keys(nof_photons), indices(nof_photons);
+#pragma omp parallel for
+		for (int i = 0; i < int(nof_photons); i++) {
+			keys[i] = hashCell(cellOf(photons[i].position));
+			indices[i] = i;
+		}
+		parallelRadixSort(keys, indices, table_bits);
+		photon_grid.photons.resize(nof_photons);
+		photon_grid.cell_begin.assign(table_size, 0);
+		photon_grid.cell_end.assign(table_size, 0);
+#pragma omp parallel for
+		for (int i = 0; i < int(nof_photons); i++) {
+			photon_grid.photons[i] = photons[indices[i]];
+			if (i == 0 || keys[i] != keys[i - 1]) photon_grid.cell_begin[keys[i]] = i;
+			if (i == int(nof_photons) - 1 || keys[i] != keys[i + 1]) photon_grid.cell_end[keys[i]] = i + 1;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Camera pass and photon gathering
+	///////////////////////////////////////////////////////////////////////////
+	vec3 LiPhotonMapping(Ray & primary_ray, int pixel, const RayDifferential & primary_differential)
+	{
+		PixelStatistics & stats = pixel_statistics[pixel];
+		vec3 beta(1.0f);
+		Ray ray = primary_ray;
+		RayDifferential differential = primary_differential;
+		for (int depth = 0; depth < settings.max_bounces; depth++) {
+			if (!intersect(ray)) {
+				stats.Ld += beta * Lenvironment(ray.d);
+				break;
+			}
+			Intersection hit = getIntersection(ray);
+			transferDifferential(differential, ray, hit);
+			stats.Ld += beta * hit.material->m_emission * baseColor(hit);
+			const Lobe lobe = pickLobe(hit.material);
+			if (lobe != DIFFUSE_LOBE) {
+				vec3 wi;
+				beta *= sampleSpecular(lobe, hit, wi);
+				if (beta == vec3(0.0f)) break;
+				if (dot(wi, hit.shading_normal) * dot(hit.wo, hit.shading_normal) > 0.0f) {
+					reflectDifferential(differential, hit, wi);
+				}
+				else {
+					refractDifferential(differential, hit, wi, SpecularRefraction().ior);
+				}
+				ray = Ray(offsetFrom(hit, wi), wi);
+				continue;
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// This is the visible point. Add direct light as Li() does: from
+			// the point light, and from emitters and the environment through
+			// a sampled direction. (Photons are only stored after their
+			// first bounce, so they only carry indirect light.)
+			///////////////////////////////////////////////////////////////////
+			Diffuse diffuse(baseColor(hit));
+			{
+				const float distance_to_light = length(point_light.position - hit.position);
+				const vec3 wi = normalize(point_light.position - hit.position);
+				Ray shadow_ray(offsetFrom(hit, wi), wi, 0.0f, distance_to_light);
+				if (!occluded(shadow_ray)) {
+					const vec3 Li = point_light.intensity_multiplier * point_light.color / (distance_to_light * distance_to_light);
+					stats.Ld += beta * diffuse.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+				}
+			}
+			{
+				vec3 wi;
+				float p;
+				const vec3 f = diffuse.sample_wi(wi, hit.wo, hit.shading_normal, p);
+				if (p >= EPSILON) {
+					const vec3 weight = beta * f * abs(dot(wi, hit.shading_normal)) / p;
+					Ray light_ray(offsetFrom(hit, wi), wi);
+					if (!intersect(light_ray)) {
+						stats.Ld += weight * Lenvironment(wi);
+					}
+					else if (depth + 2 <= settings.max_bounces) {
+						Intersection light_hit = getIntersection(light_ray);
+						stats.Ld += weight * light_hit.material->m_emission * baseColor(light_hit);
+					}
+				}
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Gather photons within the current radius. Neighbouring cells
+			// may hash to the same table entry, so visit each entry only once.
+			///////////////////////////////////////////////////////////////////
+			const float r = stats.radius;
+			const ivec3 c0 = cellOf(hit.position - vec3(r));
+			const ivec3 c1 = cellOf(hit.position + vec3(r));
+			uint32_t visited[8];
+			int nof_visited = 0;
+			vec3 phi(0.0f);
+			int M = 0;
+			for (int z = c0.z; z <= c1.z; z++) for (int y = c0.y; y <= c1.y; y++) for (int x = c0.x; x <= c1.x; x++) {
+				const uint32_t key = hashCell(ivec3(x, y, z));
+				if (std::find(visited, visited + nof_visited, key) != visited + nof_visited) continue;
+				if (nof_visited < 8) visited[nof_visited++] = key;
+				for (uint32_t i = photon_grid.cell_begin[key]; i < photon_grid.cell_end[key]; i++) {
+					const Photon & photon = photon_grid.photons[i];
+					const vec3 d = photon.position - hit.position;
+					if (dot(d, d) > r * r) continue;
+					const vec3 f = diffuse.f(photon.wi, hit.wo, hit.shading_normal);
+					if (f == vec3(0.0f)) continue;
+					phi += f * photon.power;
+					M++;
+				}
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Progressive update: keep a fraction alpha of the new photons and
+			// shrink the radius accordingly.
+			///////////////////////////////////////////////////////////////////
+			if (M > 0) {
+				const float N_new = stats.N + photon_mapping_settings.alpha * M;
+				const float r_new = r * sqrt(N_new / (stats.N + M));
+				stats.tau = (stats.tau + beta * phi) * (r_new * r_new) / (r * r);
+				stats.N = N_new;
+				stats.radius = r_new;
+			}
+			break;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// The current estimate. Photon power was already divided by the
+		// number of photons emitted per pass.
+		///////////////////////////////////////////////////////////////////////
+		const float k = float(number_of_passes);
+		return stats.Ld / k + stats.tau / (k * M_PI * stats.radius * stats.radius);
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <glm/glm.hpp>
+#include "embree.h"
+#include "raydifferential.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Stochastic progressive photon mapping settings
+	///////////////////////////////////////////////////////////////////////////
+	extern struct PhotonMappingSettings {
+		// Number of photons emitted per pass
+		int photons_per_iteration = 200000;
+		// At most this many photons are stored per pass (a photon is stored
+		// at every diffuse surface it hits after its first bounce). Photons
+		// come from the point light, the environment and emitting surfaces.
+		int max_stored_photons = 1000000;
+		// Initial gather radius, relative to the scene bounding box diagonal
+		float initial_radius = 0.002f;
+		// Controls how fast the gather radius shrinks (alpha in the paper)
+		float alpha = 0.7f;
+	} photon_mapping_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Trace the photons of a pass and build the photon hash grid. Must be
+	// called before LiPhotonMapping() is called for the pixels of the pass.
+	// If restart is true, all per pixel statistics are reset.
+	///////////////////////////////////////////////////////////////////////////
+	void beginPhotonMappingPass(int width, int height, bool restart);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Follow a camera path through specular surfaces to the first diffuse
+	// surface, gather photons there and update the statistics of the pixel.
+	// Returns the current (progressive) radiance estimate for the pixel, not
+	// a sample to be averaged. The differential of the primary ray is
+	// followed through the specular bounces to filter textures.
+	///////////////////////////////////////////////////////////////////////////
+	vec3 LiPhotonMapping(Ray & primary_ray, int pixel, const RayDifferential & differential);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <atomic>
+#include <stddef.h>
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// A bounded lock-free queue for one producer thread and one consumer
+	// thread. One slot is always left empty, so it holds capacity - 1
+	// elements. The indices live on separate cache lines, so the two
+	// threads only share a line when one of them reads the other's index.
+	///////////////////////////////////////////////////////////////////////////
+	template <typename T, size_t capacity>
+	class SpscQueue
+	{
+	public:
+		SpscQueue() : head(0), tail(0) {}
+		// Called by the producer. Returns false if the queue is full.
+		bool push(const T & value)
+		{
+			const size_t t = tail.load(std::memory_order_relaxed);
+			const size_t next = (t + 1) % capacity;
+			if (next == head.load(std::memory_order_acquire)) return false;
+			slots[t] = value;
+			tail.store(next, std::memory_order_release);
+			return true;
+		}
+		// Called by the consumer. Returns false if the queue is empty.
+		bool pop(T & value)
+		{
+			const size_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire)) return false;
+			value = slots[h];
+			head.store((h + 1) % capacity, std::memory_order_release);
+			return true;
+		}
+	private:
+		alignas(64) std::atomic<size_t> head;
+		alignas(64) std::atomic<size_t> tail;
+		T slots[capacity];
+	};
+}
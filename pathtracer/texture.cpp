@@ -0,0 +1,224 @@
+#include "texture.h"
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	static unordered_map<const labhelper::Texture *, unique_ptr<MipTexture>> textures;
+	static unordered_map<const labhelper::Texture *, unique_ptr<AlphaMask>> alpha_masks;
+
+	///////////////////////////////////////////////////////////////////////////
+	// sRGB conversion. Decoding goes through a table since it is done for
+	// every texel that is filtered.
+	///////////////////////////////////////////////////////////////////////////
+	static float srgbToLinear(float c)
+	{
+		return c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+	}
+
+	static float linearToSrgb(float c)
+	{
+		return c <= 0.0031308f ? c * 12.92f : 1.055f * pow(c, 1.0f / 2.4f) - 0.055f;
+	}
+
+	static struct SrgbTable {
+		float to_linear[256];
+		SrgbTable() { for (int i = 0; i < 256; i++) to_linear[i] = srgbToLinear(float(i) / 255.0f); }
+	} srgb_table;
+
+	static uint8_t toByte(float c)
+	{
+		return uint8_t(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// MipTexture
+	///////////////////////////////////////////////////////////////////////////
+	MipTexture::MipTexture(const labhelper::Texture & texture, int _nof_components, bool _srgb)
+		: source(texture.data), nof_components(_nof_components), srgb(_srgb)
+	{
+		int w = texture.width, h = texture.height;
+		while (true) {
+			Level level;
+			level.width = w;
+			level.height = h;
+			level.tiles_x = (w + tile_size - 1) / tile_size;
+			level.tiles_y = (h + tile_size - 1) / tile_size;
+			const int nof_tiles = level.tiles_x * level.tiles_y;
+			level.tiles.reset(new atomic<Tile *>[nof_tiles]);
+			for (int i = 0; i < nof_tiles; i++) level.tiles[i].store(nullptr, memory_order_relaxed);
+			levels.push_back(std::move(level));
+			if (w == 1 && h == 1) break;
+			w = std::max(1, w / 2);
+			h = std::max(1, h / 2);
+		}
+	}
+
+	MipTexture::~MipTexture()
+	{
+		for (auto & level : levels) {
+			for (int i = 0; i < level.tiles_x * level.tiles_y; i++) delete level.tiles[i].load();
+		}
+	}
+
+	const MipTexture::Tile & MipTexture::tile(int l, int tile_x, int tile_y) const
+	{
+		atomic<Tile *> & slot = levels[l].tiles[tile_y * levels[l].tiles_x + tile_x];
+		Tile * t = slot.load(memory_order_acquire);
+		if (t != nullptr) return *t;
+		///////////////////////////////////////////////////////////////////////
+		// Build the tile and try to publish it. If another thread got there
+		// first we use its tile instead (both have the same contents).
+		///////////////////////////////////////////////////////////////////////
+		Tile * new_tile = new Tile;
+		buildTile(l, tile_x, tile_y, *new_tile);
+		Tile * expected = nullptr;
+		if (slot.compare_exchange_strong(expected, new_tile, memory_order_acq_rel, memory_order_acquire)) {
+			return *new_tile;
+		}
+		delete new_tile;
+		return *expected;
+	}
+
+	void MipTexture::buildTile(int l, int tile_x, int tile_y, Tile & t) const
+	{
+		const Level & level = levels[l];
+		for (int y = 0; y < tile_size; y++) {
+			for (int x = 0; x < tile_size; x++) {
+				// Texels outside the level (in partial edge tiles) are never read
+				const int px = std::min(tile_x * tile_size + x, level.width - 1);
+				const int py = std::min(tile_y * tile_size + y, level.height - 1);
+				uint8_t * dst = &t.texels[(y * tile_size + x) * 4];
+				if (l == 0) {
+					const uint8_t * src = &source[(size_t(py) * level.width + px) * nof_components];
+					for (int c = 0; c < 4; c++) dst[c] = c < nof_components ? src[c] : (c == 3 ? 255 : src[0]);
+					continue;
+				}
+				// Box filter the 2x2 texels of the level above, in linear space
+				const Level & above = levels[l - 1];
+				vec4 sum(0.0f);
+				for (int dy = 0; dy < 2; dy++) for (int dx = 0; dx < 2; dx++) {
+					sum += texel(l - 1, std::min(2 * px + dx, above.width - 1), std::min(2 * py + dy, above.height - 1));
+				}
+				sum *= 0.25f;
+				for (int c = 0; c < 3; c++) dst[c] = toByte(srgb ? linearToSrgb(sum[c]) : sum[c]);
+				dst[3] = toByte(sum.w);
+			}
+		}
+	}
+
+	vec4 MipTexture::decode(const uint8_t * p) const
+	{
+		if (srgb) {
+			return vec4(srgb_table.to_linear[p[0]], srgb_table.to_linear[p[1]], srgb_table.to_linear[p[2]], p[3] * (1.0f / 255.0f));
+		}
+		return vec4(p[0], p[1], p[2], p[3]) * (1.0f / 255.0f);
+	}
+
+	const uint8_t * MipTexture::texelPointer(int l, uint32_t x, uint32_t y) const
+	{
+		const Tile & t = tile(l, x / tile_size, y / tile_size);
+		return &t.texels[((y % tile_size) * tile_size + (x % tile_size)) * 4];
+	}
+
+	vec4 MipTexture::texel(int l, int x, int y) const
+	{
+		return decode(texelPointer(l, x, y));
+	}
+
+	vec4 MipTexture::bilinear(const vec2 & uv, int l) const
+	{
+		const Level & level = levels[l];
+		// Wrap to [0,1) first, uv can be far outside it
+		const float u = uv.x - floor(uv.x), v = uv.y - floor(uv.y);
+		const float fx = u * level.width - 0.5f;
+		const float fy = v * level.height - 0.5f;
+		// fx, fy >= -0.5 so truncation can be used instead of floor
+		int x0 = int(fx + 1.0f) - 1, y0 = int(fy + 1.0f) - 1;
+		const float tx = fx - float(x0), ty = fy - float(y0);
+		// With u and v in [0,1) only -1 needs wrapping
+		if (x0 < 0) x0 += level.width;
+		if (y0 < 0) y0 += level.height;
+		const int x1 = x0 + 1 == level.width ? 0 : x0 + 1;
+		const int y1 = y0 + 1 == level.height ? 0 : y0 + 1;
+		return mix(mix(texel(l, x0, y0), texel(l, x1, y0), tx),
+			mix(texel(l, x0, y1), texel(l, x1, y1), tx), ty);
+	}
+
+	vec4 MipTexture::trilinear(const vec2 & uv, float lod) const
+	{
+		if (!(lod > 0.0f)) return bilinear(uv, 0);
+		const int last = levelCount() - 1;
+		if (lod >= float(last)) return bilinear(uv, last);
+		const int l = int(lod);
+		return mix(bilinear(uv, l), bilinear(uv, l + 1), lod - float(l));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// AlphaMask
+	///////////////////////////////////////////////////////////////////////////
+	AlphaMask::AlphaMask(const labhelper::Texture & texture)
+		: width(texture.width), height(texture.height), all_opaque(true)
+	{
+		const size_t nof_texels = size_t(width) * height;
+		bits.assign((nof_texels + 63) / 64, 0);
+		for (size_t i = 0; i < nof_texels; i++) {
+			if (texture.data[i * 4 + 3] >= 128) {
+				bits[i >> 6] |= uint64_t(1) << (i & 63);
+			}
+			else {
+				all_opaque = false;
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Texture registry
+	///////////////////////////////////////////////////////////////////////////
+	void addTexture(const labhelper::Texture & texture, int nof_components, bool srgb)
+	{
+		if (!texture.valid || texture.data == nullptr || textures.count(&texture)) return;
+		textures[&texture].reset(new MipTexture(texture, nof_components, srgb));
+		if (nof_components == 4) {
+			AlphaMask * mask = new AlphaMask(texture);
+			if (!mask->allOpaque()) alpha_masks[&texture].reset(mask);
+			else delete mask;
+		}
+	}
+
+	const AlphaMask * getAlphaMask(const labhelper::Texture & texture)
+	{
+		if (!texture.valid) return nullptr;
+		auto it = alpha_masks.find(&texture);
+		return it == alpha_masks.end() ? nullptr : it->second.get();
+	}
+
+	const MipTexture * getTexture(const labhelper::Texture & texture)
+	{
+		if (!texture.valid) return nullptr;
+		auto it = textures.find(&texture);
+		return it == textures.end() ? nullptr : it->second.get();
+	}
+
+	vec3 baseColor(const Intersection & hit)
+	{
+		const MipTexture * texture = getTexture(hit.material->m_color_texture);
+		if (texture == nullptr) return hit.material->m_color;
+		///////////////////////////////////////////////////////////////////////
+		// Pick the level where the larger axis of the pixel footprint covers
+		// about one texel. Without a footprint (zero derivatives) the lod is
+		// -inf and level 0 is used.
+		///////////////////////////////////////////////////////////////////////
+		const vec2 size(texture->width(), texture->height());
+		const float footprint = std::max(dot(hit.duvdx * size, hit.duvdx * size), dot(hit.duvdy * size, hit.duvdy * size));
+		const float lod = 0.5f * log2(footprint);
+		return vec3(texture->trilinear(hit.texture_coordinate, lod));
+	}
+}
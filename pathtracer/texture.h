@@ -0,0 +1,114 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <Model.h>
+#include "embree.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// A CPU side, mip-mapped copy of a labhelper::Texture. Each level is
+	// stored in 8x8 texel tiles, which are built the first time they are
+	// needed (from the source image, or from the level above). Tiles are
+	// published with a compare-and-swap, so lookups from many threads never
+	// take a lock. Texels are stored with 8 bits per channel and converted
+	// to linear space (through a table, for sRGB color textures) before they
+	// are filtered.
+	///////////////////////////////////////////////////////////////////////////
+	class MipTexture
+	{
+	public:
+		static const int tile_size = 8;
+		MipTexture(const labhelper::Texture & texture, int nof_components, bool srgb);
+		~MipTexture();
+		MipTexture(const MipTexture &) = delete;
+		MipTexture & operator=(const MipTexture &) = delete;
+		// Filtered lookups, with repeat wrapping. uv follows the OpenGL
+		// convention (v = 0 is the first row of the image).
+		vec4 bilinear(const vec2 & uv, int level) const;
+		vec4 trilinear(const vec2 & uv, float lod) const;
+		// The average over the whole texture (the coarsest level)
+		vec4 average() const { return texel(levelCount() - 1, 0, 0); }
+		int levelCount() const { return int(levels.size()); }
+		int width(int level = 0) const { return levels[level].width; }
+		int height(int level = 0) const { return levels[level].height; }
+	private:
+		struct Tile {
+			uint8_t texels[tile_size * tile_size * 4];
+		};
+		struct Level {
+			int width, height;
+			int tiles_x, tiles_y;
+			std::unique_ptr<std::atomic<Tile *>[]> tiles;
+		};
+		vec4 decode(const uint8_t * texel) const;
+		const uint8_t * texelPointer(int level, uint32_t x, uint32_t y) const;
+		vec4 texel(int level, int x, int y) const;
+		const Tile & tile(int level, int tile_x, int tile_y) const;
+		void buildTile(int level, int tile_x, int tile_y, Tile & tile) const;
+		const uint8_t * source;
+		int nof_components;
+		bool srgb;
+		std::vector<Level> levels;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// The alpha channel of a texture, thresholded at 0.5 and stored as one bit
+	// per texel. Alpha is tested for every candidate hit during traversal, so
+	// the lookup is a single (nearest) texel from a mask that is 32 times 
+	// smaller than the texture.
+	///////////////////////////////////////////////////////////////////////////
+	class AlphaMask
+	{
+	public:
+		AlphaMask(const labhelper::Texture & texture);
+		// With repeat wrapping, and the uv convention of MipTexture
+		bool opaque(const vec2 & uv) const
+		{
+			const float u = uv.x - floor(uv.x), v = uv.y - floor(uv.y);
+			const uint32_t x = std::min(uint32_t(u * width), uint32_t(width - 1));
+			const uint32_t y = std::min(uint32_t(v * height), uint32_t(height - 1));
+			const size_t i = size_t(y) * width + x;
+			return ((bits[i >> 6] >> (i & 63)) & 1) != 0;
+		}
+		// Whether no texel is transparent
+		bool allOpaque() const { return all_opaque; }
+		size_t memoryUsage() const { return bits.size() * sizeof(uint64_t); }
+	private:
+		int width, height;
+		std::vector<uint64_t> bits;
+		bool all_opaque;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Create the CPU copy of a texture (does nothing if it has already been
+	// added, or if the texture is not valid). Textures with four components
+	// also get an alpha mask. Not thread safe, call it when the scene is set 
+	// up.
+	///////////////////////////////////////////////////////////////////////////
+	void addTexture(const labhelper::Texture & texture, int nof_components, bool srgb);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The CPU copy of a texture, or nullptr if it has none.
+	///////////////////////////////////////////////////////////////////////////
+	const MipTexture * getTexture(const labhelper::Texture & texture);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The alpha mask of a texture, or nullptr if it has none or if it is
+	// opaque everywhere
+	///////////////////////////////////////////////////////////////////////////
+	const AlphaMask * getAlphaMask(const labhelper::Texture & texture);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The (linear space) base color of the material at an intersection,
+	// looked up in its color texture if it has one. The mip level is chosen
+	// from the footprint in hit.duvdx and hit.duvdy.
+	///////////////////////////////////////////////////////////////////////////
+	vec3 baseColor(const Intersection & hit);
+}
@@ -0,0 +1,172 @@
+#include "threads.h"
+#include "numa.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <omp.h>
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+using namespace std;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	ThreadSettings thread_settings = { 0, true, false, false, true };
+
+	static int nof_threads = 0;
+	// The node of each thread, and the processors it may run on, if pinned
+	static vector<int> thread_nodes;
+	static vector<vector<int>> thread_affinity;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The cores of the machine, each as a list of its logical processors
+	///////////////////////////////////////////////////////////////////////////
+	static vector<vector<int>> cores()
+	{
+		vector<vector<int>> result;
+#ifdef _WIN32
+		DWORD size = 0;
+		GetLogicalProcessorInformation(nullptr, &size);
+		vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(size / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+		if (!info.empty() && GetLogicalProcessorInformation(info.data(), &size)) {
+			for (auto & i : info) {
+				if (i.Relationship != RelationProcessorCore) continue;
+				vector<int> core;
+				for (int p = 0; p < int(sizeof(ULONG_PTR) * 8); p++) {
+					if (i.ProcessorMask & (ULONG_PTR(1) << p)) core.push_back(p);
+				}
+				if (!core.empty()) result.push_back(core);
+			}
+		}
+#elif defined(__linux__)
+		// Logical processors this process may run on, grouped by
+		// (package, core) as reported by sysfs
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+			map<pair<int, int>, vector<int>> by_core;
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (!CPU_ISSET(cpu, &allowed)) continue;
+				const string topology = "/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology/";
+				int package = -1, core = -1;
+				ifstream(topology + "physical_package_id") >> package;
+				ifstream(topology + "core_id") >> core;
+				// Without topology, each processor is a core of its own
+				if (package < 0 || core < 0) {
+					package = -1;
+					core = cpu;
+				}
+				by_core[make_pair(package, core)].push_back(cpu);
+			}
+			for (auto & c : by_core) result.push_back(c.second);
+		}
+#endif
+		if (result.empty()) {
+			const int n = std::max(1, int(thread::hardware_concurrency()));
+			for (int p = 0; p < n; p++) result.push_back(vector<int>(1, p));
+		}
+		return result;
+	}
+
+	vector<int> logicalProcessors(bool use_hyperthreads)
+	{
+		const vector<vector<int>> all_cores = cores();
+		vector<int> processors;
+		size_t max_siblings = 1;
+		for (auto & core : all_cores) max_siblings = std::max(max_siblings, core.size());
+		for (size_t sibling = 0; sibling < (use_hyperthreads ? max_siblings : 1); sibling++) {
+			for (auto & core : all_cores) {
+				if (sibling < core.size()) processors.push_back(core[sibling]);
+			}
+		}
+		return processors;
+	}
+
+	static bool pinCurrentThread(const vector<int> & processors)
+	{
+#ifdef _WIN32
+		DWORD_PTR mask = 0;
+		for (int p : processors) {
+			if (p < int(sizeof(DWORD_PTR) * 8)) mask |= DWORD_PTR(1) << p;
+		}
+		return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int p : processors) CPU_SET(p, &set);
+		return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+		(void)processors;
+		return false;
+#endif
+	}
+
+	void initializeThreads()
+	{
+		if (!thread_settings.shared_pool) {
+			nof_threads = omp_get_max_threads();
+			return;
+		}
+		const vector<int> processors = logicalProcessors(thread_settings.use_hyperthreads);
+		nof_threads = thread_settings.threads > 0 ? thread_settings.threads : int(processors.size());
+		thread_nodes.clear();
+		thread_affinity.clear();
+		if (thread_settings.pin_threads) {
+			// Thread i runs on processor i, or anywhere on its node
+			thread_affinity.resize(nof_threads);
+			for (int i = 0; i < nof_threads; i++) {
+				const int processor = processors[i % processors.size()];
+				const int node = numaNodeOfProcessor(processor);
+				thread_nodes.push_back(node);
+				if (!thread_settings.pin_to_nodes) {
+					thread_affinity[i].push_back(processor);
+					continue;
+				}
+				for (int p : processors) {
+					if (numaNodeOfProcessor(p) == node) thread_affinity[i].push_back(p);
+				}
+			}
+		}
+		applyThreadSettings();
+		cout << "Using " << nof_threads << " threads (" << processors.size() << " logical processors, " <<
+			numaNodeCount() << " NUMA nodes" << (thread_settings.pin_threads ? ", pinned" : "") << ")\n";
+	}
+
+	void applyThreadSettings()
+	{
+		if (!thread_settings.shared_pool || nof_threads == 0) return;
+		omp_set_dynamic(0);
+		omp_set_num_threads(nof_threads);
+		if (thread_affinity.empty()) return;
+		// OpenMP keeps the threads of a team between parallel regions, so
+		// this pins the threads that will trace
+		bool pinned = true;
+#pragma omp parallel reduction(&&:pinned)
+		pinned = pinCurrentThread(thread_affinity[omp_get_thread_num()]);
+		if (!pinned) cout << "WARNING: Could not pin all threads\n";
+	}
+
+	string embreeDeviceConfig()
+	{
+		if (!thread_settings.shared_pool) return "";
+		return "threads=" + to_string(nof_threads) + ",set_affinity=" + (thread_settings.pin_threads ? "1" : "0");
+	}
+
+	int threadCount()
+	{
+		return nof_threads;
+	}
+
+	int threadNode(int thread)
+	{
+		return thread_nodes.empty() ? -1 : thread_nodes[thread % thread_nodes.size()];
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <string>
+#include <vector>
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// The threads that build the BVH and trace paths. By default the
+	// pathtracer owns one pool: the OpenMP threads that trace paths also
+	// build the BVH (they join Embree's commit), and Embree is limited to
+	// the same number of threads, so the two never compete for cores. With
+	// shared_pool off, Embree and OpenMP each start their own default sized
+	// pool, as before.
+	///////////////////////////////////////////////////////////////////////////
+	extern struct ThreadSettings {
+		// Number of threads, 0 for one per core (or per hardware thread,
+		// with use_hyperthreads)
+		int threads;
+		bool use_hyperthreads;
+		// Pin thread i to the i:th logical processor, taking one hardware
+		// thread of every core before the second hardware thread of any
+		bool pin_threads;
+		// With pin_threads, let each thread run on any logical processor
+		// of the NUMA node of its processor instead
+		bool pin_to_nodes;
+		bool shared_pool;
+	} thread_settings;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Configure OpenMP (thread count and pinning) from thread_settings.
+	// Called when the first model is added, so the settings must be made
+	// before that.
+	///////////////////////////////////////////////////////////////////////////
+	void initializeThreads();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Apply the thread count and pinning of initializeThreads() to the
+	// calling thread. OpenMP keeps them per thread, and each thread that
+	// starts parallel regions gets a team of its own, so a thread that
+	// traces (like the render thread) must call this before it does.
+	///////////////////////////////////////////////////////////////////////////
+	void applyThreadSettings();
+
+	///////////////////////////////////////////////////////////////////////////
+	// The Embree device configuration that matches thread_settings
+	///////////////////////////////////////////////////////////////////////////
+	std::string embreeDeviceConfig();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Number of tracing threads (after initializeThreads())
+	///////////////////////////////////////////////////////////////////////////
+	int threadCount();
+
+	///////////////////////////////////////////////////////////////////////////
+	// The NUMA node that a tracing thread is pinned to, or -1 if threads are
+	// not pinned
+	///////////////////////////////////////////////////////////////////////////
+	int threadNode(int thread);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The logical processors that may be used, one per core first and then
+	// the remaining hardware threads of each core
+	///////////////////////////////////////////////////////////////////////////
+	std::vector<int> logicalProcessors(bool use_hyperthreads);
+}